@@ -0,0 +1,146 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: block_transfer_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 29, 2015
+ *  Time: 09:51:36
+ *  Description: throughput and latency of block server vs SFTP over loopback
+ *****************************************************************************/
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include "block_transfer.h"
+#ifdef BENCH_SFTP
+#include "libssh_wrapper.h"
+#endif
+
+// usage: block_transfer_bench [file size in MiB] [num of random reads] [ssh port]
+// a file of random data is written to /tmp and removed afterwards,
+// it's read sequentially in 128 KiB reads and at random in 4 KiB and 128 KiB reads.
+// Built with make bench SFTP=1, the same reads also go through SSHSession
+// to sshd of this host at ssh port, default 22, which must accept
+// public key of current user. Data isn't compressed in either.
+
+typedef std::function< intmax_t (const size_t offset, const size_t size, char* buff) > Reader;
+
+// reads at offsets, prints throughput and latency of each read
+// returns true on error
+static bool measure(const std::string& name, const Reader& reader,
+                    const std::vector<size_t>& offsets, const size_t read_size) {
+    std::vector<char> buff(read_size);
+    std::vector<double> latencies;
+    latencies.reserve(offsets.size());
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset: offsets) {
+        auto read_start = std::chrono::steady_clock::now();
+        if (reader(offset, read_size, buff.data()) != intmax_t(read_size)) {
+            std::cerr << name << ": short read at " << offset << std::endl;
+            return 1;
+        }
+        latencies.push_back(std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - read_start).count());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << name << " " << (read_size >> 10) << " KiB reads: "
+              << offsets.size() * read_size / seconds / (1 << 20) << " MiB/s, latency "
+              << seconds * 1e6 / offsets.size() << " us mean, "
+              << latencies[latencies.size() / 2] * 1e6 << " us median, "
+              << latencies[latencies.size() * 99 / 100] * 1e6 << " us p99" << std::endl;
+    return 0;
+}
+
+// returns true on error
+static bool run(const std::string& name, const Reader& reader,
+                const size_t file_size, const size_t num_reads) {
+    size_t block_size = 128 << 10;
+
+    std::vector<size_t> offsets;
+    for (size_t offset = 0; offset + block_size <= file_size; offset += block_size)
+        offsets.push_back(offset);
+    if (measure(name + " sequential", reader, offsets, block_size)) return 1;
+
+    for (size_t read_size: { size_t(4) << 10, block_size }) {
+        // same offsets for all readers
+        std::mt19937_64 random(read_size);
+        offsets.resize(num_reads);
+        for (auto& offset: offsets) offset = random() % (file_size - read_size);
+        if (measure(name + " random", reader, offsets, read_size)) return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    size_t file_size = (argc > 1? atol(argv[1]): 256) << 20;
+    size_t num_reads = argc > 2? atol(argv[2]): 10000;
+
+    char name[] = "/tmp/block_transfer_benchXXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    std::mt19937_64 random(0);
+    std::vector<char> data(1 << 20);
+    for (size_t written = 0; written < file_size; written += data.size()) {
+        for (auto& c: data) c = random();
+        if (write(fd, data.data(), data.size()) != ssize_t(data.size())) {
+            perror("write");
+            return 1;
+        }
+    }
+
+    // server reads the file from page cache, so the link and protocol are measured
+    BlockServer server([fd](const std::string&, const size_t offset, const size_t size, 
+                            char* buff, const uint64_t, const uint64_t) -> intmax_t {
+        return pread(fd, buff, size, offset);
+    });
+    if (server.start("127.0.0.1", 0, 4)) {
+        std::cerr << "block server failed to start" << std::endl;
+        return 1;
+    }
+
+    BlockClient client("127.0.0.1", server.port(), 0);
+    bool error = run("block", [&client](const size_t offset, const size_t size, char* buff) {
+        return client.read("file", offset, size, buff);
+    }, file_size, num_reads);
+
+#ifdef BENCH_SFTP
+    uint16_t ssh_port = argc > 3? atoi(argv[3]): 22;
+    auto transport = std::make_shared<SSHTransport>("127.0.0.1", ssh_port);
+    SSHSession session(transport);
+    std::string path = name;
+
+    if (!error && session.connect()) {
+        std::cerr << "SSH connection to port " << ssh_port << " failed" << std::endl;
+        error = 1;
+    }
+    if (!error)
+        error = run("sftp", [&session, &path](const size_t offset, const size_t size, char* buff) {
+            return session.read(path, 0, offset, size, buff);
+        }, file_size, num_reads);
+#endif
+
+    server.stop();
+    close(fd);
+    unlink(name);
+    return error;
+}
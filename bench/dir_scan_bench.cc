@@ -0,0 +1,143 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: dir_scan_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 18:13:40
+ *  Description: recursive boost::filesystem scan vs parallel DirScanner
+ *****************************************************************************/
+#include <chrono>
+#include <string>
+#include <cstdlib>
+#include <iostream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "dir_scanner.h"
+
+// usage: dir_scan_bench [dir] [num of threads]...
+// default numbers of threads are 1, 2, 4 and 8
+// without dir, or with dir "-", a tree of 20 x 50 directories of 250 empty files each
+// is built in /tmp and removed afterwards
+// dir is scanned once before timing, so that its metadata is in memory
+
+// the recursive scan working dir was built with before DirScanner
+static void recursiveScan(const boost::filesystem::path& dir, const DirTree::TreeNode& parent) {
+    using namespace boost::filesystem;
+
+    for (const auto& entry: directory_iterator(dir)) {
+        DirTree::TreeNode node;
+        node.name = entry.path().filename().string();
+        node.mtime = last_write_time(entry.path());
+        node.num_links = hard_link_count(entry.path());
+
+        if (symlink_status(entry).type() == directory_file) {
+            node.type = DirTree::TreeNode::DIRECTORY;
+            recursiveScan(entry, *parent.children.insert(std::move(node)).first);
+        } else {
+            node.type = DirTree::TreeNode::REGULAR;
+            node.size = is_regular_file(entry.status())? file_size(entry.path()): 0;
+            parent.children.insert(std::move(node));
+        }
+    }
+}
+
+static size_t count(const DirTree::TreeNode& node) {
+    size_t n = 1;
+    for (const auto& child: node.children) n += count(child);
+    return n;
+}
+
+// returns true on error
+static bool buildTree(const std::string& dir) {
+    for (size_t i = 0; i < 20; ++i) {
+        std::string top = dir + "/" + std::to_string(i);
+        if (mkdir(top.c_str(), 0755)) return 1;
+
+        for (size_t j = 0; j < 50; ++j) {
+            std::string sub = top + "/" + std::to_string(j);
+            if (mkdir(sub.c_str(), 0755)) return 1;
+
+            for (size_t k = 0; k < 250; ++k) {
+                int fd = open((sub + "/" + std::to_string(k)).c_str(), O_CREAT | O_WRONLY, 0644);
+                if (fd < 0) return 1;
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+template <class Function>
+static double seconds(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string dir = argc > 1? argv[1]: "-";
+    std::vector<size_t> threads;
+    for (int i = 2; i < argc; ++i) threads.push_back(atol(argv[i]));
+    if (threads.empty()) threads = { 1, 2, 4, 8 };
+
+    std::string temp_dir;
+    if (dir == "-") {
+        char name[] = "/tmp/dir_scan_benchXXXXXX";
+        if (!mkdtemp(name)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        dir = temp_dir = name;
+
+        if (buildTree(dir)) {
+            perror("build tree");
+            boost::system::error_code ec;
+            boost::filesystem::remove_all(temp_dir, ec);
+            return 1;
+        }
+    }
+
+    int rtv = 0;
+    try {
+        // warm up
+        DirTree warm;
+        warm.initialize();
+        DirScanner(0, 0, 8).scan(dir, *warm.root());
+
+        DirTree recursive;
+        recursive.initialize();
+        double elapsed = seconds([&]() { recursiveScan(dir, *recursive.root()); });
+        size_t entries = count(*recursive.root()) - 1;
+        std::cout << "recursive: " << entries << " entries, " << elapsed << " s" << std::endl;
+
+        for (size_t num_threads: threads) {
+            DirTree tree;
+            tree.initialize();
+            DirScanner scanner(0, 0, num_threads);
+            elapsed = seconds([&]() { scanner.scan(dir, *tree.root()); });
+
+            std::cout << "scanner, " << num_threads << " threads: " << scanner.entries() 
+                      << " entries, " << scanner.errors() << " errors, " << elapsed << " s, "
+                      << entries / elapsed / 1000 << "k entries/s" << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        rtv = 1;
+    }
+
+    if (temp_dir.size()) {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(temp_dir, ec);
+    }
+
+    return rtv;
+}
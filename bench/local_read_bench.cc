@@ -0,0 +1,105 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: local_read_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 10:42:17
+ *  Description: reads of a local file with ifstream per read vs cached pread
+ *****************************************************************************/
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "local_file.h"
+
+// usage: local_read_bench [file size in MiB] [num of reads]
+// a file of random data is written to /tmp and removed afterwards
+
+// what reading a local file did before LocalFileCache
+static intmax_t ifstreamRead(const std::string& path, const size_t offset,
+                             const size_t size, char* buff) {
+    std::ifstream fin(path);
+    fin.seekg(offset);
+    fin.read(buff, size);
+    if (fin.bad()) return -1;
+    return fin.gcount();
+}
+
+static intmax_t cachedRead(LocalFileCache& files, const std::string& path,
+                           const size_t offset, const size_t size, char* buff) {
+    LocalFileCache::File file = files.open(path);
+    if (!file) return -1;
+    return file->read(offset, size, buff);
+}
+
+int main(int argc, char** argv) {
+    size_t file_size = (argc > 1? atol(argv[1]): 64) << 20;
+    size_t num_reads = argc > 2? atol(argv[2]): 100000;
+
+    char name[] = "/tmp/local_read_benchXXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    std::mt19937_64 random(0);
+    std::vector<char> data(1 << 20);
+    for (size_t written = 0; written < file_size; written += data.size()) {
+        for (auto& c: data) c = random();
+        if (write(fd, data.data(), data.size()) != ssize_t(data.size())) {
+            perror("write");
+            return 1;
+        }
+    }
+    close(fd);
+
+    std::string path = name;
+    LocalFileCache files;
+    std::vector<char> buff(128 << 10);
+
+    for (size_t read_size: { size_t(4) << 10, size_t(128) << 10 }) {
+        // same offsets for both, page cache is warm after the first pass
+        std::vector<size_t> offsets(num_reads);
+        for (auto& offset: offsets) offset = random() % (file_size - read_size);
+
+        for (int cached = 0; cached < 2; ++cached) {
+            auto start = std::chrono::steady_clock::now();
+            size_t total = 0;
+
+            for (int pass = 0; pass < 2; ++pass) {
+                if (pass) start = std::chrono::steady_clock::now(), total = 0;
+
+                for (size_t offset: offsets) {
+                    intmax_t rtv = cached? cachedRead(files, path, offset, read_size, buff.data()):
+                                           ifstreamRead(path, offset, read_size, buff.data());
+                    if (rtv != intmax_t(read_size)) {
+                        std::cerr << "short read at " << offset << std::endl;
+                        return 1;
+                    }
+                    total += rtv;
+                }
+            }
+
+            double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start).count();
+            std::cout << (cached? "pread   ": "ifstream") << " "
+                      << (read_size >> 10) << " KiB reads: "
+                      << seconds * 1e9 / num_reads << " ns/read, "
+                      << total / seconds / (1 << 20) << " MiB/s" << std::endl;
+        }
+    }
+
+    unlink(name);
+}
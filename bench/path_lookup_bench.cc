@@ -0,0 +1,89 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: path_lookup_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 20:02:29
+ *  Description: dir tree lookups walking down from root vs through path index
+ *****************************************************************************/
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include "dir_tree.h"
+
+// usage: path_lookup_bench [files per directory]
+// trees are a chain of 4, 8 or 16 directories, each holding files and the next one,
+// every node is looked up 5 times in random order
+
+template <class Function>
+static double seconds(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    size_t num_files = argc > 1? atol(argv[1]): 2000;
+    const size_t repeats = 5;
+    std::mt19937_64 random(0);
+
+    for (size_t depth: { 4, 8, 16 }) {
+        DirTree tree;
+        tree.initialize();
+        tree.root()->type = DirTree::TreeNode::DIRECTORY;
+
+        std::vector<std::string> paths;
+        const DirTree::TreeNode* dir = tree.root();
+        std::string dir_path;
+
+        for (size_t level = 0; level < depth; ++level) {
+            for (size_t i = 0; i < num_files; ++i) {
+                DirTree::TreeNode file;
+                file.name = "file_number_" + std::to_string(i);
+                file.type = DirTree::TreeNode::REGULAR;
+                paths.push_back(dir_path + "/" + file.name.string());
+                dir->children.insert(std::move(file));
+            }
+
+            DirTree::TreeNode sub;
+            sub.name = "directory_level_" + std::to_string(level);
+            sub.type = DirTree::TreeNode::DIRECTORY;
+            dir_path += "/" + sub.name.string();
+            paths.push_back(dir_path);
+            dir = &*dir->children.insert(std::move(sub)).first;
+        }
+
+        std::shuffle(paths.begin(), paths.end(), random);
+
+        // find walks down from root until tree is indexed
+        auto lookups = [&]() {
+            size_t found = 0;
+            for (size_t i = 0; i < repeats; ++i)
+                for (const auto& path: paths) found += tree.find(path) != nullptr;
+            if (found != repeats * paths.size()) {
+                std::cerr << "lookups failed" << std::endl;
+                exit(1);
+            }
+        };
+
+        double walk = seconds(lookups);
+        double reindex = seconds([&]() { tree.reindex(); });
+        double index = seconds(lookups);
+
+        size_t num_lookups = repeats * paths.size();
+        std::cout << "depth " << depth << ", " << paths.size() << " nodes: "
+                  << "walk " << walk * 1e9 / num_lookups << " ns, "
+                  << "index " << index * 1e9 / num_lookups << " ns, "
+                  << "reindex " << reindex * 1e3 << " ms" << std::endl;
+    }
+}
@@ -0,0 +1,158 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: tree_serialize_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 16:47:03
+ *  Description: size and speed of dir tree serialization
+ *****************************************************************************/
+#include <set>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <cstdlib>
+#include <iostream>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/serialization/set.hpp>
+#include <boost/serialization/string.hpp>
+#include "dir_tree.h"
+
+// usage: tree_serialize_bench [num of nodes]
+// a tree like a dataset is built: 20 dirs of 50 dirs of 50 dirs of files
+// it's serialized as a Boost text archive like GSFS did before the binary format,
+// then in the binary format at each zlib level
+
+// a node as it was serialized in text archives, uid, gid, atime and ctime 
+// were never set then, here they're 0, which takes fewer digits than garbage did
+struct TextNode {
+    template <class Archive>
+    void serialize(Archive& ar, const unsigned int /* version */) {
+        ar & type;
+        ar & size;
+        ar & uid;
+        ar & gid;
+        ar & atime;
+        ar & mtime;
+        ar & ctime;
+        ar & host_id;
+        ar & num_links;
+        ar & name;
+        ar & children;
+    }
+
+    bool operator<(const TextNode& node) const { return name < node.name; }
+
+    DirTree::TreeNode::FileType type;
+    size_t size, uid, gid, atime, mtime, ctime;
+    uint64_t host_id;
+    size_t num_links;
+    std::string name;
+    std::set<TextNode> children;
+};
+
+static TextNode textNode(const DirTree::TreeNode& node) {
+    TextNode text{ node.type, node.size, 0, 0, 0, node.mtime, 0, node.host_id, node.num_links,
+                   node.name.string(), std::set<TextNode>() };
+    for (const auto& child: node.children) text.children.insert(textNode(child));
+    return text;
+}
+
+static size_t count(const TextNode& node) {
+    size_t n = 1;
+    for (const auto& child: node.children) n += count(child);
+    return n;
+}
+
+static void build(const DirTree::TreeNode& parent, const int depth, size_t& n, const size_t limit) {
+    size_t width = depth == 0? 20: depth < 3? 50: 40;
+    for (size_t i = 0; i < width && n < limit; ++i) {
+        DirTree::TreeNode node;
+        node.name = depth < 3? "dir_" + std::to_string(i): "file_name_" + std::to_string(i) + ".jpg";
+        node.type = depth < 3? DirTree::TreeNode::DIRECTORY: DirTree::TreeNode::REGULAR;
+        node.size = 123456 + n;
+        node.mtime = 1436000000 + n % 1000;
+        node.host_id = 2 + n % 3;
+        node.num_links = 1;
+        ++n;
+
+        auto ite = parent.children.insert(std::move(node)).first;
+        if (depth < 3) build(*ite, depth + 1, n, limit);
+    }
+}
+
+static size_t count(const DirTree::TreeNode& node) {
+    size_t n = 1;
+    for (const auto& child: node.children) n += count(child);
+    return n;
+}
+
+template <class Function>
+static double seconds(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    size_t limit = argc > 1? atol(argv[1]): 2000000;
+
+    DirTree tree;
+    tree.initialize();
+    tree.root()->type = DirTree::TreeNode::DIRECTORY;
+
+    size_t num_nodes = 0;
+    build(*tree.root(), 0, num_nodes, limit);
+    std::cout << "nodes " << num_nodes << std::endl;
+
+    {
+        TextNode root = textNode(*tree.root());
+
+        std::string text;
+        double encode = seconds([&]() {
+            std::ostringstream os;
+            boost::archive::text_oarchive oa(os);
+            oa << root;
+            text = os.str();
+        });
+
+        TextNode decoded;
+        double decode = seconds([&]() {
+            std::istringstream is(text);
+            boost::archive::text_iarchive ia(is);
+            ia >> decoded;
+        });
+
+        if (count(decoded) != num_nodes + 1) {
+            std::cerr << "text archive: decoded tree differs" << std::endl;
+            return 1;
+        }
+
+        std::cout << "text archive: " << text.size() << " bytes, "
+                  << double(text.size()) / num_nodes << " bytes/node, "
+                  << "encode " << encode << " s, decode " << decode << " s" << std::endl;
+    }
+
+    for (int level: { 0, 1, 6 }) {
+        std::string bytes;
+        double encode = seconds([&]() { bytes = DirTree::serialize(tree, level); });
+
+        DirTree decoded;
+        double decode = seconds([&]() { decoded = DirTree::deserialize(bytes); });
+
+        if (count(*decoded.root()) != num_nodes + 1 || DirTree::serialize(decoded, level) != bytes) {
+            std::cerr << "level " << level << ": decoded tree differs" << std::endl;
+            return 1;
+        }
+
+        std::cout << "level " << level << ": " << bytes.size() << " bytes, "
+                  << double(bytes.size()) / num_nodes << " bytes/node, "
+                  << "encode " << encode << " s, decode " << decode << " s" << std::endl;
+    }
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: binary_codec.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 20, 2015
+ *  Time: 16:41:02
+ *  Description: varints and length-prefixed strings for binary formats
+ *****************************************************************************/
+#ifndef BINARY_CODEC_H_
+#define BINARY_CODEC_H_
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+// Appends to a string. Integers are written as little-endian base 128 varints,
+// so small ones take one byte.
+class BinaryWriter {
+public:
+    BinaryWriter(std::string& out): _out(out) { }
+
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            _out.push_back(char(value | 0x80));
+            value >>= 7;
+        }
+        _out.push_back(char(value));
+    }
+
+    // length, then bytes
+    void string(const std::string& str) {
+        varint(str.size());
+        _out.append(str);
+    }
+
+    void bytes(const char* data, const size_t size) { _out.append(data, size); }
+
+private:
+    std::string& _out;
+};
+
+// Reads what BinaryWriter wrote.
+// Throws std::runtime_error if data is truncated or malformed.
+class BinaryReader {
+public:
+    BinaryReader(const char* data, const size_t size): _pos(data), _end(data + size) { }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (_pos == _end) fail();
+            uint8_t byte = *_pos++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        fail();
+        return 0;
+    }
+
+    std::string string() {
+        size_t size = varint();
+        return std::string(bytes(size), size);
+    }
+
+    // returns pointer to next size bytes, and skips them
+    const char* bytes(const size_t size) {
+        if (size > remaining()) fail();
+        const char* data = _pos;
+        _pos += size;
+        return data;
+    }
+
+    size_t remaining() const { return _end - _pos; }
+
+private:
+    static void fail() { throw std::runtime_error("Malformed binary data. "); }
+
+    const char* _pos;
+    const char* _end;
+};
+
+#endif /* BINARY_CODEC_H_ */
@@ -0,0 +1,181 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: block_cache.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 22, 2015
+ *  Time: 11:12:48
+ *  Description: in-memory LRU cache of remote file blocks
+ *****************************************************************************/
+#include "block_cache.h"
+#include <iterator>
+
+const size_t BlockCache::block_size;
+const size_t BlockCache::num_shards;
+const size_t BlockCache::min_capacity;
+
+// returns nullptr if not found
+BlockCache::Block BlockCache::get(const std::string& file, 
+                                  const size_t mtime, const size_t file_size, const size_t index) {
+    Key key{ file, index };
+    Shard& s = shard(key);
+
+    boost::unique_lock< boost::mutex > lock(s.mutex);
+
+    auto ite = s.index.find(key);
+    if (ite == s.index.end()) {
+        ++_misses;
+        return nullptr;
+    }
+
+    auto entry = ite->second;
+
+    // file has changed since this block was read
+    if (entry->mtime != mtime || entry->file_size != file_size) {
+        s.erase(entry);
+        ++_misses;
+        return nullptr;
+    }
+
+    // move to front
+    if (!entry->pinned)
+        s.entries.splice(s.entries.begin(), s.entries, entry);
+    ++_hits;
+
+    return entry->block;
+}
+
+// returns true if found, without counting it as a hit or touching LRU
+bool BlockCache::contains(const std::string& file, 
+                          const size_t mtime, const size_t file_size, const size_t index) const {
+    Key key{ file, index };
+    const Shard& s = shard(key);
+
+    boost::unique_lock< boost::mutex > lock(s.mutex);
+
+    auto ite = s.index.find(key);
+    return ite != s.index.end() && 
+           ite->second->mtime == mtime && ite->second->file_size == file_size;
+}
+
+void BlockCache::put(const std::string& file, 
+                     const size_t mtime, const size_t file_size, const size_t index,
+                     const Block& block) {
+    size_t shard_capacity = _capacity / num_shards;
+    if (block->size() > shard_capacity) return;
+
+    bool pinned = isPinned(file);
+
+    Key key{ file, index };
+    Shard& s = shard(key);
+
+    boost::unique_lock< boost::mutex > lock(s.mutex);
+
+    // replace old one
+    auto ite = s.index.find(key);
+    if (ite != s.index.end()) 
+        s.erase(ite->second);
+
+    // evict least recently used
+    while (s.bytes + block->size() > shard_capacity && s.entries.size()) 
+        s.erase(std::prev(s.entries.end()));
+
+    // the rest is pinned
+    if (s.bytes + block->size() > shard_capacity) return;
+
+    std::list<Entry>& list = pinned? s.pinned: s.entries;
+    list.push_front(Entry{ key, mtime, file_size, block, pinned });
+    s.index.emplace(key, list.begin());
+    s.bytes += block->size();
+    if (pinned) s.pinned_bytes += block->size();
+}
+
+// blocks of this file cached from now on are pinned or not
+// so are those already cached
+void BlockCache::pin(const std::string& file, const size_t file_size, const bool pinned) {
+    {
+        boost::unique_lock< boost::shared_mutex > lock(_pins_mutex);
+        if (pinned) 
+            _pinned_files.insert(file);
+        else 
+            _pinned_files.erase(file);
+        _num_pinned = _pinned_files.size();
+    }
+
+    for (size_t index = 0; index * block_size < file_size; ++index) {
+        Key key{ file, index };
+        Shard& s = shard(key);
+
+        boost::unique_lock< boost::mutex > lock(s.mutex);
+
+        auto ite = s.index.find(key);
+        if (ite == s.index.end() || ite->second->pinned == pinned) continue;
+
+        auto entry = ite->second;
+        entry->pinned = pinned;
+        if (pinned) {
+            s.pinned.splice(s.pinned.begin(), s.entries, entry);
+            s.pinned_bytes += entry->block->size();
+        } else {
+            s.entries.splice(s.entries.begin(), s.pinned, entry);
+            s.pinned_bytes -= entry->block->size();
+        }
+    }
+}
+
+// drop all blocks of this file, pinned or not
+void BlockCache::evict(const std::string& file, const size_t file_size) {
+    for (size_t index = 0; index * block_size < file_size; ++index) {
+        Key key{ file, index };
+        Shard& s = shard(key);
+
+        boost::unique_lock< boost::mutex > lock(s.mutex);
+
+        auto ite = s.index.find(key);
+        if (ite != s.index.end()) s.erase(ite->second);
+    }
+}
+
+// should be called with mutex held
+void BlockCache::Shard::erase(const std::list<Entry>::iterator entry) {
+    bytes -= entry->block->size();
+    index.erase(entry->key);
+
+    if (entry->pinned) {
+        pinned_bytes -= entry->block->size();
+        pinned.erase(entry);
+    } else {
+        entries.erase(entry);
+    }
+}
+
+bool BlockCache::isPinned(const std::string& file) const {
+    if (!_num_pinned) return 0;
+
+    boost::shared_lock< boost::shared_mutex > lock(_pins_mutex);
+    return _pinned_files.count(file);
+}
+
+void BlockCache::printStats(std::ostream& os) const {
+    size_t blocks = 0;
+    size_t bytes = 0;
+    size_t pinned_bytes = 0;
+
+    for (auto& s: _shards) {
+        boost::unique_lock< boost::mutex > lock(s.mutex);
+        blocks += s.entries.size() + s.pinned.size();
+        bytes += s.bytes;
+        pinned_bytes += s.pinned_bytes;
+    }
+
+    os << "memory: blocks " << blocks
+       << ", bytes " << bytes << "/" << _capacity
+       << ", pinned " << pinned_bytes
+       << ", hits " << _hits
+       << ", misses " << _misses << "\n";
+}
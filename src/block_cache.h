@@ -0,0 +1,134 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: block_cache.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 22, 2015
+ *  Time: 10:37:05
+ *  Description: in-memory LRU cache of remote file blocks
+ *****************************************************************************/
+#ifndef BLOCK_CACHE_H_
+#define BLOCK_CACHE_H_
+
+#include <list>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+// All member functions are thread-safe.
+// Files are cut into blocks of block_size bytes, a block is keyed by 
+// (key of file, block index). Each block remembers mtime and size of 
+// the file it was read from, a lookup with different ones drops it.
+// Blocks are spread over shards by key, each shard has its own lock and LRU list.
+// Blocks of pinned files are kept out of LRU list and never evicted, 
+// though they still count against memory budget.
+class BlockCache {
+public:
+    typedef std::shared_ptr<const std::string> Block;
+
+    static const size_t block_size = 128 * 1024;
+    static const size_t num_shards = 16;
+    // each shard gets an equal part of budget and must hold at least one block
+    static const size_t min_capacity = num_shards * block_size;
+
+    BlockCache(): _capacity(0), _num_pinned(0), _hits(0), _misses(0) { }
+
+    // memory budget in bytes, 0 disables this cache, else at least min_capacity
+    // should be called before any get or put
+    void setCapacity(const size_t capacity) { _capacity = capacity; }
+
+    bool enabled() const { return _capacity; }
+
+    // returns nullptr if not found
+    Block get(const std::string& file, 
+              const size_t mtime, const size_t file_size, const size_t index);
+
+    // returns true if found, without counting it as a hit or touching LRU
+    bool contains(const std::string& file, 
+                  const size_t mtime, const size_t file_size, const size_t index) const;
+
+    void put(const std::string& file, 
+             const size_t mtime, const size_t file_size, const size_t index,
+             const Block& block);
+
+    // blocks of this file cached from now on are pinned or not
+    // so are those already cached
+    void pin(const std::string& file, const size_t file_size, const bool pinned);
+
+    // drop all blocks of this file, pinned or not
+    void evict(const std::string& file, const size_t file_size);
+
+    void printStats(std::ostream& os) const;
+
+private:
+    struct Key {
+        std::string file;
+        size_t index;
+
+        bool operator==(const Key& key) const {
+            return index == key.index && file == key.file;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            size_t seed = std::hash<std::string>()(key.file);
+            seed ^= key.index + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            return seed;
+        }
+    };
+
+    struct Entry {
+        Key key;
+        size_t mtime;
+        size_t file_size;
+        Block block;
+        bool pinned;
+    };
+
+    struct Shard {
+        Shard(): bytes(0), pinned_bytes(0) { }
+
+        // should be called with mutex held
+        void erase(const std::list<Entry>::iterator entry);
+
+        mutable boost::mutex mutex;
+        // most recently used at front
+        std::list<Entry> entries;
+        // not evicted, in no order
+        std::list<Entry> pinned;
+        std::unordered_map< Key, std::list<Entry>::iterator, KeyHash > index;
+        // bytes of all entries, and of pinned ones
+        size_t bytes;
+        size_t pinned_bytes;
+    };
+
+    bool isPinned(const std::string& file) const;
+
+    Shard& shard(const Key& key) { return _shards[KeyHash()(key) % num_shards]; }
+    const Shard& shard(const Key& key) const { return _shards[KeyHash()(key) % num_shards]; }
+
+    size_t _capacity;
+    Shard _shards[num_shards];
+
+    // keys of pinned files
+    mutable boost::shared_mutex _pins_mutex;
+    std::unordered_set<std::string> _pinned_files;
+    // size of _pinned_files, so that puts don't lock it if nothing is pinned
+    std::atomic<size_t> _num_pinned;
+
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+};
+
+#endif /* BLOCK_CACHE_H_ */
@@ -0,0 +1,362 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: block_transfer.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul  3, 2015
+ *  Time: 20:31:05
+ *  Description: native block transfer between GSFS nodes
+ *****************************************************************************/
+#include "block_transfer.h"
+#include <cerrno>
+#include <iostream>
+#include "bytes_order.h"
+
+const size_t BlockServer::max_length;
+const size_t BlockServer::max_path;
+const size_t BlockClient::chunk_size;
+const uint64_t BlockClient::unchecked;
+
+// One client connection. Handlers of a connection run in its strand,
+// so the io_service can be run by many threads.
+class BlockServer::Connection: public std::enable_shared_from_this<Connection> {
+public:
+    Connection(boost::asio::io_service& io_service, boost::asio::ip::tcp::socket socket, 
+               const Reader& reader):
+        _socket(std::move(socket)), _strand(io_service), _reader(reader) { }
+
+    void start() { do_read_header(); }
+
+private:
+    void do_read_header() {
+        auto self(shared_from_this());
+        boost::asio::async_read(_socket, boost::asio::buffer(_header, sizeof(_header)),
+        _strand.wrap([this, self](boost::system::error_code ec, std::size_t) {
+            if (ec) return close();
+
+            uint64_t length = network_to_host_64(_header);
+            // request id, offset, length, compression level, mtime, file size and a path
+            if (length <= 48 || length > 48 + max_path) return close();
+
+            do_read_body(length);
+        }));
+    }
+
+    void do_read_body(const size_t length) {
+        auto self(shared_from_this());
+        _body.resize(length);
+        boost::asio::async_read(_socket, boost::asio::buffer(&_body[0], length),
+        _strand.wrap([this, self](boost::system::error_code ec, std::size_t) {
+            if (ec) return close();
+
+            respond();
+            do_read_header();
+        }));
+    }
+
+    void respond() {
+        uint64_t id = network_to_host_64(&_body[0]);
+        uint64_t offset = network_to_host_64(&_body[8]);
+        uint64_t length = network_to_host_64(&_body[16]);
+        uint64_t level = network_to_host_64(&_body[24]);
+        uint64_t mtime = network_to_host_64(&_body[32]);
+        uint64_t file_size = network_to_host_64(&_body[40]);
+        std::string path(&_body[48], _body.size() - 48);
+
+        // reserve room for message length, request id, status and encoding
+        const size_t header_length = 32;
+        std::shared_ptr<std::string> response(new std::string(header_length, 0x00));
+        uint64_t status = 0;
+        uint64_t encoding = 0;
+
+        if (length > max_length) {
+            status = EINVAL;
+        } else {
+            response->resize(header_length + length);
+            intmax_t rtv = _reader(path, offset, length, &(*response)[header_length], 
+                                   mtime, file_size);
+            if (rtv < 0) status = rtv == -ESTALE? ESTALE: EIO, rtv = 0;
+            response->resize(header_length + rtv);
+
+            if (level > 0 && level <= 9 && 
+                Compression::compress(&(*response)[header_length], rtv, level, _compressed)) {
+                response->replace(header_length, std::string::npos, _compressed);
+                encoding = 1;
+            }
+        }
+
+        uint64_t message_length = response->size() - 8;
+        host_to_network_64(&(*response)[0], &message_length);
+        host_to_network_64(&(*response)[8], &id);
+        host_to_network_64(&(*response)[16], &status);
+        host_to_network_64(&(*response)[24], &encoding);
+
+        bool write_in_progress = _write_queue.size();
+        _write_queue.push(response);
+        if (!write_in_progress) do_write();
+    }
+
+    void do_write() {
+        auto self(shared_from_this());
+        boost::asio::async_write(_socket, 
+            boost::asio::buffer(_write_queue.front()->data(), _write_queue.front()->size()),
+        _strand.wrap([this, self](boost::system::error_code ec, std::size_t) {
+            if (ec) return close();
+
+            _write_queue.pop();
+            if (!_write_queue.empty()) do_write();
+        }));
+    }
+
+    void close() {
+        boost::system::error_code ec;
+        _socket.close(ec);
+    }
+
+    boost::asio::ip::tcp::socket _socket;
+    boost::asio::io_service::strand _strand;
+    const Reader& _reader;
+
+    char _header[8];
+    std::vector<char> _body;
+    std::string _compressed;
+    std::queue< std::shared_ptr<std::string> > _write_queue;
+};
+
+// returns true on error
+bool BlockServer::start(const std::string& addr, const uint16_t port, const size_t num_threads) {
+    using boost::asio::ip::tcp;
+    boost::system::error_code ec;
+
+    // slaves only know the address of master, so listen at any address
+    boost::asio::ip::address address = boost::asio::ip::address::from_string(addr, ec);
+    tcp::endpoint endpoint(!ec && address.is_v6()? tcp::v6(): tcp::v4(), port);
+    ec.clear();
+
+    _acceptor.open(endpoint.protocol(), ec);
+    if (!ec)
+        _acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+    if (!ec)
+        _acceptor.bind(endpoint, ec);
+    if (!ec)
+        _acceptor.listen(boost::asio::socket_base::max_connections, ec);
+
+    if (ec) return 1;
+
+    do_accept();
+
+    for (size_t i = 0; i < num_threads; ++i)
+        _threads.emplace_back([this]() { _io_service.run(); });
+
+    return 0;
+}
+
+void BlockServer::stop() {
+    _io_service.stop();
+    for (auto& t: _threads) t.join();
+    _threads.clear();
+}
+
+// port it listens at, a free one is chosen if it's started with port 0
+uint16_t BlockServer::port() const {
+    boost::system::error_code ec;
+    return _acceptor.local_endpoint(ec).port();
+}
+
+void BlockServer::do_accept() {
+    _acceptor.async_accept(_socket,
+    [this](boost::system::error_code ec) {
+        if (!ec) {
+            boost::system::error_code ignored;
+            _socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+            std::make_shared<Connection>(_io_service, std::move(_socket), _reader)->start();
+        }
+
+        do_accept();
+    });
+}
+
+intmax_t BlockClient::read(const std::string& path, const size_t offset, const size_t size, char* buff,
+                          const uint64_t mtime, const uint64_t file_size) {
+    size_t num_requests = size? (size - 1) / chunk_size + 1: 1;
+    std::vector<Pending> pending(num_requests);
+    std::string message;
+
+    {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        if (!_connected && connect()) return -1;
+
+        int level = _link.level();
+
+        for (size_t i = 0; i < num_requests; ++i) {
+            size_t chunk_offset = i * chunk_size;
+            pending[i] = { buff + chunk_offset, std::min(chunk_size, size - chunk_offset), -1, 0, 0 };
+
+            uint64_t id = _next_id++;
+            _pending[id] = &pending[i];
+
+            message += host_to_network_64(48 + path.length());
+            message += host_to_network_64(id);
+            message += host_to_network_64(offset + chunk_offset);
+            message += host_to_network_64(pending[i].size);
+            message += host_to_network_64(level);
+            message += host_to_network_64(mtime);
+            message += host_to_network_64(file_size);
+            message += path;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        boost::unique_lock<boost::mutex> lock(_write_mutex);
+        boost::system::error_code ec;
+        boost::asio::write(_socket, boost::asio::buffer(message), ec);
+        // receiving thread fails all pending requests when connection is shut down
+        if (ec) _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    }
+
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    for (const auto& p: pending) 
+        while (!p.done) _done.wait(lock);
+    lock.unlock();
+
+    // a short chunk means end of file
+    intmax_t bytes = 0;
+    size_t wire_bytes = 0;
+    for (const auto& p: pending) {
+        if (p.result < 0) return p.result == -ESTALE? -ESTALE: -1;
+        bytes += p.result;
+        wire_bytes += p.wire_bytes;
+        if (size_t(p.result) < p.size) break;
+    }
+
+    _link.record(wire_bytes, std::chrono::steady_clock::now() - start);
+
+    ++_requests;
+    _bytes += bytes;
+    _wire_bytes += wire_bytes;
+
+    return bytes;
+}
+
+// should be called with _mutex held
+// returns true on error
+bool BlockClient::connect() {
+    using boost::asio::ip::tcp;
+
+    // receiving thread of last connection has failed all requests and exited
+    if (_receiver.joinable()) _receiver.join();
+
+    // no reader is writing while the socket is reopened
+    boost::unique_lock<boost::mutex> lock(_write_mutex);
+
+    boost::system::error_code ec;
+    tcp::resolver resolver(_io_service);
+    auto endpoint_iterator = resolver.resolve({ _address, std::to_string(_port) }, ec);
+    if (!ec) {
+        _socket.close(ec);
+        boost::asio::connect(_socket, endpoint_iterator, ec);
+    }
+    if (!ec) 
+        _socket.set_option(tcp::no_delay(true), ec);
+    if (ec) {
+        _socket.close(ec);
+        return 1;
+    }
+
+    _connected = 1;
+    _receiver = std::thread(&BlockClient::receive, this);
+    return 0;
+}
+
+void BlockClient::disconnect() {
+    {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        boost::system::error_code ec;
+        if (_connected) _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    }
+    if (_receiver.joinable()) _receiver.join();
+}
+
+void BlockClient::receive() {
+    char header[32];
+    std::vector<char> scratch;
+
+    for (;;) {
+        boost::system::error_code ec;
+        boost::asio::read(_socket, boost::asio::buffer(header, sizeof(header)), ec);
+        if (ec) break;
+
+        uint64_t length = network_to_host_64(header);
+        uint64_t id = network_to_host_64(header + 8);
+        uint64_t status = network_to_host_64(header + 16);
+        uint64_t encoding = network_to_host_64(header + 24);
+        if (length < 24) break;
+        size_t data_length = length - 24;
+
+        Pending* p = nullptr;
+        {
+            boost::unique_lock<boost::mutex> lock(_mutex);
+            auto ite = _pending.find(id);
+            if (ite != _pending.end()) p = ite->second;
+        }
+
+        // the reader waits until done, so its buffer can be filled without lock
+        intmax_t result = status == ESTALE? -ESTALE: -1;
+        if (p && !status && !encoding && data_length <= p->size) {
+            boost::asio::read(_socket, boost::asio::buffer(p->buff, data_length), ec);
+            result = data_length;
+        } else {
+            scratch.resize(data_length);
+            boost::asio::read(_socket, boost::asio::buffer(scratch), ec);
+            if (p && !status && encoding == 1)
+                result = Compression::decompress(scratch.data(), data_length, p->buff, p->size);
+        }
+        if (ec) break;
+
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        if (p) {
+            p->result = result;
+            p->wire_bytes = data_length;
+            p->done = 1;
+            _pending.erase(id);
+            _done.notify_all();
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    boost::unique_lock<boost::mutex> write_lock(_write_mutex);
+    boost::system::error_code ec;
+    _socket.close(ec);
+    _connected = 0;
+    fail();
+}
+
+// should be called with _mutex held
+void BlockClient::fail() {
+    for (auto& p: _pending) {
+        p.second->result = -1;
+        p.second->done = 1;
+    }
+    _pending.clear();
+    _done.notify_all();
+}
+
+void BlockClient::printStats(std::ostream& os) const {
+    uint64_t bytes = _bytes;
+    uint64_t wire_bytes = _wire_bytes;
+
+    os << _address << ":" << _port << " native: "
+       << "requests " << _requests << ", "
+       << "bytes " << bytes << ", "
+       << "wire bytes " << wire_bytes << ", "
+       << "compression ratio " << (wire_bytes? double(bytes) / wire_bytes: 1.0) << ", "
+       << "level " << _link.level() << ", "
+       << "throughput " << uint64_t(_link.throughput() / 1024) << " KiB/s" << std::endl;
+}
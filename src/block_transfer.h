@@ -0,0 +1,178 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: block_transfer.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul  3, 2015
+ *  Time: 19:46:12
+ *  Description: native block transfer between GSFS nodes, 
+ *               an alternative to SFTP on trusted networks
+ *****************************************************************************/
+#ifndef BLOCK_TRANSFER_H_
+#define BLOCK_TRANSFER_H_
+
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <ostream>
+#include <functional>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "compression.h"
+
+/* 
+   protocol:
+   
+   Each message is framed like Packet
+   |   8 bytes   | message length |
+   |   length    |    message     |
+
+   request, client sends to server:
+   |  8 bytes   | 8 bytes |  8 bytes  |     8 bytes       | 8 bytes |  8 bytes  | message length - 48 bytes |
+   | request id | offset  |  length   | compression level |  mtime  | file size |   path in dir tree        |
+
+   response, server sends to client:
+   |  8 bytes   | 8 bytes |  8 bytes  | message length - 24 bytes |
+   | request id | status  | encoding  |       file data           |
+
+   status: 0 -- success, others -- errno
+   compression level: zlib level the client wants, 0 -- not compressed
+   mtime, file size: the file must still have them after it's read, 
+                     otherwise status is ESTALE, not checked if mtime is all ones
+   encoding: 0 -- raw, 1 -- zlib, 
+             data that doesn't compress is sent raw whatever level is requested
+
+   A client may send many requests without waiting for responses, 
+   the server answers them in order.
+*/
+
+// Serves files of this host to other nodes.
+class BlockServer {
+public:
+    // reads [offset, offset + size) of a file of this host into buff, 
+    // path is the path in dir tree. Unless mtime is BlockClient::unchecked,
+    // the file should still have mtime and file_size after it's read.
+    // returns num of bytes read, -ESTALE if the file doesn't, or < 0 on other errors
+    typedef std::function< intmax_t (const std::string& path, const size_t offset, 
+                                     const size_t size, char* buff,
+                                     const uint64_t mtime, const uint64_t file_size) > Reader;
+
+    BlockServer(const Reader& reader): 
+        _acceptor(_io_service), _socket(_io_service), _reader(reader) { }
+    ~BlockServer() { stop(); }
+
+    // listen at port of any address of the same family as addr
+    // returns true on error
+    bool start(const std::string& addr, const uint16_t port, const size_t num_threads);
+
+    void stop();
+
+    // port it listens at, a free one is chosen if it's started with port 0
+    uint16_t port() const;
+
+    // max length of a request
+    static const size_t max_length = 4 * 1024 * 1024;
+    // max length of a path
+    static const size_t max_path = 64 * 1024;
+
+private:
+    class Connection;
+
+    void do_accept();
+
+    boost::asio::io_service _io_service;
+    boost::asio::ip::tcp::acceptor _acceptor;
+    boost::asio::ip::tcp::socket _socket;
+    std::vector<std::thread> _threads;
+
+    Reader _reader;
+};
+
+// All member functions are thread-safe.
+// A connection to one node's block server, shared by all readers of that node.
+// Requests of all readers are pipelined on the connection.
+class BlockClient {
+public:
+    // compression is a zlib level or Compression::automatic
+    BlockClient(const std::string& addr, const uint16_t port, const int compression):
+        _address(addr), _port(port), _socket(_io_service), _connected(0), _next_id(0),
+        _link(compression), _requests(0), _bytes(0), _wire_bytes(0) { }
+    ~BlockClient() { disconnect(); }
+
+    // path is the path in dir tree of that node
+    // a big read is split into requests of chunk_size sent at once
+    // unless mtime is unchecked, the file should still have mtime and file_size 
+    // on that node after it's read
+    // returns num of bytes read on success
+    // returns -ESTALE if the file doesn't, < 0 on other errors
+    intmax_t read(const std::string& path, const size_t offset, const size_t size, char* buff,
+                  const uint64_t mtime = unchecked, const uint64_t file_size = 0);
+
+    // bytes per second on the wire, 0 if not measured
+    double throughput() const { return _link.throughput(); }
+
+    void printStats(std::ostream& os) const;
+
+    static const size_t chunk_size = 256 * 1024;
+    // mtime of a read whose file isn't checked
+    static const uint64_t unchecked = uint64_t(-1);
+
+private:
+    struct Pending {
+        char* buff;
+        size_t size;
+        intmax_t result;
+        // bytes received on the wire
+        size_t wire_bytes;
+        bool done;
+    };
+
+    // should be called with _mutex held
+    // returns true on error
+    bool connect();
+
+    void disconnect();
+
+    // receiving thread
+    void receive();
+
+    // should be called with _mutex held
+    void fail();
+
+    std::string _address;
+    uint16_t _port;
+
+    boost::asio::io_service _io_service;
+    boost::asio::ip::tcp::socket _socket;
+    std::thread _receiver;
+
+    // lock for all below
+    boost::mutex _mutex;
+    boost::condition_variable _done;
+    bool _connected;
+    uint64_t _next_id;
+    std::unordered_map<uint64_t, Pending*> _pending;
+
+    // requests of one reader are written at once
+    // lock order: _mutex before _write_mutex
+    boost::mutex _write_mutex;
+
+    LinkMeter _link;
+
+    std::atomic<uint64_t> _requests;
+    // file data read
+    std::atomic<uint64_t> _bytes;
+    // file data received on the wire, may be compressed
+    std::atomic<uint64_t> _wire_bytes;
+};
+
+#endif /* BLOCK_TRANSFER_H_ */
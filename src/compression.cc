@@ -0,0 +1,140 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: compression.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul  6, 2015
+ *  Time: 10:40:19
+ *  Description: compression of file data sent between nodes
+ *****************************************************************************/
+#include "compression.h"
+#include <algorithm>
+#include <zlib.h>
+
+const size_t LinkMeter::min_sample;
+const size_t LinkMeter::fast_link;
+const size_t LinkMeter::slow_link;
+const int LinkMeter::min_dwell;
+
+namespace Compression {
+
+// bytes compressed first to tell whether data compresses
+static const size_t probe_size = 4096;
+
+// compress data at level into out
+// returns false and leaves out empty if it doesn't compress well
+bool compress(const char* data, const size_t size, const int level, std::string& out) {
+    out.clear();
+    if (level <= 0 || !size) return 0;
+
+    // compressed data, images and archives don't shrink, 
+    // find them out by compressing a small piece at fast level
+    if (size > 2 * probe_size) {
+        out.resize(compressBound(probe_size));
+        uLongf length = out.size();
+        if (compress2((Bytef*)&out[0], &length, (const Bytef*)data, probe_size, fast) != Z_OK ||
+            length > probe_size * 7 / 8) {
+            out.clear();
+            return 0;
+        }
+    }
+
+    out.resize(compressBound(size));
+    uLongf length = out.size();
+    if (compress2((Bytef*)&out[0], &length, (const Bytef*)data, size, level) != Z_OK ||
+        length > size * 7 / 8) {
+        out.clear();
+        return 0;
+    }
+
+    out.resize(length);
+    return 1;
+}
+
+// decompress data into buff of size bytes
+// returns num of bytes decompressed, or < 0 on error
+intmax_t decompress(const char* data, const size_t length, char* buff, const size_t size) {
+    uLongf buff_length = size;
+    if (uncompress((Bytef*)buff, &buff_length, (const Bytef*)data, length) != Z_OK)
+        return -1;
+    return buff_length;
+}
+
+// size of data compressed at level, estimated from a few pieces of it
+// for links compressing data where bytes on the wire aren't known
+size_t estimate(const char* data, const size_t size, const int level) {
+    static const size_t num_probes = 2;
+    static const size_t estimate_probe = 16 * 1024;
+    if (level <= 0 || !size) return size;
+
+    std::string out(compressBound(std::min(size, num_probes * estimate_probe)), 0);
+
+    // small data is compressed whole
+    if (size <= num_probes * estimate_probe) {
+        uLongf length = out.size();
+        if (compress2((Bytef*)&out[0], &length, (const Bytef*)data, size, level) != Z_OK)
+            return size;
+        return std::min<size_t>(length, size);
+    }
+
+    // pieces spread evenly over data
+    size_t compressed = 0;
+    for (size_t i = 0; i < num_probes; ++i) {
+        size_t offset = (size - estimate_probe) / (num_probes - 1) * i;
+        uLongf length = out.size();
+        if (compress2((Bytef*)&out[0], &length, (const Bytef*)data + offset, estimate_probe, 
+                      level) != Z_OK)
+            return size;
+        compressed += std::min<size_t>(length, estimate_probe);
+    }
+
+    return double(size) * compressed / (num_probes * estimate_probe);
+}
+
+} // namespace Compression
+
+// record a transfer of bytes on the wire taking elapsed time
+void LinkMeter::record(const size_t bytes, const std::chrono::steady_clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    if (bytes < min_sample || seconds <= 0) return;
+
+    double throughput = bytes / seconds;
+
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    _throughput = _throughput? _throughput * 0.75 + throughput * 0.25: throughput;
+}
+
+int LinkMeter::level() const {
+    if (_level != Compression::automatic) return _level;
+
+    boost::unique_lock<boost::mutex> lock(_mutex);
+
+    // not measured yet
+    if (!_throughput) return _current;
+
+    // stay until throughput is a quarter past a threshold of current level
+    if (choose(_throughput * 4 / 3) <= _current && _current <= choose(_throughput * 3 / 4))
+        return _current;
+
+    // the first change, from the level before measuring, is made at once
+    auto now = std::chrono::steady_clock::now();
+    if (_changed != std::chrono::steady_clock::time_point() && 
+        now - _changed < std::chrono::seconds(min_dwell))
+        return _current;
+
+    _current = choose(_throughput);
+    _changed = now;
+    return _current;
+}
+
+// level for throughput, without hysteresis
+int LinkMeter::choose(const double throughput) {
+    if (throughput >= fast_link) return Compression::none;
+    if (throughput >= slow_link) return Compression::fast;
+    return Compression::best;
+}
@@ -0,0 +1,92 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: compression.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul  6, 2015
+ *  Time: 10:12:44
+ *  Description: compression of file data sent between nodes
+ *****************************************************************************/
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <string>
+#include <chrono>
+#include <boost/thread/mutex.hpp>
+
+// zlib levels
+namespace Compression {
+    // choose from measured throughput of the link
+    const int automatic = -1;
+    const int none = 0;
+    // cheap, for fast links
+    const int fast = 1;
+    // for slow links
+    const int best = 6;
+
+    // compress data at level into out
+    // returns false and leaves out empty if it doesn't compress well
+    bool compress(const char* data, const size_t size, const int level, std::string& out);
+
+    // decompress data into buff of size bytes
+    // returns num of bytes decompressed, or < 0 on error
+    intmax_t decompress(const char* data, const size_t length, char* buff, const size_t size);
+
+    // size of data compressed at level, estimated from a few pieces of it
+    // for links compressing data where bytes on the wire aren't known
+    size_t estimate(const char* data, const size_t size, const int level);
+}
+
+// All member functions are thread-safe.
+// Measures throughput of a link on the wire and picks a compression level for it.
+// Compressing pays off only when the link is slower than the compressor.
+// A new level costs SSH a new connection, so a chosen level is kept
+// until throughput is well past a threshold, and for at least min_dwell seconds.
+class LinkMeter {
+public:
+    LinkMeter(const int level): 
+        _level(level), _throughput(0), _current(Compression::none), _changed() { }
+
+    // level set by user, Compression::automatic if it's chosen from throughput
+    void setLevel(const int level) { _level = level; }
+
+    // record a transfer of bytes on the wire taking elapsed time
+    void record(const size_t bytes, const std::chrono::steady_clock::duration elapsed);
+
+    int level() const;
+
+    // bytes per second, 0 if not measured
+    double throughput() const {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        return _throughput;
+    }
+
+    // transfers smaller than this are dominated by latency, they're not measured
+    static const size_t min_sample = 64 * 1024;
+    // links faster than this aren't compressed
+    static const size_t fast_link = 64 * 1024 * 1024;
+    // links slower than this are compressed at best level
+    static const size_t slow_link = 8 * 1024 * 1024;
+    // seconds a chosen level is kept at least
+    static const int min_dwell = 60;
+
+private:
+    // level for throughput, without hysteresis
+    static int choose(const double throughput);
+
+    int _level;
+
+    mutable boost::mutex _mutex;
+    // moving average
+    double _throughput;
+    // level chosen from throughput and when it was chosen
+    mutable int _current;
+    mutable std::chrono::steady_clock::time_point _changed;
+};
+
+#endif /* COMPRESSION_H_ */
@@ -0,0 +1,54 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: content_hash.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 12, 2015
+ *  Time: 11:18:36
+ *  Description: hash of file content, identical files on different hosts 
+ *               have the same hash
+ *****************************************************************************/
+#ifndef CONTENT_HASH_H_
+#define CONTENT_HASH_H_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/uuid/detail/sha1.hpp>
+
+// returns SHA-1 of content of file at path in hex, or empty string on error
+inline std::string contentHash(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return std::string();
+
+    boost::uuids::detail::sha1 sha1;
+    std::vector<char> buffer(1024 * 1024);
+
+    ssize_t rtv;
+    while ((rtv = ::read(fd, buffer.data(), buffer.size())) > 0)
+        sha1.process_bytes(buffer.data(), rtv);
+
+    ::close(fd);
+    if (rtv < 0) return std::string();
+
+    boost::uuids::detail::sha1::digest_type digest;
+    sha1.get_digest(digest);
+
+    // digest is made of 32-bit words in older boost and of bytes in newer
+    std::ostringstream os;
+    os << std::hex << std::setfill('0');
+    for (const auto word: digest) 
+        os << std::setw(sizeof(word) * 2) << uint32_t(word);
+
+    return os.str();
+}
+
+#endif /* CONTENT_HASH_H_ */
@@ -0,0 +1,252 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: dir_scanner.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 26, 2015
+ *  Time: 14:48:02
+ *  Description: scan a directory tree into TreeNodes with many threads
+ *****************************************************************************/
+#include "dir_scanner.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "content_hash.h"
+
+typedef DirTree::TreeNode TreeNode;
+
+// bytes of directory entries read at once
+static const size_t entries_buffer_size = 256 * 1024;
+
+// Queue of directories of each thread.
+// pending counts directories pushed but not done yet, scan ends when it's 0.
+class DirScanner::Queues {
+public:
+    Queues(const size_t num_threads): _queues(num_threads), _pending(0) { }
+
+    void push(const size_t self, Task&& task) {
+        ++_pending;
+        std::lock_guard<std::mutex> lock(_queues[self].mutex);
+        _queues[self].tasks.push_back(std::move(task));
+    }
+
+    // take newest task of this thread, or else steal oldest one of others
+    // returns false if there's none
+    bool pop(const size_t self, Task& task) {
+        for (size_t i = 0; i < _queues.size(); ++i) {
+            Queue& queue = _queues[(self + i) % _queues.size()];
+
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+
+            if (i) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            return 1;
+        }
+        return 0;
+    }
+
+    // a task popped is done
+    void done() { --_pending; }
+
+    bool finished() const { return !_pending; }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<Queue> _queues;
+    std::atomic<size_t> _pending;
+};
+
+#ifdef __linux__
+// entry returned by getdents64
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+// call f with name of each entry of directory fd
+// returns true on error
+template <class Function>
+static bool readEntries(const int fd, std::vector<char>& buffer, const Function& f) {
+#ifdef __linux__
+    // one system call for as many entries as fit in buffer
+    for (;;) {
+        long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (length < 0) return 1;
+        if (length == 0) return 0;
+
+        for (long pos = 0; pos < length; ) {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + pos);
+            pos += entry->d_reclen;
+            f(entry->d_name);
+        }
+    }
+#else
+    // directory stream takes over its descriptor
+    int dir_fd = dup(fd);
+    DIR* dir = dir_fd < 0? nullptr: fdopendir(dir_fd);
+    if (!dir) {
+        if (dir_fd >= 0) close(dir_fd);
+        return 1;
+    }
+
+    bool failed;
+    for (;;) {
+        errno = 0;
+        dirent* entry = readdir(dir);
+        if (!entry) {
+            failed = errno;
+            break;
+        }
+        f(entry->d_name);
+    }
+
+    closedir(dir);
+    return failed;
+#endif
+}
+
+// fill children of node with files under dir, recursively
+// subdirectories that can't be read are left empty and counted as errors
+// throws std::runtime_error if dir itself can't be read
+void DirScanner::scan(const std::string& dir, const TreeNode& node) {
+    Queues queues(_num_threads);
+
+    Task root;
+    root.path = dir;
+    if (root.path.empty() || root.path.back() != '/') root.path.push_back('/');
+    root.node = &node;
+
+    // root is read by this thread first, so that its error is thrown
+    std::vector<char> buffer(entries_buffer_size);
+    if (scanOne(root, queues, 0, buffer)) 
+        throw std::runtime_error("Cannot read directory \"" + dir + "\". ");
+
+    auto worker = [this, &queues](const size_t self) {
+        std::vector<char> buffer(entries_buffer_size);
+        Task task;
+
+        while (!queues.finished()) {
+            if (!queues.pop(self, task)) {
+                // others are reading the last few directories, wait for more
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+
+            if (scanOne(task, queues, self, buffer)) ++_errors;
+            queues.done();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < _num_threads; ++i) threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& t: threads) t.join();
+}
+
+// read directory of task into its node
+// subdirectories found are pushed to queue of this thread
+// returns true on error
+bool DirScanner::scanOne(const Task& task, Queues& queues, const size_t self, 
+                         std::vector<char>& buffer) {
+    int fd = open(task.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 1;
+
+    // entries come unsorted, they're collected before node is visible to other threads
+    std::vector<TreeNode> children;
+
+    bool failed = readEntries(fd, buffer, [&](const char* name) {
+        if (!strcmp(name, ".") || !strcmp(name, "..")) return;
+
+        TreeNode child;
+        // file may have been removed meanwhile
+        if (makeNode(fd, name, child)) return;
+
+        child.host_id = _host_id;
+        if (_content_hash && child.type == TreeNode::REGULAR)
+            child.hash = contentHash(task.path + name);
+
+        children.push_back(std::move(child));
+    });
+
+    close(fd);
+
+    _entries += children.size();
+
+    // sorted once, nodes aren't moved after subdirectories are pushed
+    task.node->children.assign(std::move(children));
+
+    for (const auto& child: task.node->children) {
+        if (child.type != TreeNode::DIRECTORY) continue;
+
+        Task subtask;
+        subtask.path = task.path + child.name.string() + "/";
+        subtask.node = &child;
+        queues.push(self, std::move(subtask));
+    }
+
+    return failed;
+}
+
+// fill attributes and name of file name in directory dir_fd, without hash or host id
+// those of a symlink are of its target, if there's one
+// returns true on error, or if its type is unknown
+bool DirScanner::makeNode(const int dir_fd, const char* name, TreeNode& node) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW)) return 1;
+
+    switch (st.st_mode & S_IFMT) {
+        case S_IFDIR: node.type = TreeNode::DIRECTORY; break;
+        case S_IFREG: node.type = TreeNode::REGULAR; break;
+        case S_IFCHR: node.type = TreeNode::CHRDEVICE; break;
+        case S_IFBLK: node.type = TreeNode::BLKDEVICE; break;
+        case S_IFIFO: node.type = TreeNode::FIFO; break;
+        case S_IFLNK: node.type = TreeNode::SYMLINK; break;
+        case S_IFSOCK: node.type = TreeNode::SOCKET; break;
+        default: return 1;
+    }
+
+    node.name = name;
+
+    // a dangling symlink is kept without attributes
+    if (node.type == TreeNode::SYMLINK && fstatat(dir_fd, name, &st, 0)) {
+        node.size = node.mtime = node.num_links = 0;
+        return 0;
+    }
+
+    // size of directories isn't portable, it's 0 as that of root
+    node.size = S_ISREG(st.st_mode)? st.st_size: 0;
+    node.mtime = st.st_mtime;
+    node.num_links = st.st_nlink;
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: dir_scanner.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 26, 2015
+ *  Time: 11:20:37
+ *  Description: scan a directory tree into TreeNodes with many threads
+ *****************************************************************************/
+#ifndef DIR_SCANNER_H_
+#define DIR_SCANNER_H_
+
+#include <string>
+#include <atomic>
+#include <vector>
+#include "dir_tree.h"
+
+// Scans a directory tree with a pool of threads.
+// Each thread takes directories from its own queue, newest first, and steals 
+// the oldest ones from others when it runs out. Entries of a directory are read
+// in big batches and each costs one stat, or two for a symlink.
+class DirScanner {
+public:
+    // host_id is set in all nodes
+    // content of regular files is hashed if content_hash is true
+    DirScanner(const uint64_t host_id, const bool content_hash, const size_t num_threads):
+        _host_id(host_id), _content_hash(content_hash), _num_threads(num_threads? num_threads: 1),
+        _entries(0), _errors(0) { }
+
+    // fill children of node with files under dir, recursively
+    // subdirectories that can't be read are left empty and counted as errors
+    // throws std::runtime_error if dir itself can't be read
+    void scan(const std::string& dir, const DirTree::TreeNode& node);
+
+    // num of entries scanned, and of directories failed to be read
+    size_t entries() const { return _entries; }
+    size_t errors() const { return _errors; }
+
+    // fill attributes and name of file name in directory dir_fd, without hash or host id
+    // those of a symlink are of its target, if there's one
+    // returns true on error, or if its type is unknown
+    static bool makeNode(const int dir_fd, const char* name, DirTree::TreeNode& node);
+
+private:
+    // a directory to read, and its node
+    struct Task {
+        // with trailing slash
+        std::string path;
+        const DirTree::TreeNode* node;
+    };
+
+    class Queues;
+
+    // read directory of task into its node
+    // subdirectories found are pushed to queue of this thread
+    // returns true on error
+    bool scanOne(const Task& task, Queues& queues, const size_t self, std::vector<char>& buffer);
+
+    uint64_t _host_id;
+    bool _content_hash;
+    size_t _num_threads;
+
+    std::atomic<size_t> _entries;
+    std::atomic<size_t> _errors;
+};
+
+#endif /* DIR_SCANNER_H_ */
@@ -16,35 +16,80 @@
 
 #include "dir_tree.h"
 #include <string>
-#include <sstream>
 #include <iterator>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
 #include <algorithm>
+#include <functional>
 #include <boost/filesystem.hpp>
+#include "compression.h"
+
+const size_t DirTree::chunk_nodes;
+
+static const char dir_tree_magic[4] = { 'G', 'S', 'D', 'T' };
+static const uint64_t dir_tree_version = 2;
+
+// chunk encodings
+enum { RAW_CHUNK, ZLIB_CHUNK };
+
+// run task(i) for each i in [0, n) on all cores
+// rethrows the first exception thrown by a task
+static void parallelFor(const size_t n, const std::function<void (size_t)>& task) {
+    size_t num_threads = std::min<size_t>(n, std::max(std::thread::hardware_concurrency(), 1u));
+
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                task(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto& t: threads) t.join();
+
+    if (error) std::rethrow_exception(error);
+}
 
 
 // remove all nodes of a certain host
 void DirTree::removeOf(const uint64_t host_id) {
-    for (auto ite = _root->children.begin(); ite != _root->children.end();)
-        if (ite->host_id == host_id) 
-            _root->children.erase(ite++);
-        else 
-            ++ite;
+    std::vector<InternedString> names;
+    for (const auto& node: _root->children)
+        if (node.host_id == host_id) names.push_back(node.name);
+
+    unindexChildren(PathIndex<TreeNode>::seed, *_root, names);
+    _root->children.removeIf([host_id](const TreeNode& node) { return node.host_id == host_id; });
+    indexChildren(PathIndex<TreeNode>::seed, *_root, std::vector<InternedString>());
 }
 
 // remove all nodes but those of a certain node
 void DirTree::removeNotOf(const uint64_t host_id) {
-    for (auto ite = _root->children.begin(); ite != _root->children.end();)
-        if (ite->host_id != host_id)
-            _root->children.erase(ite++);
-        else 
-            ++ite;
+    std::vector<InternedString> names;
+    for (const auto& node: _root->children)
+        if (node.host_id != host_id) names.push_back(node.name);
+
+    unindexChildren(PathIndex<TreeNode>::seed, *_root, names);
+    _root->children.removeIf([host_id](const TreeNode& node) { return node.host_id != host_id; });
+    indexChildren(PathIndex<TreeNode>::seed, *_root, std::vector<InternedString>());
 }
 
 std::vector<std::string> DirTree::hasConflict(const DirTree& tree) const {
     std::vector<std::string> conflicts;
 
     auto first1 = tree.root()->children.begin();
-    auto last1 = tree.root()->children.begin();
+    auto last1 = tree.root()->children.end();
     auto first2 = _root->children.begin();
     auto last2 = _root->children.end();
 
@@ -52,7 +97,7 @@ std::vector<std::string> DirTree::hasConflict(const DirTree& tree) const {
         if (*first1 < *first2) ++first1;
         else if (*first2 < *first1) ++first2;
         else {
-            conflicts.push_back(first1->name);
+            conflicts.push_back(first1->name.string());
             ++first1, ++first2;
         }
     }
@@ -63,49 +108,386 @@ std::vector<std::string> DirTree::hasConflict(const DirTree& tree) const {
 // merge dirtree from host_id to self's dirtree
 // assert no conflicts
 void DirTree::merge(const DirTree& tree) {
-    for (auto treenode: tree.root()->children) 
-        _root->children.insert(treenode);
+    TreeNode::Children nodes = tree.root()->children;
+    addChildren("/", *_root, std::move(nodes));
+}
+
+// Index all nodes by hash of their paths, so that find takes one lookup.
+// Then functions here keep it up to date, changing children of nodes
+// otherwise leaves it stale until the next reindex.
+void DirTree::reindex() {
+    _index.clear();
+    _indexed = 1;
+    indexNode(PathIndex<TreeNode>::seed, *_root, 1);
+}
+
+// add nodes under directory dir at dir_path, those of the same names are replaced
+void DirTree::addChildren(const std::string& dir_path, const TreeNode& dir, TreeNode::Children&& nodes) {
+    uint64_t hash = hashPath(dir_path);
+
+    std::vector<InternedString> names;
+    names.reserve(nodes.size());
+    for (const auto& node: nodes) names.push_back(node.name);
+
+    unindexChildren(hash, dir, names);
+    dir.children.merge(std::move(nodes));
+    indexChildren(hash, dir, names);
+}
+
+// remove child named name of directory dir at dir_path, and its descendants
+void DirTree::removeChild(const std::string& dir_path, const TreeNode& dir, const std::string& name) {
+    auto ite = dir.children.find(name);
+    if (ite == dir.children.end()) return;
+
+    uint64_t hash = hashPath(dir_path);
+    std::vector<InternedString> names(1, ite->name);
+
+    unindexChildren(hash, dir, names);
+    dir.children.erase(ite);
+    indexChildren(hash, dir, std::vector<InternedString>());
+}
+
+// hash of path, as PathIndex does it
+// empty components are skipped, like boost::filesystem::path does
+uint64_t DirTree::hashPath(const std::string& path) {
+    uint64_t hash = PathIndex<TreeNode>::seed;
+    for (size_t begin = 0; begin < path.size();) {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos) end = path.size();
+        if (end > begin) hash = PathIndex<TreeNode>::extend(hash, path.data() + begin, end - begin);
+        begin = end + 1;
+    }
+    return hash;
 }
 
+// add node and its descendants if subtree is true, hash is that of its path
+// root isn't indexed, find handles it
+void DirTree::indexNode(const uint64_t hash, const TreeNode& node, const bool subtree) {
+    if (&node != _root) _index.insert(hash, &node);
+    if (!subtree) return;
+
+    for (const auto& child: node.children)
+        indexNode(PathIndex<TreeNode>::extend(hash, child.name.data(), child.name.size()), child, 1);
+}
+
+void DirTree::unindexNode(const uint64_t hash, const TreeNode& node, const bool subtree) {
+    if (&node != _root) _index.erase(hash, &node);
+    if (!subtree) return;
+
+    for (const auto& child: node.children)
+        unindexNode(PathIndex<TreeNode>::extend(hash, child.name.data(), child.name.size()), child, 1);
+}
+
+// children of dir are moved by changing them, those in names are added or removed
+// with their descendants, the others are reindexed alone
+// names are sorted, hash is that of path of dir
+void DirTree::indexChildren(const uint64_t hash, const TreeNode& dir, 
+                            const std::vector<InternedString>& names) {
+    if (!_indexed) return;
+
+    for (const auto& child: dir.children)
+        indexNode(PathIndex<TreeNode>::extend(hash, child.name.data(), child.name.size()), child, 
+                  std::binary_search(names.begin(), names.end(), child.name));
+}
+
+void DirTree::unindexChildren(const uint64_t hash, const TreeNode& dir, 
+                              const std::vector<InternedString>& names) {
+    if (!_indexed) return;
+
+    for (const auto& child: dir.children)
+        unindexNode(PathIndex<TreeNode>::extend(hash, child.name.data(), child.name.size()), child, 
+                    std::binary_search(names.begin(), names.end(), child.name));
+}
+
+// looks up index if path is like "/a/b", otherwise walks down from root
 const DirTree::TreeNode* DirTree::find(const std::string& path) const {
+    if (!_indexed || path.empty() || path[0] != '/') return walk(path);
+    if (path.size() == 1) return _root;
+
+    // hashed without allocation, components "", "." and ".." need a walk
+    uint64_t hash = PathIndex<TreeNode>::seed;
+    const char* name = nullptr;
+    size_t length = 0;
+    for (size_t begin = 1; begin <= path.size();) {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos) end = path.size();
+
+        name = path.data() + begin;
+        length = end - begin;
+        if (!length || (name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.'))))
+            return walk(path);
+
+        hash = PathIndex<TreeNode>::extend(hash, name, length);
+        begin = end + 1;
+    }
+
+    bool ambiguous;
+    const TreeNode* node = _index.find(hash, name, length, ambiguous);
+    return ambiguous? walk(path): node;
+}
+
+const DirTree::TreeNode* DirTree::walk(const std::string& path) const {
     boost::filesystem::path p(path);
     const TreeNode* node = nullptr;
-    TreeNode key;
     for (auto ite = p.begin(); ite != p.end(); ++ite) {
         assert(*ite != "..");
         if (*ite == ".") continue;
         else if (*ite == "/" && !node) node = _root;
         else if (!node) continue;
         else {
-            key.name = ite->string();
-            auto set_ite = node->children.find(key);
-            if (set_ite == node->children.end()) return nullptr;
-            node = &(*set_ite);
+            auto child = node->children.find(ite->string());
+            if (child == node->children.end()) return nullptr;
+            node = &(*child);
         }
     }
 
     return node;
 }
 
-std::string DirTree::serialize(const DirTree& tree) {
-    std::ostringstream ofs;
-    boost::archive::text_oarchive oa(ofs);
+// Binary format: magic, version, then chunks each holding some subtrees.
+// Integers are varints. Directories with at least chunk_nodes nodes in their
+// subtrees have children in chunks of their own, chunks are encoded, 
+// compressed at zlib level and decoded in parallel.
+std::string DirTree::serialize(const DirTree& tree, const int level) {
+    // chunk 0 holds root, others hold children of a big directory
+    std::vector<const TreeNode*> chunk_nodes;
+    ChunkIndex index;
+    if (tree._root) {
+        chunk_nodes.push_back(tree._root);
+        planChunks(*tree._root, chunk_nodes, index);
+    }
+
+    std::vector<std::string> chunks(chunk_nodes.size());
+    std::vector<int> encodings(chunks.size(), RAW_CHUNK);
+    std::vector<size_t> raw_sizes(chunks.size());
+
+    parallelFor(chunks.size(), [&](const size_t i) {
+        std::string raw;
+        BinaryWriter writer(raw);
+        if (i) 
+            encodeChildren(*chunk_nodes[i], index, writer);
+        else 
+            encodeNode(*chunk_nodes[i], index, writer);
+
+        raw_sizes[i] = raw.size();
+        if (level > 0 && Compression::compress(raw.data(), raw.size(), level, chunks[i]))
+            encodings[i] = ZLIB_CHUNK;
+        else
+            chunks[i] = std::move(raw);
+    });
 
-    oa << tree;
+    std::string out(dir_tree_magic, sizeof(dir_tree_magic));
+    BinaryWriter writer(out);
+    writer.varint(dir_tree_version);
+    writer.varint(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        writer.varint(encodings[i]);
+        writer.varint(raw_sizes[i]);
+        writer.string(chunks[i]);
+    }
 
-    return ofs.str();
+    return out;
 }
 
+// throws std::exception on malformed data
 DirTree DirTree::deserialize(const std::string& byte_sequence) {
-    std::istringstream ifs(byte_sequence);
+    DirTree tree;
 
-    boost::archive::text_iarchive ia(ifs);
+    if (byte_sequence.compare(0, sizeof(dir_tree_magic), dir_tree_magic, sizeof(dir_tree_magic)))
+        throw std::runtime_error("Not a dir tree. ");
 
-    DirTree tree;
+    BinaryReader reader(byte_sequence.data() + sizeof(dir_tree_magic), 
+                        byte_sequence.size() - sizeof(dir_tree_magic));
+
+    if (reader.varint() != dir_tree_version) 
+        throw std::runtime_error("Unsupported version of dir tree. ");
+
+    size_t num_chunks = reader.varint();
+    // each chunk takes at least 3 bytes
+    if (num_chunks > reader.remaining() / 3) 
+        throw std::runtime_error("Malformed binary data. ");
+
+    struct Chunk {
+        int encoding;
+        size_t raw_size;
+        const char* data;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks(num_chunks);
+    for (auto& chunk: chunks) {
+        chunk.encoding = reader.varint();
+        chunk.raw_size = reader.varint();
+        chunk.size = reader.varint();
+        chunk.data = reader.bytes(chunk.size);
+    }
+
+    if (!num_chunks) return tree;
+
+    tree.initialize();
+
+    // children of big directories, decoded in parallel and linked afterwards
+    std::vector<TreeNode::Children> children(num_chunks);
+    std::vector<ChunkRefs> refs(num_chunks);
+
+    parallelFor(num_chunks, [&](const size_t i) {
+        const Chunk& chunk = chunks[i];
 
-    ia >> tree;
+        std::string raw;
+        const char* data = chunk.data;
+        size_t size = chunk.size;
+
+        if (chunk.encoding == ZLIB_CHUNK) {
+            // zlib doesn't expand data more than 1032 times
+            if (chunk.raw_size / 1032 > chunk.size) 
+                throw std::runtime_error("Malformed binary data. ");
+            raw.resize(chunk.raw_size);
+            if (Compression::decompress(chunk.data, chunk.size, &raw[0], raw.size()) != 
+                intmax_t(raw.size()))
+                throw std::runtime_error("Malformed binary data. ");
+            data = raw.data();
+            size = raw.size();
+        } else if (chunk.encoding != RAW_CHUNK) {
+            throw std::runtime_error("Malformed binary data. ");
+        }
+
+        BinaryReader chunk_reader(data, size);
+
+        if (i) {
+            TreeNode parent;
+            decodeChildren(chunk_reader, parent, refs[i]);
+            children[i] = std::move(parent.children);
+        } else {
+            size_t children_chunk = decodeNode(chunk_reader, *tree._root);
+            if (children_chunk) 
+                refs[i].emplace_back(tree._root, children_chunk);
+            else
+                decodeChildren(chunk_reader, *tree._root, refs[i]);
+        }
+
+        if (chunk_reader.remaining())
+            throw std::runtime_error("Malformed binary data. ");
+    });
+
+    // chunks refer only to later chunks, each chunk is referred to once
+    std::vector<bool> linked(num_chunks, 0);
+    for (size_t i = 0; i < num_chunks; ++i) {
+        for (const auto& ref: refs[i]) {
+            if (ref.second <= i || ref.second >= num_chunks || linked[ref.second])
+                throw std::runtime_error("Malformed binary data. ");
+            linked[ref.second] = 1;
+            // moving children keeps addresses of their nodes
+            ref.first->children = std::move(children[ref.second]);
+        }
+    }
 
     return tree;
 }
 
+// assign chunks to big directories under node, in preorder
+// returns num of nodes in its subtree
+size_t DirTree::planChunks(const TreeNode& node, std::vector<const TreeNode*>& chunks, 
+                           ChunkIndex& index) {
+    size_t num_nodes = 1;
+
+    for (const auto& child: node.children) {
+        if (child.type != TreeNode::DIRECTORY || child.children.empty()) {
+            ++num_nodes;
+            continue;
+        }
+
+        // chunk index is taken before those of its descendants
+        size_t chunk = chunks.size();
+        chunks.push_back(&child);
+
+        size_t child_nodes = planChunks(child, chunks, index);
+        num_nodes += child_nodes;
+
+        if (child_nodes >= chunk_nodes) {
+            index.emplace(&child, chunk);
+        } else {
+            // small directory, no chunk of its own, and neither for its descendants
+            for (size_t i = chunk + 1; i < chunks.size(); ++i) index.erase(chunks[i]);
+            chunks.resize(chunk);
+        }
+    }
+
+    return num_nodes;
+}
+
+void DirTree::encodeNode(const TreeNode& node, const ChunkIndex& index, BinaryWriter& writer) {
+    writer.varint(node.type);
+    writer.varint(node.size);
+    writer.varint(node.mtime);
+    writer.varint(node.host_id);
+    writer.varint(node.num_links);
+    writer.varint(node.name.size());
+    writer.bytes(node.name.data(), node.name.size());
+    writer.varint(node.hash.size());
+    writer.bytes(node.hash.data(), node.hash.size());
+
+    auto ite = index.find(&node);
+    if (ite != index.end()) {
+        writer.varint(ite->second);
+        return;
+    }
+
+    writer.varint(0);
+    encodeChildren(node, index, writer);
+}
+
+void DirTree::encodeChildren(const TreeNode& node, const ChunkIndex& index, BinaryWriter& writer) {
+    writer.varint(node.children.size());
+    for (const auto& child: node.children)
+        encodeNode(child, index, writer);
+}
 
+// read attributes of a node
+// returns index of chunk holding its children, 0 if they follow
+size_t DirTree::decodeNode(BinaryReader& reader, TreeNode& node) {
+    uint64_t type = reader.varint();
+    if (type > TreeNode::UNKNOWN) throw std::runtime_error("Malformed binary data. ");
+    node.type = TreeNode::FileType(type);
+    node.size = reader.varint();
+    node.mtime = reader.varint();
+
+    uint64_t host_id = reader.varint();
+    uint64_t num_links = reader.varint();
+    if (host_id > UINT32_MAX || num_links > UINT32_MAX) 
+        throw std::runtime_error("Malformed binary data. ");
+    node.host_id = host_id;
+    node.num_links = num_links;
+
+    // interned straight from data
+    size_t name_size = reader.varint();
+    node.name = InternedString(reader.bytes(name_size), name_size);
+    size_t hash_size = reader.varint();
+    node.hash = InternedString(reader.bytes(hash_size), hash_size);
+
+    return reader.varint();
+}
+
+void DirTree::decodeChildren(BinaryReader& reader, const TreeNode& node, ChunkRefs& refs) {
+    size_t num_children = reader.varint();
+    // each child takes at least 8 bytes
+    if (num_children > reader.remaining() / 8) 
+        throw std::runtime_error("Malformed binary data. ");
+
+    // reserved, so that nodes referred to aren't moved by their siblings
+    node.children.reserve(num_children);
+
+    for (size_t i = 0; i < num_children; ++i) {
+        TreeNode child;
+        size_t children_chunk = decodeNode(reader, child);
+
+        // children were written in order
+        if (node.children.append(std::move(child)))
+            throw std::runtime_error("Malformed binary data. ");
+        const TreeNode& added = node.children.back();
+
+        if (children_chunk) 
+            refs.emplace_back(&added, children_chunk);
+        else 
+            decodeChildren(reader, added, refs);
+    }
+}
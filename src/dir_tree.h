@@ -16,40 +16,112 @@
 #ifndef DIR_TREE_H_
 #define DIR_TREE_H_
 
-#include <set>
-#include <boost/archive/text_oarchive.hpp>
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/serialization/set.hpp>
+#include <utility>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include "binary_codec.h"
+#include "path_index.h"
+#include "interned_string.h"
 
 
 class DirTree {
-private:
-    friend class boost::serialization::access;
-    template <class Archive>
-    void serialize(Archive& ar, const unsigned int /* version */) {
-        ar & _root;
-    }
-
 public:
     class TreeNode {
-    private:
-        friend class boost::serialization::access;
-        template <class Archive>
-        void serialize(Archive& ar, const unsigned int /* version */) {
-            ar & type;
-            ar & size;
-            ar & uid;
-            ar & gid;
-            ar & atime;
-            ar & mtime;
-            ar & ctime;
-            ar & host_id;
-            ar & num_links;
-            ar & name;
-            ar & children;
-        }
-
     public:
+        // Children sorted by name in one contiguous array, found by binary search.
+        // Inserting or erasing a child moves those after it, but not their descendants.
+        class Children {
+        public:
+            typedef std::vector<TreeNode>::iterator iterator;
+            typedef std::vector<TreeNode>::const_iterator const_iterator;
+
+            iterator begin() { return _nodes.begin(); }
+            iterator end() { return _nodes.end(); }
+            const_iterator begin() const { return _nodes.begin(); }
+            const_iterator end() const { return _nodes.end(); }
+            TreeNode& back() { return _nodes.back(); }
+
+            size_t size() const { return _nodes.size(); }
+            bool empty() const { return _nodes.empty(); }
+            void reserve(const size_t size) { _nodes.reserve(size); }
+            void clear() { std::vector<TreeNode>().swap(_nodes); }
+
+            iterator find(const char* name, const size_t length) {
+                iterator ite = lowerBound(name, length);
+                return ite != end() && !ite->name.compare(name, length)? ite: end();
+            }
+            iterator find(const std::string& name) { return find(name.data(), name.size()); }
+            size_t count(const std::string& name) { return find(name) != end(); }
+
+            // returns node inserted and true, or the one of the same name and false
+            std::pair<iterator, bool> insert(TreeNode&& node) {
+                iterator ite = lowerBound(node.name.data(), node.name.size());
+                if (ite != end() && ite->name == node.name) return std::make_pair(ite, false);
+                return std::make_pair(_nodes.insert(ite, std::move(node)), true);
+            }
+
+            std::pair<iterator, bool> insert(const TreeNode& node) { return insert(TreeNode(node)); }
+
+            iterator erase(iterator ite) { return _nodes.erase(ite); }
+
+            // remove nodes for which pred returns true
+            template <class Pred>
+            void removeIf(Pred pred) { _nodes.erase(std::remove_if(begin(), end(), pred), end()); }
+
+            // append node named after the last one
+            // returns true if it isn't
+            bool append(TreeNode&& node) {
+                if (!empty() && !(_nodes.back().name < node.name)) return 1;
+                _nodes.push_back(std::move(node));
+                return 0;
+            }
+
+            // take nodes in any order, but not of duplicate names
+            void assign(std::vector<TreeNode>&& nodes) {
+                std::sort(nodes.begin(), nodes.end());
+                nodes.shrink_to_fit();
+                _nodes = std::move(nodes);
+            }
+
+            // add nodes, those of the same names are replaced
+            void merge(Children&& nodes) {
+                std::vector<TreeNode> merged;
+                merged.reserve(size() + nodes.size());
+
+                iterator first1 = begin(), first2 = nodes.begin();
+                while (first1 != end() || first2 != nodes.end()) {
+                    if (first2 == nodes.end() || (first1 != end() && *first1 < *first2)) {
+                        merged.push_back(std::move(*first1++));
+                    } else {
+                        if (first1 != end() && first1->name == first2->name) ++first1;
+                        merged.push_back(std::move(*first2++));
+                    }
+                }
+
+                _nodes.swap(merged);
+                nodes.clear();
+            }
+
+        private:
+            iterator lowerBound(const char* name, const size_t length) {
+                iterator first = begin();
+                for (size_t count = size(); count;) {
+                    size_t half = count / 2;
+                    if ((first + half)->name.compare(name, length) < 0) {
+                        first += half + 1;
+                        count -= half + 1;
+                    } else {
+                        count = half;
+                    }
+                }
+                return first;
+            }
+
+            std::vector<TreeNode> _nodes;
+        };
+
         void setHostID(const uint64_t host_id) const {
             for (const auto& node: children) {
                 node.host_id = host_id;
@@ -59,40 +131,74 @@ public:
 
         bool operator<(const TreeNode& node) const { return name < node.name; }
         
-        enum FileType { REGULAR, DIRECTORY, CHRDEVICE, BLKDEVICE, FIFO, SYMLINK, SOCKET, UNKNOWN };
+        enum FileType : uint8_t { REGULAR, DIRECTORY, CHRDEVICE, BLKDEVICE, FIFO, SYMLINK, SOCKET, UNKNOWN };
 
-        // file type
-        FileType type;
         // file size
-        size_t size;
-        // owner user id
-        size_t uid;
-        // owner group id 
-        size_t gid;
-        // time of last access
-        size_t atime;
+        uint64_t size;
         // time of last modification
-        size_t mtime;
-        // time of last status change
-        size_t ctime;
+        uint64_t mtime;
+
+        // SHA-1 of content of a regular file in hex, empty if not computed
+        InternedString hash;
+
+        // if name is empty, this is root node
+        InternedString name;
+        mutable Children children;
+
         // this tree node belongs to which host
-        mutable uint64_t host_id;
+        mutable uint32_t host_id;
         // number of hard links
-        size_t num_links;
-        
-        // if name is empty, this is root node
-        std::string name;
-        mutable std::set<TreeNode> children;
+        uint32_t num_links;
+        // file type
+        FileType type;
 
-        TreeNode() { }
+        TreeNode(): size(0), mtime(0), host_id(0), num_links(0), type(UNKNOWN) { }
     };
 
-    DirTree(): _root(nullptr) { }
+    DirTree(): _root(nullptr), _indexed(0) { }
     ~DirTree() { delete _root; }
 
-    void initialize() { _root = new TreeNode; }
+    // owns its nodes, movable only
+    DirTree(DirTree&& tree): _root(tree._root), _index(std::move(tree._index)), _indexed(tree._indexed) {
+        tree._root = nullptr;
+        tree._indexed = 0;
+    }
+    DirTree& operator=(DirTree&& tree) {
+        std::swap(_root, tree._root);
+        std::swap(_index, tree._index);
+        std::swap(_indexed, tree._indexed);
+        return *this;
+    }
+    DirTree(const DirTree&) = delete;
+    DirTree& operator=(const DirTree&) = delete;
+
+    void initialize() {
+        delete _root;
+        _root = new TreeNode;
+        _index.clear();
+        _indexed = 0;
+    }
     TreeNode* root() const { return _root; }
 
+    // Index all nodes by hash of their paths, so that find takes one lookup.
+    // Then functions here keep it up to date, changing children of nodes
+    // otherwise leaves it stale until the next reindex.
+    void reindex();
+
+    // num of nodes indexed and slots of index, for statistics
+    size_t indexSize() const { return _index.size(); }
+    size_t indexCapacity() const { return _index.capacity(); }
+
+    // bytes taken by nodes and index, about as nodes are counted by index,
+    // strings are counted by InternedString::bytes
+    size_t memoryUsage() const { return (_index.size() + 1) * sizeof(TreeNode) + _index.bytes(); }
+
+    // add nodes under directory dir at dir_path, those of the same names are replaced
+    void addChildren(const std::string& dir_path, const TreeNode& dir, TreeNode::Children&& nodes);
+
+    // remove child named name of directory dir at dir_path, and its descendants
+    void removeChild(const std::string& dir_path, const TreeNode& dir, const std::string& name);
+
     // remove all nodes of a certain host
     void removeOf(const uint64_t host_id);
 
@@ -105,15 +211,62 @@ public:
     // assert no conflicts
     void merge(const DirTree& tree);
 
+    // looks up index if path is like "/a/b", otherwise walks down from root
     const TreeNode* find(const std::string& path) const;
 
-    static std::string serialize(const DirTree& tree);
+    // Binary format: magic, version, then chunks each holding some subtrees.
+    // Integers are varints. Directories with at least chunk_nodes nodes in their
+    // subtrees have children in chunks of their own, chunks are encoded, 
+    // compressed at zlib level and decoded in parallel.
+    static std::string serialize(const DirTree& tree, const int level);
 
+    // throws std::exception on malformed data
     static DirTree deserialize(const std::string& byte_sequence);
 
+    // subtrees not smaller than this are encoded in chunks of their own
+    static const size_t chunk_nodes = 16384;
+
 private:
+    // chunk holding children of each big directory
+    typedef std::unordered_map<const TreeNode*, size_t> ChunkIndex;
+    // decoded nodes whose children are in other chunks
+    typedef std::vector< std::pair<const TreeNode*, size_t> > ChunkRefs;
+
+    // assign chunks to big directories under node, in preorder
+    // returns num of nodes in its subtree
+    static size_t planChunks(const TreeNode& node, std::vector<const TreeNode*>& chunks, 
+                             ChunkIndex& index);
+
+    static void encodeNode(const TreeNode& node, const ChunkIndex& index, BinaryWriter& writer);
+
+    static void encodeChildren(const TreeNode& node, const ChunkIndex& index, BinaryWriter& writer);
+
+    // read attributes of a node
+    // returns index of chunk holding its children, 0 if they follow
+    static size_t decodeNode(BinaryReader& reader, TreeNode& node);
+
+    static void decodeChildren(BinaryReader& reader, const TreeNode& node, ChunkRefs& refs);
+
+    // hash of path, as PathIndex does it
+    static uint64_t hashPath(const std::string& path);
+
+    // add or remove node and its descendants if subtree is true, hash is that of its path
+    void indexNode(const uint64_t hash, const TreeNode& node, const bool subtree);
+    void unindexNode(const uint64_t hash, const TreeNode& node, const bool subtree);
+
+    // children of dir are moved by changing them, those in names are added or removed
+    // with their descendants, the others are reindexed alone
+    // names are sorted, hash is that of path of dir
+    void indexChildren(const uint64_t hash, const TreeNode& dir, const std::vector<InternedString>& names);
+    void unindexChildren(const uint64_t hash, const TreeNode& dir, const std::vector<InternedString>& names);
+
+    const TreeNode* walk(const std::string& path) const;
+
     TreeNode* _root;
 
+    PathIndex<TreeNode> _index;
+    bool _indexed;
+
 };
 
 #endif /* DIR_TREE_H_ */
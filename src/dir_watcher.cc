@@ -0,0 +1,259 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: dir_watcher.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 24, 2015
+ *  Time: 15:32:50
+ *  Description: report changes in a directory tree in batches
+ *****************************************************************************/
+#include "dir_watcher.h"
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+const size_t DirWatcher::max_delay_factor;
+
+#ifdef __linux__
+// events of files in a watched directory, events of directory itself aren't needed
+static const uint32_t watch_mask = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | 
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | 
+                                   IN_EXCL_UNLINK;
+#endif
+
+// delay is in milliseconds
+// returns true on error, or if it isn't supported on this platform
+bool DirWatcher::start(const std::string& dir, const size_t delay, const Callback& callback) {
+#ifdef __linux__
+    stop();
+
+    _dir = dir;
+    if (_dir.empty() || _dir.back() != '/') _dir.push_back('/');
+    _delay = std::max<size_t>(delay, 1);
+    _callback = callback;
+
+    _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_fd < 0) return 1;
+
+    if (pipe(_stop_pipe)) {
+        _stop_pipe[0] = _stop_pipe[1] = -1;
+        stop();
+        return 1;
+    }
+
+    watch("");
+    if (_watches.empty()) {
+        stop();
+        return 1;
+    }
+
+    _thread = boost::thread(&DirWatcher::run, this);
+    return 0;
+#else
+    (void)dir, (void)delay, (void)callback;
+    return 1;
+#endif
+}
+
+// changes not reported yet are dropped
+void DirWatcher::stop() {
+    if (_thread.joinable()) {
+        char byte = 0;
+        if (write(_stop_pipe[1], &byte, 1) == 1) _thread.join();
+        else _thread.detach();
+    }
+
+    auto closeFd = [](int& fd) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    };
+    closeFd(_fd);
+    closeFd(_stop_pipe[0]);
+    closeFd(_stop_pipe[1]);
+
+    boost::unique_lock<boost::mutex> lock(_watches_mutex);
+    _paths.clear();
+    _watches.clear();
+    _changes.clear();
+    _written.clear();
+}
+
+void DirWatcher::printStats(std::ostream& os) const {
+    size_t directories;
+    {
+        boost::unique_lock<boost::mutex> lock(_watches_mutex);
+        directories = _watches.size();
+    }
+
+    os << "watcher: directories " << directories << ", events " << _events 
+       << ", batches " << _batches << ", overflows " << _overflows 
+       << ", failures " << _failures << "\n";
+}
+
+#ifdef __linux__
+void DirWatcher::run() {
+    typedef std::chrono::steady_clock clock;
+    // when first and last changes not reported yet came
+    clock::time_point first, last;
+
+    for (;;) {
+        int timeout = -1;
+
+        if (_changes.size()) {
+            clock::time_point now = clock::now();
+            clock::time_point deadline = std::min(last + std::chrono::milliseconds(_delay), 
+                                                  first + std::chrono::milliseconds(_delay * max_delay_factor));
+
+            if (deadline <= now) {
+                std::set<std::string> changes, written;
+                changes.swap(_changes);
+                written.swap(_written);
+                // the rest don't matter if all is to be rescanned
+                if (changes.count("/")) changes = { "/" }, written.clear();
+
+                ++_batches;
+                _callback(changes, written);
+                continue;
+            }
+
+            timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        }
+
+        pollfd fds[2] = { { _fd, POLLIN, 0 }, { _stop_pipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) return;
+
+        if (fds[1].revents) return;
+
+        if (fds[0].revents & POLLIN) {
+            bool was_empty = _changes.empty();
+            handleEvents();
+
+            last = clock::now();
+            if (was_empty) first = last;
+        }
+    }
+}
+
+// read and handle events in buffer
+void DirWatcher::handleEvents() {
+    alignas(inotify_event) char buffer[64 * 1024];
+
+    ssize_t length = read(_fd, buffer, sizeof(buffer));
+    if (length <= 0) return;
+
+    for (const char* p = buffer; p < buffer + length; ) {
+        const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+        p += sizeof(inotify_event) + event->len;
+
+        ++_events;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            ++_overflows;
+            _changes.insert("/");
+            continue;
+        }
+
+        auto ite = _paths.find(event->wd);
+        if (ite == _paths.end()) continue;
+
+        // directory is removed, or moved out
+        if (event->mask & IN_IGNORED) {
+            boost::unique_lock<boost::mutex> lock(_watches_mutex);
+            auto watch_ite = _watches.find(ite->second);
+            if (watch_ite != _watches.end() && watch_ite->second == event->wd)
+                _watches.erase(watch_ite);
+            _paths.erase(ite);
+            continue;
+        }
+
+        if (!event->len) continue;
+
+        std::string path = ite->second + "/" + event->name;
+
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) 
+                watch(path);
+            else if (event->mask & IN_MOVED_FROM) 
+                unwatch(path);
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            _written.insert(path);
+        }
+
+        _changes.insert(path);
+    }
+}
+
+// watch directory at path and its subdirectories
+void DirWatcher::watch(const std::string& path) {
+    std::string full_path = _dir + (path.empty()? path: path.substr(1));
+
+    int wd = inotify_add_watch(_fd, full_path.c_str(), watch_mask);
+    if (wd < 0) {
+        // it may have been removed meanwhile
+        if (errno != ENOENT && errno != ENOTDIR) ++_failures;
+        return;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(_watches_mutex);
+
+        // a directory moved within watched tree keeps its watch descriptor
+        auto ite = _paths.find(wd);
+        if (ite != _paths.end()) _watches.erase(ite->second);
+
+        _paths[wd] = path;
+        _watches[path] = wd;
+    }
+
+    DIR* dir = opendir(full_path.c_str());
+    if (!dir) return;
+
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = !fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir) watch(path + "/" + name);
+    }
+
+    closedir(dir);
+}
+
+// stop watching directory at path and its subdirectories
+void DirWatcher::unwatch(const std::string& path) {
+    boost::unique_lock<boost::mutex> lock(_watches_mutex);
+
+    auto unwatchOne = [this](std::map<std::string, int>::iterator ite) {
+        inotify_rm_watch(_fd, ite->second);
+        _paths.erase(ite->second);
+        return _watches.erase(ite);
+    };
+
+    auto ite = _watches.find(path);
+    if (ite != _watches.end()) unwatchOne(ite);
+
+    // subdirectories are contiguous after path + "/"
+    std::string prefix = path + "/";
+    for (ite = _watches.lower_bound(prefix); 
+         ite != _watches.end() && !ite->first.compare(0, prefix.size(), prefix);)
+        ite = unwatchOne(ite);
+}
+#endif
@@ -0,0 +1,98 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: dir_watcher.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 24, 2015
+ *  Time: 14:06:29
+ *  Description: report changes in a directory tree in batches
+ *****************************************************************************/
+#ifndef DIR_WATCHER_H_
+#define DIR_WATCHER_H_
+
+#include <set>
+#include <map>
+#include <atomic>
+#include <string>
+#include <ostream>
+#include <functional>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+// Watches a directory and all its subdirectories with inotify, only on Linux.
+// Changed paths are collected until none has changed for delay, or for at most
+// max_delay_factor * delay, and reported in one batch from the thread of watcher.
+class DirWatcher {
+public:
+    // paths are relative to watched directory, beginning with "/", without trailing slash
+    // a batch of just "/" means some changes are lost, whole directory should be rescanned
+    // written are those of changed closed after writing or moved in, files there are complete
+    typedef std::function<void (const std::set<std::string>& changed, 
+                                const std::set<std::string>& written)> Callback;
+
+    DirWatcher(): _delay(0), _fd(-1), _events(0), _batches(0), _overflows(0), _failures(0) {
+        _stop_pipe[0] = _stop_pipe[1] = -1;
+    }
+    ~DirWatcher() { stop(); }
+
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    // delay is in milliseconds
+    // returns true on error, or if it isn't supported on this platform
+    bool start(const std::string& dir, const size_t delay, const Callback& callback);
+
+    // changes not reported yet are dropped
+    void stop();
+
+    bool enabled() const { return _fd >= 0; }
+
+    void printStats(std::ostream& os) const;
+
+    static const size_t max_delay_factor = 10;
+
+private:
+    void run();
+
+    // read and handle events in buffer
+    void handleEvents();
+
+    // watch directory at path and its subdirectories
+    void watch(const std::string& path);
+
+    // stop watching directory at path and its subdirectories
+    void unwatch(const std::string& path);
+
+    // watched directory with trailing slash
+    std::string _dir;
+    size_t _delay;
+    Callback _callback;
+
+    int _fd;
+    int _stop_pipe[2];
+    boost::thread _thread;
+
+    // accessed only by thread of watcher, except for their sizes in statistics
+    mutable boost::mutex _watches_mutex;
+    // path of each watch descriptor, and the other way round
+    std::unordered_map<int, std::string> _paths;
+    std::map<std::string, int> _watches;
+
+    // changed paths not reported yet
+    std::set<std::string> _changes;
+    std::set<std::string> _written;
+
+    std::atomic<uint64_t> _events;
+    std::atomic<uint64_t> _batches;
+    std::atomic<uint64_t> _overflows;
+    // directories failed to be watched, e.g. out of inotify watches
+    std::atomic<uint64_t> _failures;
+};
+
+#endif /* DIR_WATCHER_H_ */
@@ -0,0 +1,443 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: disk_cache.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 24, 2015
+ *  Time: 21:40:09
+ *  Description: on-disk cache of remote file blocks, survives restart
+ *****************************************************************************/
+#include "disk_cache.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "block_cache.h"
+
+const uint64_t DiskCache::version;
+const size_t DiskCache::num_ways;
+const size_t DiskCache::num_locks;
+const time_t DiskCache::hole_delay;
+
+static const char index_magic[8] = { 'G', 'S', 'F', 'S', 'I', 'D', 'X', 0 };
+
+DiskCache::~DiskCache() {
+    if (_header) {
+        _header->clock = _clock;
+        munmap(_header, _mapped_size);
+    }
+    if (_fd >= 0) close(_fd);
+}
+
+// capacity is in bytes, subdirectory gsfs-cache of dir is created if not exists
+// reload index in it if it has the same geometry, otherwise start over
+// returns true on error
+bool DiskCache::initialize(const std::string& dir, const size_t capacity) {
+    using namespace boost::filesystem;
+
+    // files are kept in a subdirectory of their own, 
+    // so that other files in dir are never touched
+    _dir = dir;
+    // add trailing slash
+    if (_dir.size() && _dir.back() != '/')
+        _dir.push_back('/');
+    _dir += "gsfs-cache/";
+
+    if (mkdir(_dir.c_str(), 0700) && errno != EEXIST) {
+        std::perror(("Create cache directory " + _dir + " failed").c_str());
+        return 1;
+    }
+
+    _num_sets = std::max<size_t>(capacity / BlockCache::block_size / num_ways, 1);
+    _mapped_size = sizeof(Header) + _num_sets * num_ways * sizeof(Slot);
+
+    std::string index_path = _dir + "index";
+
+    _fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (_fd < 0) {
+        std::perror(("Open cache index " + index_path + " failed").c_str());
+        return 1;
+    }
+
+    struct stat st;
+    bool reload = fstat(_fd, &st) == 0 && size_t(st.st_size) == _mapped_size;
+
+    if (!reload && ftruncate(_fd, _mapped_size)) {
+        std::perror("Resize cache index failed");
+        close(_fd);
+        _fd = -1;
+        return 1;
+    }
+
+    void* addr = mmap(nullptr, _mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (addr == MAP_FAILED) {
+        std::perror("Map cache index failed");
+        close(_fd);
+        _fd = -1;
+        return 1;
+    }
+
+    _header = static_cast<Header*>(addr);
+    _slots = reinterpret_cast<Slot*>(_header + 1);
+
+    reload = reload && 
+             !memcmp(_header->magic, index_magic, sizeof(index_magic)) &&
+             _header->version == version &&
+             _header->block_size == BlockCache::block_size &&
+             _header->num_sets == _num_sets &&
+             _header->num_ways == num_ways;
+
+    // start over, cache files are useless without their index
+    if (!reload) {
+        memset(addr, 0, _mapped_size);
+
+        boost::system::error_code ec, remove_ec;
+        for (directory_iterator ite(_dir, ec), end; !ec && ite != end; ite.increment(ec)) 
+            if (isCacheFile(ite->path().filename().string()))
+                remove(ite->path(), remove_ec);
+
+        memcpy(_header->magic, index_magic, sizeof(index_magic));
+        _header->version = version;
+        _header->block_size = BlockCache::block_size;
+        _header->num_sets = _num_sets;
+        _header->num_ways = num_ways;
+        _header->clock = 0;
+    }
+
+    _clock = _header->clock;
+
+    return 0;
+}
+
+// fd is a descriptor of cache file of key got by openFile(), 
+// or < 0 to open it for this call
+// returns true if found, and block is filled with its data
+bool DiskCache::get(const std::string& key, const size_t mtime, const size_t file_size,
+                    const size_t index, std::string& block, const int fd) {
+    FileID id = fileID(key);
+    size_t set_index = set(id.hash, index);
+
+    boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+    Slot* slots = _slots + set_index * num_ways;
+
+    for (size_t i = 0; i < num_ways; ++i) {
+        Slot& slot = slots[i];
+        if (!holds(slot, id, index)) continue;
+
+        // file has changed since this block was cached
+        if (slot.mtime != mtime || slot.file_size != file_size) {
+            invalidate(slot);
+            break;
+        }
+
+        int file_fd = fd >= 0? fd: open(filename(id).c_str(), O_RDONLY);
+        if (file_fd < 0) {
+            invalidate(slot);
+            break;
+        }
+
+        block.resize(slot.length);
+        ssize_t rtv = pread(file_fd, &block[0], slot.length, index * BlockCache::block_size);
+        if (fd < 0) close(file_fd);
+
+        if (rtv < 0 || uint64_t(rtv) != slot.length) {
+            invalidate(slot);
+            break;
+        }
+
+        slot.last_access = ++_clock;
+        ++_hits;
+        return 1;
+    }
+
+    ++_misses;
+    return 0;
+}
+
+void DiskCache::put(const std::string& key, const size_t mtime, const size_t file_size,
+                    const size_t index, const std::string& block) {
+    if (block.empty()) return;
+
+    FileID id = fileID(key);
+    size_t set_index = set(id.hash, index);
+    bool pinned = isPinned(id.hash);
+
+    boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+    Slot* slots = _slots + set_index * num_ways;
+    Slot* target = nullptr;
+
+    // same block, or an empty slot, or the least recently used unpinned one
+    for (size_t i = 0; i < num_ways; ++i) {
+        Slot& slot = slots[i];
+        if (holds(slot, id, index)) {
+            target = &slot;
+            pinned = pinned || slot.pinned;
+            break;
+        }
+        if (slot.length && slot.pinned) continue;
+        if (!target || (target->length && 
+                        (!slot.length || slot.last_access < target->last_access)))
+            target = &slot;
+    }
+
+    // all pinned
+    if (!target) return;
+
+    // evict
+    if (target->length && !holds(*target, id, index))
+        invalidate(*target);
+    target->length = 0;
+
+    int fd = open(filename(id).c_str(), O_WRONLY | O_CREAT, 0600);
+    if (fd < 0) return;
+
+    ssize_t rtv = pwrite(fd, block.data(), block.size(), index * BlockCache::block_size);
+    close(fd);
+
+    if (rtv < 0 || size_t(rtv) != block.size()) return;
+
+    target->file_hash = id.hash;
+    target->file_check = id.check;
+    target->index = index;
+    target->mtime = mtime;
+    target->file_size = file_size;
+    target->last_access = ++_clock;
+    target->pinned = pinned;
+    target->length = block.size();
+
+    _header->clock = _clock;
+
+    lock.unlock();
+
+    punchHoles();
+}
+
+// returns true if found, and length is set to length of this block
+// the block is at offset index * block_size of cache file of key
+bool DiskCache::locate(const std::string& key, const size_t mtime, const size_t file_size,
+                       const size_t index, size_t& length) {
+    FileID id = fileID(key);
+    size_t set_index = set(id.hash, index);
+
+    boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+    Slot* slots = _slots + set_index * num_ways;
+
+    for (size_t i = 0; i < num_ways; ++i) {
+        Slot& slot = slots[i];
+        if (!holds(slot, id, index)) continue;
+
+        // file has changed since this block was cached
+        if (slot.mtime != mtime || slot.file_size != file_size) {
+            invalidate(slot);
+            break;
+        }
+
+        slot.last_access = ++_clock;
+        length = slot.length;
+        ++_hits;
+        return 1;
+    }
+
+    ++_misses;
+    return 0;
+}
+
+// returns true if found, without counting it as a hit
+bool DiskCache::contains(const std::string& key, const size_t mtime, const size_t file_size,
+                         const size_t index) {
+    FileID id = fileID(key);
+    size_t set_index = set(id.hash, index);
+
+    boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+    const Slot* slots = _slots + set_index * num_ways;
+
+    for (size_t i = 0; i < num_ways; ++i) {
+        const Slot& slot = slots[i];
+        if (holds(slot, id, index))
+            return slot.mtime == mtime && slot.file_size == file_size;
+    }
+
+    return 0;
+}
+
+// blocks of this file cached from now on are pinned or not, so are those 
+// already cached. Pinned slots stay pinned after restart.
+void DiskCache::pin(const std::string& key, const size_t file_size, const bool pinned) {
+    FileID id = fileID(key);
+
+    {
+        boost::unique_lock< boost::shared_mutex > lock(_pins_mutex);
+        if (pinned) 
+            _pinned_files.insert(id.hash);
+        else 
+            _pinned_files.erase(id.hash);
+        _num_pinned = _pinned_files.size();
+    }
+
+    for (size_t index = 0; index * BlockCache::block_size < file_size; ++index) {
+        size_t set_index = set(id.hash, index);
+
+        boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+        Slot* slots = _slots + set_index * num_ways;
+        for (size_t i = 0; i < num_ways; ++i)
+            if (holds(slots[i], id, index))
+                slots[i].pinned = pinned;
+    }
+}
+
+// drop all blocks of this file, pinned or not
+void DiskCache::evict(const std::string& key, const size_t file_size) {
+    FileID id = fileID(key);
+
+    for (size_t index = 0; index * BlockCache::block_size < file_size; ++index) {
+        size_t set_index = set(id.hash, index);
+
+        boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+        Slot* slots = _slots + set_index * num_ways;
+        for (size_t i = 0; i < num_ways; ++i)
+            if (holds(slots[i], id, index))
+                invalidate(slots[i]);
+    }
+
+    punchHoles();
+}
+
+// read-only descriptor of cache file of key, it's created if not exists
+// returns < 0 on error
+int DiskCache::openFile(const std::string& key) const {
+    return open(filename(fileID(key)).c_str(), O_RDONLY | O_CREAT, 0600);
+}
+
+void DiskCache::printStats(std::ostream& os) const {
+    size_t blocks = 0;
+    size_t bytes = 0;
+    size_t pinned_bytes = 0;
+
+    for (size_t set_index = 0; set_index < _num_sets; ++set_index) {
+        boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+        const Slot* slots = _slots + set_index * num_ways;
+        for (size_t i = 0; i < num_ways; ++i) {
+            if (!slots[i].length) continue;
+            ++blocks;
+            bytes += slots[i].length;
+            if (slots[i].pinned) pinned_bytes += slots[i].length;
+        }
+    }
+
+    os << "disk: blocks " << blocks << "/" << _num_sets * num_ways
+       << ", bytes " << bytes
+       << ", pinned " << pinned_bytes
+       << ", hits " << _hits
+       << ", misses " << _misses << "\n";
+}
+
+// FNV-1a, and a multiply-xorshift hash independent of it
+// they should stay the same after restart
+DiskCache::FileID DiskCache::fileID(const std::string& key) {
+    FileID id = { 0xcbf29ce484222325ull, 0x2545f4914f6cdd1dull };
+    for (unsigned char c: key) {
+        id.hash ^= c;
+        id.hash *= 0x100000001b3ull;
+
+        id.check = (id.check + c) * 0xff51afd7ed558ccdull;
+        id.check ^= id.check >> 32;
+    }
+
+    id.check ^= key.size();
+    id.check *= 0xc4ceb9fe1a85ec53ull;
+    id.check ^= id.check >> 33;
+    return id;
+}
+
+// set of a block
+size_t DiskCache::set(const uint64_t file_hash, const size_t index) const {
+    uint64_t h = file_hash ^ (index * 0x9e3779b97f4a7c15ull);
+    h ^= h >> 29;
+    return h % _num_sets;
+}
+
+bool DiskCache::isPinned(const uint64_t file_hash) const {
+    if (!_num_pinned) return 0;
+
+    boost::shared_lock< boost::shared_mutex > lock(_pins_mutex);
+    return _pinned_files.count(file_hash);
+}
+
+// returns true if name is one made by filename()
+bool DiskCache::isCacheFile(const std::string& name) {
+    if (name.size() != 32) return 0;
+    for (char c: name)
+        if (!isdigit(c) && (c < 'a' || c > 'f')) return 0;
+    return 1;
+}
+
+std::string DiskCache::filename(const FileID& id) const {
+    char name[33];
+    snprintf(name, sizeof(name), "%016llx%016llx", static_cast<unsigned long long>(id.hash),
+             static_cast<unsigned long long>(id.check));
+    return _dir + name;
+}
+
+// mark a slot empty, its data is dropped after hole_delay seconds
+// because the data may be still spliced from a descriptor got by locate()
+void DiskCache::invalidate(Slot& slot) {
+    {
+        boost::unique_lock< boost::mutex > lock(_holes_mutex);
+        _holes.push_back(Hole{ FileID{ slot.file_hash, slot.file_check }, slot.index, slot.length, 
+                               time(nullptr) });
+    }
+    slot.length = 0;
+}
+
+// drop data of slots invalidated more than hole_delay seconds ago
+void DiskCache::punchHoles() {
+    std::deque<Hole> holes;
+    {
+        boost::unique_lock< boost::mutex > lock(_holes_mutex);
+        time_t now = time(nullptr);
+        while (_holes.size() && _holes.front().time + hole_delay <= now) {
+            holes.push_back(_holes.front());
+            _holes.pop_front();
+        }
+    }
+
+    for (const auto& hole: holes) {
+        size_t set_index = set(hole.id.hash, hole.index);
+
+        boost::unique_lock< boost::mutex > lock(_locks[set_index % num_locks]);
+
+        // the same block has been cached again
+        const Slot* slots = _slots + set_index * num_ways;
+        bool cached = 0;
+        for (size_t i = 0; i < num_ways; ++i)
+            if (holds(slots[i], hole.id, hole.index))
+                cached = 1;
+        if (cached) continue;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+        int fd = open(filename(hole.id).c_str(), O_WRONLY);
+        if (fd >= 0) {
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                      hole.index * BlockCache::block_size, hole.length);
+            close(fd);
+        }
+#endif
+    }
+}
@@ -0,0 +1,179 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: disk_cache.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 24, 2015
+ *  Time: 20:15:31
+ *  Description: on-disk cache of remote file blocks, survives restart
+ *****************************************************************************/
+#ifndef DISK_CACHE_H_
+#define DISK_CACHE_H_
+
+#include <ctime>
+#include <deque>
+#include <atomic>
+#include <string>
+#include <ostream>
+#include <unordered_set>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+// All member functions are thread-safe, after initialize().
+// Each remote file is stored in a sparse cache file under subdirectory gsfs-cache
+// of cache dir, named by hash of its key, and its blocks are kept at their original offsets.
+// The index is a memory-mapped file of fixed-size slots, one slot per cached block.
+// Slots are grouped in sets of num_ways, a block can only live in the set
+// chosen by its hash, the least recently used slot of a full set is evicted.
+// Pinned slots are never evicted, a block whose set is all pinned isn't cached.
+// Key of a file should be the same after restart, e.g. address + path.
+// A file is identified by two independent 64-bit hashes of its key, 
+// both are checked, so that a collision of one doesn't mix up files.
+class DiskCache {
+public:
+    DiskCache(): _fd(-1), _header(nullptr), _slots(nullptr), _num_sets(0), 
+                 _num_pinned(0), _hits(0), _misses(0) { }
+    ~DiskCache();
+
+    // capacity is in bytes, subdirectory gsfs-cache of dir is created if not exists
+    // reload index in it if it has the same geometry, otherwise start over
+    // returns true on error
+    bool initialize(const std::string& dir, const size_t capacity);
+
+    bool enabled() const { return _header; }
+
+    // fd is a descriptor of cache file of key got by openFile(), 
+    // or < 0 to open it for this call
+    // returns true if found, and block is filled with its data
+    bool get(const std::string& key, const size_t mtime, const size_t file_size,
+             const size_t index, std::string& block, const int fd = -1);
+
+    void put(const std::string& key, const size_t mtime, const size_t file_size,
+             const size_t index, const std::string& block);
+
+    // returns true if found, without counting it as a hit
+    bool contains(const std::string& key, const size_t mtime, const size_t file_size,
+                  const size_t index);
+
+    // returns true if found, and length is set to length of this block
+    // the block is at offset index * block_size of cache file of key
+    bool locate(const std::string& key, const size_t mtime, const size_t file_size,
+                const size_t index, size_t& length);
+
+    // blocks of this file cached from now on are pinned or not, so are those 
+    // already cached. Pinned slots stay pinned after restart.
+    void pin(const std::string& key, const size_t file_size, const bool pinned);
+
+    // drop all blocks of this file, pinned or not
+    void evict(const std::string& key, const size_t file_size);
+
+    // read-only descriptor of cache file of key, it's created if not exists
+    // returns < 0 on error
+    int openFile(const std::string& key) const;
+
+    void printStats(std::ostream& os) const;
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t version;
+        uint64_t block_size;
+        uint64_t num_sets;
+        uint64_t num_ways;
+        uint64_t clock;
+    };
+
+    // hashes of file key
+    struct FileID {
+        uint64_t hash;
+        uint64_t check;
+    };
+
+    struct Slot {
+        // hashes of file key
+        uint64_t file_hash;
+        uint64_t file_check;
+        uint64_t index;
+        uint64_t mtime;
+        uint64_t file_size;
+        // length of data, 0 -- empty slot
+        uint64_t length;
+        // larger is more recent
+        uint64_t last_access;
+        // not evicted if non-zero
+        uint64_t pinned;
+    };
+
+    static const uint64_t version = 3;
+    static const size_t num_ways = 8;
+    static const size_t num_locks = 64;
+
+    static FileID fileID(const std::string& key);
+
+    // returns true if slot holds block index of file id
+    static bool holds(const Slot& slot, const FileID& id, const size_t index) {
+        return slot.length && slot.file_hash == id.hash && slot.file_check == id.check && 
+               slot.index == index;
+    }
+
+    // set of a block
+    size_t set(const uint64_t file_hash, const size_t index) const;
+
+    // 32 hex digits of both hashes, under cache dir
+    std::string filename(const FileID& id) const;
+
+    // returns true if name is one made by filename()
+    static bool isCacheFile(const std::string& name);
+
+    bool isPinned(const uint64_t file_hash) const;
+
+    // mark a slot empty, its data is dropped after hole_delay seconds
+    // because the data may be still spliced from a descriptor got by locate()
+    void invalidate(Slot& slot);
+
+    // drop data of slots invalidated more than hole_delay seconds ago
+    void punchHoles();
+
+    struct Hole {
+        FileID id;
+        uint64_t index;
+        uint64_t length;
+        time_t time;
+    };
+
+    static const time_t hole_delay = 5;
+
+    std::string _dir;
+
+    // index file
+    int _fd;
+    size_t _mapped_size;
+    Header* _header;
+    Slot* _slots;
+    size_t _num_sets;
+
+    std::atomic<uint64_t> _clock;
+
+    // lock striping over sets
+    mutable boost::mutex _locks[num_locks];
+
+    // invalidated slots waiting for their data being dropped
+    boost::mutex _holes_mutex;
+    std::deque<Hole> _holes;
+
+    // hashes of keys of pinned files
+    mutable boost::shared_mutex _pins_mutex;
+    std::unordered_set<uint64_t> _pinned_files;
+    // size of _pinned_files, so that puts don't lock it if nothing is pinned
+    std::atomic<size_t> _num_pinned;
+
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+};
+
+#endif /* DISK_CACHE_H_ */
@@ -16,89 +16,137 @@
 #include "fuse_interface.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <ctime>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <algorithm>
 
 #include "user_fs.h"
 
 fuse_operations FUSEInterface::_gsfs_oper;
+const unsigned FUSEInterface::max_readahead;
 UserFS* FUSEInterface::_user_fs = nullptr;
+const char* FUSEInterface::_stats_path = "/.gsfs_stats";
+const char* FUSEInterface::_control_path = "/.gsfs_ctl";
 
 int FUSEInterface::getattr(const char* path, struct stat* stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
 
+    if (!strcmp(path, _stats_path)) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = _user_fs->stats().size();
+        stbuf->st_mtime = time(nullptr);
+        return 0;
+    }
+
+    if (!strcmp(path, _control_path)) {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = _user_fs->controlStatus().size();
+        stbuf->st_mtime = time(nullptr);
+        return 0;
+    }
+
     // find in dir tree
-    const DirTree::TreeNode* node = _user_fs->find(path);
+    UserFS::Attributes node;
     
     // not found
-    if (!node) return -ENOENT;
+    if (_user_fs->getattr(path, node)) return -ENOENT;
     
-    if (node->type == DirTree::TreeNode::REGULAR) {
+    if (node.type == DirTree::TreeNode::REGULAR) {
         stbuf->st_mode = S_IFREG | 0444;
-    } else if (node->type == DirTree::TreeNode::DIRECTORY) {
+    } else if (node.type == DirTree::TreeNode::DIRECTORY) {
         stbuf->st_mode = S_IFDIR | 0755;
-    } else if (node->type == DirTree::TreeNode::SYMLINK) {
+    } else if (node.type == DirTree::TreeNode::SYMLINK) {
         stbuf->st_mode = S_IFLNK | 0444;
-    } else if (node->type == DirTree::TreeNode::CHRDEVICE) {
+    } else if (node.type == DirTree::TreeNode::CHRDEVICE) {
         stbuf->st_mode = S_IFCHR | 0444;
-    } else if (node->type == DirTree:: TreeNode::BLKDEVICE) {
+    } else if (node.type == DirTree:: TreeNode::BLKDEVICE) {
         stbuf->st_mode = S_IFBLK | 0444;
-    } else if (node->type == DirTree::TreeNode::FIFO) {
+    } else if (node.type == DirTree::TreeNode::FIFO) {
         stbuf->st_mode = S_IFIFO | 0444;
-    } else if (node->type == DirTree::TreeNode::SOCKET) {
+    } else if (node.type == DirTree::TreeNode::SOCKET) {
         stbuf->st_mode = S_IFSOCK | 0444;
     } else {
         std::cerr << "read path error at " << path << "." << std::endl;
         return -ENOENT;
     }
-    stbuf->st_nlink = node->num_links;
-    stbuf->st_size = node->size;
-    stbuf->st_mtime = node->mtime;
+    stbuf->st_nlink = node.num_links;
+    stbuf->st_size = node.size;
+    stbuf->st_mtime = node.mtime;
 
     return 0;
 }
 
 int FUSEInterface::readdir(const char* path, void* buf, fuse_fill_dir_t filler,
                    off_t /* offset */, struct fuse_file_info* /* fi */) {
-    const DirTree::TreeNode* node = _user_fs->find(path);
-    if (!node) return -ENOENT;
-
-    if (node->type != DirTree::TreeNode::DIRECTORY) return -ENOTDIR;
+    // names are copied out, dir tree may change while they're filled
+    std::vector<InternedString> names;
+    int rtv = _user_fs->readdir(path, names);
+    if (rtv) return rtv;
     
-    for (const auto& i: node->children) 
-        filler(buf, i.name.c_str(), 0, 0);
+    for (const auto& name: names) 
+        filler(buf, name.c_str(), 0, 0);
 
     return 0;
 }
 
 int FUSEInterface::open(const char* path, fuse_file_info* fi) {
-    const DirTree::TreeNode* node = _user_fs->find(path);
-    if (!node) return -ENOENT;
-    
+    // handle of control file is the last line written to it, until it's ended
+    if (!strcmp(path, _control_path)) {
+        fi->direct_io = 1;
+        fi->fh = reinterpret_cast<uint64_t>(new std::string);
+        return 0;
+    }
+
     if ((fi->flags & 3) != O_RDONLY)
         return -EACCES;
 
+    // content changes all the time, bypass page cache
+    if (!strcmp(path, _stats_path)) {
+        fi->direct_io = 1;
+        fi->fh = 0;
+        return 0;
+    }
+
+    // resolve path once, reads use this handle
+    UserFS::FileHandle* handle = _user_fs->open(path, IOScheduler::reader(fuse_get_context()->pid));
+    if (!handle) return -ENOENT;
+
+    fi->fh = reinterpret_cast<uint64_t>(handle);
+    fi->keep_cache = handle->keep_cache;
+
     return 0;
 }
 
 int FUSEInterface::read(const char* path, char* buf, size_t size, off_t offset,
-                fuse_file_info* /* fi */) {
+                fuse_file_info* fi) {
+    if (!strcmp(path, _control_path))
+        return readText(_user_fs->controlStatus(), buf, size, offset);
+
+    // only stats file has no handle
+    if (!fi->fh) 
+        return readText(_user_fs->stats(), buf, size, offset);
     
-    const DirTree::TreeNode* node = _user_fs->find(path);
-    if (!node) return -ENOENT;
+    const UserFS::FileHandle* handle = reinterpret_cast<UserFS::FileHandle*>(fi->fh);
 
-    if (node->type == DirTree::TreeNode::DIRECTORY) return -EISDIR;
+    if (handle->type == DirTree::TreeNode::DIRECTORY) return -EISDIR;
 
     assert(offset >= 0);
 
     size_t read_offset = offset;
     size_t read_size = size;
-    size_t file_size = node->size;
+    size_t file_size = handle->size;
 
     if (read_offset >= file_size) return 0;
 
     if (read_offset + read_size > file_size)
         read_size = file_size - read_offset;
     
-    intmax_t bytes_read = _user_fs->read(node->host_id, path, offset, size, buf);
+    intmax_t bytes_read = _user_fs->read(*handle, read_offset, read_size, buf, 
+                                         IOScheduler::reader(fuse_get_context()->pid));
 
     if (bytes_read < 0) return -EIO;
 
@@ -106,5 +154,127 @@ int FUSEInterface::read(const char* path, char* buf, size_t size, off_t offset,
 
 }
 
+// same as read, but data of local files and blocks in disk cache 
+// are returned as file descriptors, so that they can be spliced to kernel
+int FUSEInterface::read_buf(const char* path, fuse_bufvec** bufp, size_t size, off_t offset,
+                            fuse_file_info* fi) {
+    // libfuse frees bufvec and memory of its buffers
+    fuse_bufvec* bufvec = static_cast<fuse_bufvec*>(malloc(sizeof(fuse_bufvec)));
+    if (!bufvec) return -ENOMEM;
+
+    bufvec->count = 1;
+    bufvec->idx = 0;
+    bufvec->off = 0;
+
+    fuse_buf& buf = bufvec->buf[0];
+    buf.size = 0;
+    buf.flags = fuse_buf_flags(0);
+    buf.mem = nullptr;
+    buf.fd = -1;
+    buf.pos = 0;
+
+    *bufp = bufvec;
+
+    const UserFS::FileHandle* handle = strcmp(path, _control_path)? 
+                                       reinterpret_cast<UserFS::FileHandle*>(fi->fh): nullptr;
+
+    if (handle && handle->type != DirTree::TreeNode::DIRECTORY) {
+        assert(offset >= 0);
+
+        size_t read_offset = offset;
+        size_t read_size = size;
+        size_t file_size = handle->size;
+
+        if (read_offset >= file_size) return 0;
+
+        if (read_offset + read_size > file_size)
+            read_size = file_size - read_offset;
+
+        int fd;
+        if (_user_fs->locate(*handle, read_offset, read_size, fd, 
+                             IOScheduler::reader(fuse_get_context()->pid))) {
+            buf.size = read_size;
+            buf.flags = fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            buf.fd = fd;
+            buf.pos = read_offset;
+            return 0;
+        }
+    }
+
+    buf.mem = malloc(size);
+    if (!buf.mem) return -ENOMEM;
+
+    int bytes_read = read(path, static_cast<char*>(buf.mem), size, offset, fi);
+    if (bytes_read < 0) return bytes_read;
+
+    buf.size = bytes_read;
 
+    return 0;
+}
+
+// only control file is writable, each line written is a command
+// a line may be split over writes, the last one runs at release if it isn't ended
+int FUSEInterface::write(const char* path, const char* buf, size_t size, off_t /* offset */,
+                         fuse_file_info* fi) {
+    if (strcmp(path, _control_path)) return -EACCES;
+
+    std::string& commands = *reinterpret_cast<std::string*>(fi->fh);
+    commands.append(buf, size);
+
+    size_t begin = 0;
+    for (size_t end; (end = commands.find('\n', begin)) != std::string::npos; begin = end + 1) {
+        if (control(commands.substr(begin, end - begin))) {
+            commands.clear();
+            return -EINVAL;
+        }
+    }
+    commands.erase(0, begin);
+
+    return size;
+}
+
+// run a line written to control file, blank lines do nothing
+// returns true on error
+bool FUSEInterface::control(const std::string& command) {
+    if (command.find_first_not_of(" \t\r") == std::string::npos) return 0;
+    return _user_fs->control(command);
+}
+
+// only control file can be truncated, it does nothing
+int FUSEInterface::truncate(const char* path, off_t /* size */) {
+    if (strcmp(path, _control_path)) return -EACCES;
+    return 0;
+}
+
+int FUSEInterface::release(const char* path, fuse_file_info* fi) {
+    if (!strcmp(path, _control_path)) {
+        std::unique_ptr<std::string> commands(reinterpret_cast<std::string*>(fi->fh));
+        control(*commands);
+    } else if (fi->fh) {
+        _user_fs->release(reinterpret_cast<UserFS::FileHandle*>(fi->fh));
+    }
+    fi->fh = 0;
+
+    return 0;
+}
+
+void* FUSEInterface::init(fuse_conn_info* conn) {
+    // let kernel read ahead more, it's still capped by kernel
+    conn->max_readahead = max_readahead;
+
+    // move data from descriptors returned by read_buf to kernel without copy
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    return nullptr;
+}
+
+// read from a file whose content is text
+int FUSEInterface::readText(const std::string& text, char* buf, size_t size, off_t offset) {
+    if (size_t(offset) >= text.size()) return 0;
+
+    size = std::min(size, text.size() - offset);
+    memcpy(buf, text.data() + offset, size);
+
+    return size;
+}
 
@@ -19,6 +19,7 @@
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 #undef FUSE_USE_VERSION
+#include <string>
 
 class UserFS;
 
@@ -30,6 +31,11 @@ public:
         _gsfs_oper.readdir = FUSEInterface::readdir;
         _gsfs_oper.open = FUSEInterface::open;
         _gsfs_oper.read = FUSEInterface::read;
+        _gsfs_oper.read_buf = FUSEInterface::read_buf;
+        _gsfs_oper.write = FUSEInterface::write;
+        _gsfs_oper.truncate = FUSEInterface::truncate;
+        _gsfs_oper.release = FUSEInterface::release;
+        _gsfs_oper.init = FUSEInterface::init;
         _gsfs_oper.destroy = FUSEInterface::destroy;
         _user_fs = userfs;
     }
@@ -42,14 +48,49 @@ public:
     static int open(const char* path, fuse_file_info* fi);
 
     static int read(const char* path, char* buf, size_t size, off_t offset,
-                    fuse_file_info* /* fi */);
+                    fuse_file_info* fi);
+
+    // same as read, but data of local files and blocks in disk cache 
+    // are returned as file descriptors, so that they can be spliced to kernel
+    static int read_buf(const char* path, fuse_bufvec** bufp, size_t size, off_t offset,
+                        fuse_file_info* fi);
+
+    // only control file is writable, each line written is a command
+    // a line may be split over writes, the last one runs at release if it isn't ended
+    static int write(const char* path, const char* buf, size_t size, off_t /* offset */,
+                     fuse_file_info* fi);
+
+    // only control file can be truncated, it does nothing
+    static int truncate(const char* path, off_t /* size */);
+
+    static int release(const char* path, fuse_file_info* fi);
         
+    static void* init(fuse_conn_info* conn);
+
+    // max bytes of kernel readahead
+    // size of a read request is capped at 128 KiB by kernel for libfuse 2
+    static const unsigned max_readahead = 1024 * 1024;
+
 
     static void destroy(void*) { _user_fs = nullptr; }
 
     static fuse_operations* get() { return &_gsfs_oper; }
 
 private:
+    // read-only file showing statistics, it's not listed in root directory
+    static const char* _stats_path;
+
+    // file taking commands to pin, warm and evict cached data, reading it shows 
+    // their state, it's not listed in root directory
+    static const char* _control_path;
+
+    // run a line written to control file, blank lines do nothing
+    // returns true on error
+    static bool control(const std::string& command);
+
+    // read from a file whose content is text
+    static int readText(const std::string& text, char* buf, size_t size, off_t offset);
+
     static UserFS* _user_fs;
 
     static fuse_operations _gsfs_oper;
@@ -39,16 +39,52 @@ int main(int argc, char** argv) {
     UserFS fs;
     if (parser.is_master) fs.setMaster();
 
+    // init local files
+    fs.initLocalFiles(parser.kernel_cache);
+
+    // init content hash
+    fs.initContentHash(parser.content_hash);
+
     // init dir tree
     try {
-        fs.initDirTree(parser.working_dir);
+        fs.initDirTree(parser.working_dir, parser.scan_threads);
     } catch (std::exception& err) {
         std::cerr << err.what() << std::endl;
         return 1;
     }
 
     // init host
-    fs.initHost(parser.address, parser.tcp_port, parser.ssh_port);
+    fs.initHost(parser.address, parser.tcp_port, parser.ssh_port, parser.block_port);
+
+    // init native block server
+    if (fs.initBlockServer(parser.address, parser.block_port)) {
+        std::cerr << "Error when initializing block server. " << std::endl;
+        return 1;
+    }
+
+    // init compression
+    fs.initCompression(parser.compression);
+
+    // init ssh sessions
+    fs.initSSH(parser.ssh_sessions);
+
+    // init bandwidth limit of each host
+    fs.initBandwidth(parser.bandwidth << 10);
+
+    // init striped fetching of big files
+    fs.initStriping(parser.stripes, parser.stripe_threshold << 20);
+
+    // init readahead of remote files
+    fs.initReadahead(parser.readahead << 20);
+
+    // init eager fetch of small remote files
+    fs.initEagerFetch(parser.eager_size << 10);
+
+    // init block cache and disk cache
+    if (fs.initCache(parser.cache_memory << 20, parser.cache_dir, parser.cache_size << 20)) {
+        std::cerr << "Error when initializing cache. " << std::endl;
+        return 1;
+    }
 
     // init tcp network
     if (fs.initTCPNetwork(parser.address, parser.tcp_port)) {
@@ -56,6 +92,11 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    // init watcher of working directory
+    if (parser.watch_delay && fs.initWatcher(parser.watch_delay)) 
+        std::cerr << "Working directory isn't watched, files changed from now on "
+                     "are shared only after restart. " << std::endl;
+
     // init fuse interface
     FUSEInterface fuse;
     fuse.initialize(&fs);
@@ -18,52 +18,52 @@
 
 #include <string>
 #include <vector>
-#include <sstream>
-#include <boost/archive/text_oarchive.hpp>
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/serialization/vector.hpp>
+#include <stdexcept>
+#include "binary_codec.h"
 
 class Hosts {
-private:
-    friend class boost::serialization::access;
-    template <class Archive>
-    void serialize(Archive& ar, const unsigned int /* version */) {
-        ar & _hosts;
-    }
 public:
     struct Host {
-        friend class boost::serialization::access;
-        template <class Archive>
-        void serialize(Archive& ar, const unsigned int /* version */) {
-            ar & id;
-            ar & address;
-            ar & working_dir;
-            ar & tcp_port;
-            ar & ssh_port;
-        }
-
-
+        // binary format: magic, version, then fields as in encode
         static std::string serialize(const Host& host) {
-            std::ostringstream ofs;
-            boost::archive::text_oarchive oa(ofs);
-
-            oa << host;
-
-            return ofs.str();
+            std::string out = header();
+            BinaryWriter writer(out);
+            host.encode(writer);
+            return out;
         }
 
+        // throws std::exception on malformed data
         static Host deserialize(const std::string& byte_sequence) {
-            std::istringstream ifs(byte_sequence);
-
-            boost::archive::text_iarchive ia(ifs);
-
             Host host;
 
-            ia >> host;
+            if (!isBinary(byte_sequence)) 
+                throw std::runtime_error("Not a host. ");
+
+            BinaryReader reader(byte_sequence.data() + header().size(), 
+                                byte_sequence.size() - header().size());
+            host.decode(reader);
 
             return host;
         }
 
+        void encode(BinaryWriter& writer) const {
+            writer.varint(id);
+            writer.string(address);
+            writer.string(working_dir);
+            writer.varint(tcp_port);
+            writer.varint(ssh_port);
+            writer.varint(block_port);
+        }
+
+        void decode(BinaryReader& reader) {
+            id = reader.varint();
+            address = reader.string();
+            working_dir = reader.string();
+            tcp_port = reader.varint();
+            ssh_port = reader.varint();
+            block_port = reader.varint();
+        }
+
         uint64_t id;
         std::string address;
         // working dir
@@ -72,36 +72,55 @@ public:
         // TCP port isn't used for now
         // But it's may be used later when adding features such as recover from disconnection 
         uint16_t ssh_port;
+        // port of native block server, 0 if this node doesn't run one
+        uint16_t block_port;
     };
 
     size_t size() const { return _hosts.size(); }
 
     void push(const Host& host) { _hosts.push_back(host); }
+    void pop() { _hosts.pop_back(); }
     const Host& operator[](const size_t n) const { return _hosts[n]; }
     Host& operator[](const size_t n) { return _hosts[n]; }
 
+    // binary format: magic, version, num of hosts, then each host
     static std::string serialize(const Hosts& hosts) {
-        std::ostringstream ofs;
-        boost::archive::text_oarchive oa(ofs);
-
-        oa << hosts;
-
-        return ofs.str();
+        std::string out = header();
+        BinaryWriter writer(out);
+        writer.varint(hosts.size());
+        for (const auto& host: hosts._hosts) host.encode(writer);
+        return out;
     }
 
+    // throws std::exception on malformed data
     static Hosts deserialize(const std::string& byte_sequence) {
-        std::istringstream ifs(byte_sequence);
+        Hosts hosts;
 
-        boost::archive::text_iarchive ia(ifs);
+        if (!isBinary(byte_sequence)) 
+            throw std::runtime_error("Not a list of hosts. ");
 
-        Hosts hosts;
+        BinaryReader reader(byte_sequence.data() + header().size(), 
+                            byte_sequence.size() - header().size());
+
+        size_t num_hosts = reader.varint();
+        // each host takes at least 6 bytes
+        if (num_hosts > reader.remaining() / 6) 
+            throw std::runtime_error("Malformed binary data. ");
 
-        ia >> hosts;
+        hosts._hosts.resize(num_hosts);
+        for (auto& host: hosts._hosts) host.decode(reader);
 
         return hosts;
     }
 
 private:
+    // magic and version of binary format
+    static std::string header() { return std::string("GSHS\x01", 5); }
+
+    static bool isBinary(const std::string& byte_sequence) {
+        return !byte_sequence.compare(0, header().size(), header());
+    }
+
     // 0 -- undefined
     // 1 -- master's host
     // others -- other nodes' hosts
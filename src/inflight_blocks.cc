@@ -0,0 +1,74 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: inflight_blocks.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 14, 2015
+ *  Time: 15:48:09
+ *  Description: blocks of remote files being fetched, for coalescing fetches
+ *****************************************************************************/
+#include "inflight_blocks.h"
+
+// claim blocks [index, index + count) of a file
+std::vector<InflightBlocks::Claim> InflightBlocks::claim(const std::string& file, 
+        const size_t mtime, const size_t file_size, const size_t index, const size_t count) {
+    std::vector<Claim> claims;
+    claims.reserve(count);
+
+    boost::unique_lock< boost::mutex > lock(_mutex);
+
+    for (size_t i = 0; i < count; ++i) {
+        Key key{ file, mtime, file_size, index + i };
+
+        FlightPtr& flight = _flights[key];
+        if (flight) {
+            claims.push_back(Claim{ flight, 0 });
+            ++_joins;
+            continue;
+        }
+
+        flight = std::make_shared<Flight>();
+        flight->key = key;
+        flight->done = 0;
+        claims.push_back(Claim{ flight, 1 });
+        ++_fetches;
+    }
+
+    return claims;
+}
+
+// should be called once by owner of a flight
+void InflightBlocks::complete(const FlightPtr& flight, const BlockCache::Block& block) {
+    boost::unique_lock< boost::mutex > lock(_mutex);
+
+    // later claims fetch again, from cache if it was cached
+    _flights.erase(flight->key);
+
+    flight->block = block;
+    flight->done = 1;
+    flight->completed.notify_all();
+}
+
+// blocks until flight is completed
+BlockCache::Block InflightBlocks::wait(const FlightPtr& flight) {
+    boost::unique_lock< boost::mutex > lock(_mutex);
+    while (!flight->done) flight->completed.wait(lock);
+    return flight->block;
+}
+
+void InflightBlocks::printStats(std::ostream& os) const {
+    size_t in_flight;
+    {
+        boost::unique_lock< boost::mutex > lock(_mutex);
+        in_flight = _flights.size();
+    }
+
+    os << "fetches: blocks " << _fetches
+       << ", joined " << _joins
+       << ", in flight " << in_flight << "\n";
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: inflight_blocks.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 14, 2015
+ *  Time: 15:20:41
+ *  Description: blocks of remote files being fetched, for coalescing fetches
+ *****************************************************************************/
+#ifndef INFLIGHT_BLOCKS_H_
+#define INFLIGHT_BLOCKS_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "block_cache.h"
+
+// All member functions are thread-safe.
+// A thread about to fetch some blocks claims them first. Blocks nobody is 
+// fetching become its own, it must complete each of them after the fetch.
+// Blocks some other thread is fetching are only waited for, so concurrent 
+// misses of the same block cost one fetch. Blocks are keyed like BlockCache.
+class InflightBlocks {
+public:
+    // result of one fetch, shared by the fetching thread and waiting threads
+    struct Flight;
+    typedef std::shared_ptr<Flight> FlightPtr;
+
+    struct Claim {
+        FlightPtr flight;
+        // this thread should fetch it
+        bool owner;
+    };
+
+    InflightBlocks(): _fetches(0), _joins(0) { }
+
+    // claim blocks [index, index + count) of a file
+    std::vector<Claim> claim(const std::string& file, 
+                             const size_t mtime, const size_t file_size, 
+                             const size_t index, const size_t count);
+
+    // should be called once by owner of a flight
+    // block is nullptr on error, waiting threads are woken up with it
+    void complete(const FlightPtr& flight, const BlockCache::Block& block);
+
+    // blocks until flight is completed
+    // returns its block, nullptr on error
+    BlockCache::Block wait(const FlightPtr& flight);
+
+    void printStats(std::ostream& os) const;
+
+private:
+    struct Key {
+        std::string file;
+        size_t mtime;
+        size_t file_size;
+        size_t index;
+
+        bool operator==(const Key& key) const {
+            return index == key.index && mtime == key.mtime && 
+                   file_size == key.file_size && file == key.file;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            size_t seed = std::hash<std::string>()(key.file);
+            seed ^= key.index + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            return seed;
+        }
+    };
+
+    // guards flights and every Flight in it
+    mutable boost::mutex _mutex;
+    std::unordered_map<Key, FlightPtr, KeyHash> _flights;
+
+    // blocks fetched, and claims that waited for a fetch instead
+    std::atomic<uint64_t> _fetches;
+    std::atomic<uint64_t> _joins;
+};
+
+struct InflightBlocks::Flight {
+    Key key;
+    bool done;
+    BlockCache::Block block;
+    boost::condition_variable completed;
+};
+
+#endif /* INFLIGHT_BLOCKS_H_ */
@@ -0,0 +1,170 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: interned_string.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 27, 2015
+ *  Time: 20:51:07
+ *  Description: immutable strings shared through a process-wide table
+ *****************************************************************************/
+#include "interned_string.h"
+#include <new>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+// strings are spread over shards by hash, each with a lock of its own
+static const size_t num_shards = 64;
+
+// open-addressing table of entries, with linear probing
+struct InternedString::Shard {
+    std::mutex mutex;
+    std::vector<Entry*> slots;
+    size_t size = 0;
+    size_t bytes = 0;
+
+    size_t home(const uint32_t hash) const { return hash & (slots.size() - 1); }
+
+    void insert(Entry* entry) {
+        // keep load factor under 3/4
+        if ((size + 1) * 4 > slots.size() * 3) {
+            std::vector<Entry*> old(slots.size()? slots.size() * 2: 256, nullptr);
+            old.swap(slots);
+            for (const auto e: old) 
+                if (e) place(e);
+        }
+        place(entry);
+        ++size;
+    }
+
+    void place(Entry* entry) {
+        size_t mask = slots.size() - 1;
+        size_t i = home(entry->hash);
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = entry;
+    }
+
+    void erase(const Entry* entry) {
+        size_t mask = slots.size() - 1;
+        size_t i = home(entry->hash);
+        while (slots[i] != entry) i = (i + 1) & mask;
+
+        // shift back following slots which can't be reached from their homes otherwise
+        for (size_t j = i;;) {
+            j = (j + 1) & mask;
+            if (!slots[j]) break;
+
+            size_t k = home(slots[j]->hash);
+            // stays if its home is cyclically in (i, j]
+            if (i <= j? (i < k && k <= j): (i < k || k <= j)) continue;
+
+            slots[i] = slots[j];
+            i = j;
+        }
+
+        slots[i] = nullptr;
+        --size;
+    }
+};
+
+// FNV-1a, then mixed, since both low and high bits are used
+static uint32_t hashString(const char* data, const size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return uint32_t(hash);
+}
+
+// top 6 bits pick one of num_shards, low bits a slot in it
+static size_t shardOf(const uint32_t hash) { return hash >> 26; }
+
+// never freed, strings may outlive static objects
+InternedString::Shard* InternedString::shards() {
+    static Shard* shards = new Shard[num_shards];
+    return shards;
+}
+
+// returns entry of string with one more reference, nullptr if it's empty
+InternedString::Entry* InternedString::intern(const char* data, const size_t size) {
+    if (!size) return nullptr;
+
+    uint32_t hash = hashString(data, size);
+    Shard& shard = shards()[shardOf(hash)];
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    if (shard.size) {
+        size_t mask = shard.slots.size() - 1;
+        for (size_t i = shard.home(hash); shard.slots[i]; i = (i + 1) & mask) {
+            Entry* entry = shard.slots[i];
+            if (entry->hash == hash && entry->size == size && !memcmp(entry->data, data, size)) {
+                entry->refs.fetch_add(1, std::memory_order_relaxed);
+                return entry;
+            }
+        }
+    }
+
+    size_t entry_size = offsetof(Entry, data) + size + 1;
+    Entry* entry = static_cast<Entry*>(::operator new(entry_size));
+    new (&entry->refs) std::atomic<uint32_t>(1);
+    entry->hash = hash;
+    entry->size = size;
+    memcpy(entry->data, data, size);
+    entry->data[size] = 0;
+
+    shard.insert(entry);
+    shard.bytes += entry_size;
+
+    return entry;
+}
+
+// drop one reference, entry is freed with the last one
+void InternedString::release(Entry* entry) {
+    if (!entry) return;
+
+    // other references stay, no need to lock
+    uint32_t refs = entry->refs.load(std::memory_order_relaxed);
+    while (refs > 1)
+        if (entry->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel))
+            return;
+
+    // the last reference is dropped with lock held, so that it isn't found meanwhile
+    Shard& shard = shards()[shardOf(entry->hash)];
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    shard.erase(entry);
+    shard.bytes -= offsetof(Entry, data) + entry->size + 1;
+    entry->refs.~atomic();
+    ::operator delete(entry);
+}
+
+// num of distinct strings
+size_t InternedString::count() {
+    size_t count = 0;
+    for (size_t i = 0; i < num_shards; ++i) {
+        std::lock_guard<std::mutex> lock(shards()[i].mutex);
+        count += shards()[i].size;
+    }
+    return count;
+}
+
+// bytes taken by strings and the table
+size_t InternedString::bytes() {
+    size_t bytes = 0;
+    for (size_t i = 0; i < num_shards; ++i) {
+        std::lock_guard<std::mutex> lock(shards()[i].mutex);
+        bytes += shards()[i].bytes + shards()[i].slots.size() * sizeof(Entry*);
+    }
+    return bytes;
+}
@@ -0,0 +1,92 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: interned_string.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 27, 2015
+ *  Time: 20:14:52
+ *  Description: immutable strings shared through a process-wide table
+ *****************************************************************************/
+#ifndef INTERNED_STRING_H_
+#define INTERNED_STRING_H_
+
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+// An immutable string kept once in a process-wide table, however many copies
+// there are, and freed with its last copy. A copy is one pointer,
+// equal strings are equal pointers. The empty string takes no entry.
+// Thread safe, each copy counts one reference.
+class InternedString {
+public:
+    InternedString(): _entry(nullptr) { }
+    InternedString(const std::string& str): _entry(intern(str.data(), str.size())) { }
+    InternedString(const char* str): _entry(intern(str, strlen(str))) { }
+    InternedString(const char* data, const size_t size): _entry(intern(data, size)) { }
+
+    InternedString(const InternedString& str): _entry(str._entry) {
+        if (_entry) _entry->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    InternedString(InternedString&& str): _entry(str._entry) { str._entry = nullptr; }
+
+    InternedString& operator=(InternedString str) {
+        std::swap(_entry, str._entry);
+        return *this;
+    }
+
+    ~InternedString() { release(_entry); }
+
+    const char* data() const { return _entry? _entry->data: ""; }
+    const char* c_str() const { return data(); }
+    size_t size() const { return _entry? _entry->size: 0; }
+    bool empty() const { return !_entry; }
+    std::string string() const { return std::string(data(), size()); }
+
+    // in order of std::string
+    int compare(const char* data, const size_t size) const {
+        size_t length = this->size();
+        int result = memcmp(this->data(), data, std::min(length, size));
+        if (result) return result;
+        return length < size? -1: length > size;
+    }
+
+    bool operator==(const InternedString& str) const { return _entry == str._entry; }
+    bool operator!=(const InternedString& str) const { return _entry != str._entry; }
+    bool operator<(const InternedString& str) const { return compare(str.data(), str.size()) < 0; }
+
+    // num of distinct strings, and bytes taken by them and the table
+    static size_t count();
+    static size_t bytes();
+
+private:
+    struct Entry {
+        std::atomic<uint32_t> refs;
+        uint32_t hash;
+        uint32_t size;
+        // null-terminated, allocated with entry
+        char data[1];
+    };
+
+    struct Shard;
+
+    static Shard* shards();
+
+    // returns entry of string with one more reference, nullptr if it's empty
+    static Entry* intern(const char* data, const size_t size);
+
+    // drop one reference, entry is freed with the last one
+    static void release(Entry* entry);
+
+    Entry* _entry;
+};
+
+#endif /* INTERNED_STRING_H_ */
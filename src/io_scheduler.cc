@@ -0,0 +1,131 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: io_scheduler.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 16, 2015
+ *  Time: 11:05:14
+ *  Description: order and rate of requests to one remote host
+ *****************************************************************************/
+#include "io_scheduler.h"
+#include <cerrno>
+#include <algorithm>
+#include <sys/resource.h>
+
+const size_t IOScheduler::num_priorities;
+const size_t IOScheduler::max_flows;
+
+// foreground reader of a process, background if it's niced
+// weight follows its nice value
+IOScheduler::Reader IOScheduler::reader(const pid_t pid) {
+    errno = 0;
+    int nice = pid? getpriority(PRIO_PROCESS, pid): 0;
+    if (errno) nice = 0;
+
+    // nice -20 .. 19 to weight 40 .. 1
+    unsigned weight = 20 - std::max(-20, std::min(nice, 19));
+
+    return Reader{ nice > 0? BACKGROUND: FOREGROUND, pid, weight };
+}
+
+IOScheduler::IOScheduler(const size_t slots, const size_t rate):
+    _slots(slots? slots: 1), _rate(rate), _burst(std::max(rate / 4, size_t(128 * 1024))),
+    _running(0), _arrivals(0), _tokens(_burst), _refilled(std::chrono::steady_clock::now()), 
+    _throttled(0) {
+    std::fill(_virtual_time, _virtual_time + num_priorities, 0);
+    std::fill(_dispatched, _dispatched + num_priorities, 0);
+}
+
+// blocks until a request of bytes from reader may be sent
+void IOScheduler::acquire(const Reader& reader, const size_t bytes) {
+    boost::unique_lock<boost::mutex> lock(_mutex);
+
+    int priority = reader.priority;
+
+    // a flow starts at virtual time, or where its previous request finishes
+    double& last = _finish[std::make_pair(priority, reader.pid)];
+    double finish = std::max(_virtual_time[priority], last) + 
+                    double(bytes) / std::max(reader.weight, 1u);
+    last = finish;
+
+    Tag tag(priority, finish, _arrivals++);
+    _queue.insert(tag);
+
+    bool throttled = 0;
+
+    while (1) {
+        if (*_queue.begin() != tag || _running >= _slots) {
+            _changed.wait(lock);
+            continue;
+        }
+
+        if (!_rate) break;
+
+        refill(std::chrono::steady_clock::now());
+        if (_tokens >= 0) break;
+
+        // first in queue, wait until bucket isn't in debt
+        throttled = 1;
+        int64_t debt_us = -_tokens / _rate * 1e6 + 1;
+        _changed.timed_wait(lock, boost::posix_time::microseconds(debt_us));
+    }
+
+    _queue.erase(_queue.begin());
+    ++_running;
+    _virtual_time[priority] = std::max(_virtual_time[priority], finish);
+    if (_rate) _tokens -= bytes;
+
+    ++_dispatched[priority];
+    _throttled += throttled;
+
+    if (_finish.size() > max_flows) prune();
+
+    lock.unlock();
+
+    // next one may take another free slot
+    _changed.notify_all();
+}
+
+// request is done, its slot goes to the next one
+void IOScheduler::release() {
+    {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        --_running;
+    }
+    _changed.notify_all();
+}
+
+// should be called with mutex held
+void IOScheduler::refill(const std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - _refilled).count();
+    _tokens = std::min(_burst, _tokens + elapsed * _rate);
+    _refilled = now;
+}
+
+// should be called with mutex held
+// forget flows that have nothing queued beyond virtual time
+void IOScheduler::prune() {
+    for (auto ite = _finish.begin(); ite != _finish.end(); )
+        if (ite->second <= _virtual_time[ite->first.first])
+            ite = _finish.erase(ite);
+        else
+            ++ite;
+}
+
+void IOScheduler::printStats(std::ostream& os) const {
+    boost::unique_lock<boost::mutex> lock(_mutex);
+
+    os << "running " << _running << "/" << _slots
+       << ", queued " << _queue.size()
+       << ", foreground " << _dispatched[FOREGROUND]
+       << ", prefetch " << _dispatched[PREFETCH]
+       << ", background " << _dispatched[BACKGROUND]
+       << ", throttled " << _throttled;
+
+    if (_rate) os << ", limit " << _rate / 1024 << " KiB/s";
+}
@@ -0,0 +1,122 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: io_scheduler.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 16, 2015
+ *  Time: 10:22:37
+ *  Description: order and rate of requests to one remote host
+ *****************************************************************************/
+#ifndef IO_SCHEDULER_H_
+#define IO_SCHEDULER_H_
+
+#include <map>
+#include <set>
+#include <tuple>
+#include <chrono>
+#include <ostream>
+#include <sys/types.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// All member functions are thread-safe.
+// Requests to one host wait here until one of a fixed num of slots is free.
+// A free slot goes to the waiting request of the highest priority. Within a 
+// priority, requests are weighted fair queued by process, so that a process
+// reading a lot doesn't starve others. If a rate limit is set, requests also
+// wait for tokens of a bucket refilled at that rate.
+class IOScheduler {
+public:
+    enum Priority { FOREGROUND, PREFETCH, BACKGROUND };
+    static const size_t num_priorities = 3;
+
+    struct Reader {
+        Priority priority;
+        pid_t pid;
+        // share of bandwidth against other processes of the same priority
+        unsigned weight;
+    };
+
+    // foreground reader of a process, background if it's niced
+    // weight follows its nice value
+    static Reader reader(const pid_t pid);
+
+    // slots is max num of requests sent at the same time
+    // rate is in bytes per second, 0 for unlimited
+    IOScheduler(const size_t slots, const size_t rate);
+
+    // blocks until a request of bytes from reader may be sent
+    void acquire(const Reader& reader, const size_t bytes);
+
+    // request is done, its slot goes to the next one
+    void release();
+
+    // holds a slot until it's released or destroyed
+    class Slot {
+    public:
+        Slot(IOScheduler& scheduler, const Reader& reader, const size_t bytes): 
+            _scheduler(&scheduler) {
+            _scheduler->acquire(reader, bytes);
+        }
+
+        ~Slot() { release(); }
+
+        void release() {
+            if (_scheduler) _scheduler->release();
+            _scheduler = nullptr;
+        }
+
+    private:
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+
+        IOScheduler* _scheduler;
+    };
+
+    void printStats(std::ostream& os) const;
+
+private:
+    // (priority, finish tag, arrival), smallest goes first
+    typedef std::tuple<int, double, uint64_t> Tag;
+
+    // should be called with mutex held
+    void refill(const std::chrono::steady_clock::time_point now);
+
+    // should be called with mutex held
+    // forget flows that have nothing queued beyond virtual time
+    void prune();
+
+    // flows remembered before they are pruned
+    static const size_t max_flows = 1024;
+
+    size_t _slots;
+    size_t _rate;
+    double _burst;
+
+    mutable boost::mutex _mutex;
+    boost::condition_variable _changed;
+
+    std::set<Tag> _queue;
+    size_t _running;
+    uint64_t _arrivals;
+
+    // finish tag of the last request dispatched of each priority
+    double _virtual_time[num_priorities];
+    // finish tag of the last request of each (priority, pid)
+    std::map< std::pair<int, pid_t>, double > _finish;
+
+    // bytes may be sent, negative after a request larger than it
+    double _tokens;
+    std::chrono::steady_clock::time_point _refilled;
+
+    uint64_t _dispatched[num_priorities];
+    // num of requests that waited for tokens
+    uint64_t _throttled;
+};
+
+#endif /* IO_SCHEDULER_H_ */
@@ -16,38 +16,130 @@
 #include "libssh_wrapper.h"
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
 
+const uint32_t SFTPReadWindow::chunk_size;
+const size_t SFTPReadWindow::max_window;
+const size_t SFTPReadWindow::max_requests;
+const size_t SSHSession::max_open_files;
+const int SSHConnection::poll_timeout;
 
-intmax_t SSHSession::read(const std::string& path, const size_t offset, const size_t size, char* buff) {
-    // if connection already exists
-    if (_file_open == path && _sftp_session) {
-        // read
-        intmax_t bytes_read = do_read(offset, size, buff);
-        // read success
-        if (bytes_read >= 0) return bytes_read;
-        // read failed
-        disconnect();
+// returns num of bytes read on success
+// returns < 0 on error
+intmax_t SFTPReadWindow::read(const size_t offset, const size_t size, char* buff) {
+    if (!_file) return -1;
+
+    // sequential if offset falls in buffered or requested data,
+    // otherwise drop the window and start over from offset
+    if (offset >= _buffer_offset && offset <= _next) {
+        _window = std::min(_window * 2, max_window);
+    } else {
+        drain();
+        _buffer.clear();
+        _buffer_offset = _next = offset;
+        _window = 1;
+        _eof = 0;
     }
 
-    // reconnect failed
-    if (connect(path)) return -1;
+    size_t bytes_read = 0;
+    std::string chunk;
 
-    // read
-    intmax_t bytes_read = do_read(offset, size, buff);
+    while (bytes_read < size) {
+        size_t position = offset + bytes_read;
 
-    // read success
-    if (bytes_read >= 0) return bytes_read;
-    
-    std::cerr << "SFTP read file failed. " << std::endl;
+        // skip data before position
+        if (position > _buffer_offset) {
+            size_t skip = std::min(position - _buffer_offset, _buffer.size());
+            _buffer.erase(0, skip);
+            _buffer_offset += skip;
+        }
 
-    // read failed
-    disconnect();
+        // consume buffered data
+        if (_buffer.size()) {
+            size_t length = std::min(size - bytes_read, _buffer.size());
+            memcpy(buff + bytes_read, _buffer.data(), length);
+            _buffer.erase(0, length);
+            _buffer_offset += length;
+            bytes_read += length;
+            continue;
+        }
+
+        if (fill(offset + size)) return -1;
+
+        // end of file
+        if (_requests.empty()) break;
+
+        // wait for the oldest request, it starts at _buffer_offset
+        Request request = _requests.front();
+        _requests.pop_front();
+
+        chunk.resize(chunk_size);
+        int rtv = await(request, &chunk[0]);
+
+        if (rtv < 0) {
+            reset(_file);
+            return -1;
+        }
+
+        if (rtv == 0) {
+            _eof = 1;
+            drain();
+            break;
+        }
+
+        _buffer.assign(chunk.data(), rtv);
+
+        // short read, requests after this one don't line up anymore
+        if (uint32_t(rtv) < chunk_size) {
+            drain();
+            _next = request.offset + rtv;
+        }
+    }
+
+    // keep requests in flight for the next read
+    if (fill(0)) return -1;
 
     return bytes_read;
 }
 
+// keep the window full and at least cover [.., end)
+// returns true on error
+bool SFTPReadWindow::fill(const size_t end) {
+    while (!_eof && _requests.size() < max_requests && 
+           (_requests.size() < _window || _next < end)) {
+        if (sftp_seek64(_file, _next) != 0) return 1;
+
+        int id = sftp_async_read_begin(_file, chunk_size);
+        if (id < 0) return 1;
+
+        _requests.push_back(Request{ uint32_t(id), _next });
+        _next += chunk_size;
+    }
+    return 0;
+}
+
+// blocks until response of request arrives
+int SFTPReadWindow::await(const Request& request, char* buff) {
+    int rtv;
+    while ((rtv = sftp_async_read(_file, buff, chunk_size, request.id)) == SSH_AGAIN)
+        _wait();
+    return rtv;
+}
 
-bool SSHSession::do_connect(const std::string& path) {
+// wait for and discard all requests in flight
+void SFTPReadWindow::drain() {
+    std::string chunk(chunk_size, 0);
+    for (const auto& request: _requests) 
+        if (await(request, &chunk[0]) < 0) break;
+    _requests.clear();
+    _next = _buffer_offset + _buffer.size();
+}
+
+// returns true on error
+bool SSHConnection::connect(const std::string& address, const unsigned int port) {
     // create ssh session
     _ssh_session = ssh_new();
 
@@ -57,12 +149,20 @@ bool SSHSession::do_connect(const std::string& path) {
     } 
 
     // set host and port
-    if (ssh_options_set(_ssh_session, SSH_OPTIONS_HOST, _address.c_str()) ||
-        ssh_options_set(_ssh_session, SSH_OPTIONS_PORT, &_port)) {
+    if (ssh_options_set(_ssh_session, SSH_OPTIONS_HOST, address.c_str()) ||
+        ssh_options_set(_ssh_session, SSH_OPTIONS_PORT, &port)) {
         std::cerr << "Set SSH host and port failed. " << std::endl;
         return 1;
     }
 
+    // compress file data sent from server
+    if (_compression > 0 &&
+        (ssh_options_set(_ssh_session, SSH_OPTIONS_COMPRESSION_S_C, "yes") ||
+         ssh_options_set(_ssh_session, SSH_OPTIONS_COMPRESSION_LEVEL, &_compression))) {
+        std::cerr << "Set SSH compression failed. " << std::endl;
+        return 1;
+    }
+
     // ssh connect
     if (ssh_connect(_ssh_session) != SSH_OK) {
         std::cerr << "SSH connection failed. " << std::endl;
@@ -75,8 +175,184 @@ bool SSHSession::do_connect(const std::string& path) {
         return 1;
     }
 
-    // create sftp session
-    _sftp_session = sftp_new(_ssh_session);
+    return 0;
+}
+
+// should be called with mutex held by lock
+// blocks until data may have arrived for any channel, mutex is released meanwhile
+void SSHConnection::wait(boost::unique_lock<boost::mutex>& lock) {
+    uint64_t dispatches = _dispatches;
+
+    while (dispatches == _dispatches) {
+        // another channel is polling, it wakes everyone up when data arrives
+        if (_polling) {
+            _progress.wait(lock);
+            continue;
+        }
+
+        _polling = 1;
+        lock.unlock();
+
+        pollfd fd = { ssh_get_fd(_ssh_session), POLLIN, 0 };
+        poll(&fd, 1, poll_timeout);
+
+        lock.lock();
+        _polling = 0;
+
+        // whoever reads first dispatches data to all channels
+        ++_dispatches;
+        _progress.notify_all();
+    }
+}
+
+// send a message ignored by server if it has been idle for interval
+// returns true if connection is broken
+bool SSHConnection::keepalive(const std::chrono::steady_clock::duration interval) {
+    // busy connections don't need it
+    boost::unique_lock<boost::mutex> lock(_mutex, boost::try_to_lock);
+    if (!lock.owns_lock()) return 0;
+
+    if (!isConnected()) return 1;
+
+    if (std::chrono::steady_clock::now() - _last_active < interval) return 0;
+
+    if (ssh_send_ignore(_ssh_session, "keepalive") != SSH_OK) return 1;
+    touch();
+
+    return 0;
+}
+
+// returns current connection, connects if there's none 
+// or if current one has a different compression level,
+// channels on the old one keep it until they're closed
+// returns nullptr on error
+std::shared_ptr<SSHConnection> SSHTransport::connection(const int compression) {
+    boost::unique_lock<boost::mutex> lock(_mutex);
+
+    if (_connection && _connection->compression() == compression) return _connection;
+
+    std::shared_ptr<SSHConnection> connection(new SSHConnection(compression));
+    if (connection->connect(_address, _port)) return nullptr;
+
+    ++_connects;
+    return _connection = connection;
+}
+
+// keep current connection from being closed by server or firewalls for idleness
+void SSHTransport::keepalive(const std::chrono::steady_clock::duration interval) {
+    std::shared_ptr<SSHConnection> connection;
+    {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        connection = _connection;
+    }
+
+    if (connection && connection->keepalive(interval))
+        invalidate(connection);
+}
+
+intmax_t SSHSession::read(const std::string& path, const size_t mtime,
+                          const size_t offset, const size_t size, char* buff,
+                          const size_t file_size, bool* unchanged) {
+    // compression level has changed, move to a connection of the new level
+    if (_sftp_session && compression() != _compression) disconnect();
+
+    // if channel already exists
+    if (_sftp_session) {
+        intmax_t bytes_read = readFile(path, mtime, offset, size, buff, file_size, unchanged);
+        // read success
+        if (bytes_read >= 0) return bytes_read;
+        // read failed, channel or connection may be broken
+        disconnect();
+    }
+
+    // reopen channel failed
+    if (connect()) return -1;
+
+    intmax_t bytes_read = readFile(path, mtime, offset, size, buff, file_size, unchanged);
+
+    // read success
+    if (bytes_read >= 0) return bytes_read;
+    
+    std::cerr << "SFTP read file failed. " << std::endl;
+
+    // read failed
+    disconnect();
+
+    return bytes_read;
+}
+
+// read with connection mutex held
+intmax_t SSHSession::readFile(const std::string& path, const size_t mtime, 
+                              const size_t offset, const size_t size, char* buff,
+                              const size_t file_size, bool* unchanged) {
+    boost::unique_lock<boost::mutex> lock(_connection->mutex());
+    _lock = &lock;
+
+    File* file = openFile(path, mtime);
+    intmax_t bytes_read = file? file->read_window.read(offset, size, buff): -1;
+
+    // stat after reading, so that a change during the read is seen
+    if (unchanged && bytes_read >= 0) {
+        sftp_attributes attributes = sftp_fstat(file->handle);
+        *unchanged = attributes && attributes->mtime == mtime && attributes->size == file_size;
+        if (attributes) sftp_attributes_free(attributes);
+    }
+
+    _connection->touch();
+    _lock = nullptr;
+
+    return bytes_read;
+}
+
+// should be called with connection mutex held
+// returns nullptr on error
+SSHSession::File* SSHSession::openFile(const std::string& path, const size_t mtime) {
+    auto ite = _file_index.find(path);
+
+    if (ite != _file_index.end()) {
+        // move to front
+        if (ite->second->mtime == mtime) {
+            _files.splice(_files.begin(), _files, ite->second);
+            return &_files.front();
+        }
+        // file changed since it was opened
+        closeFile(ite->second);
+    }
+
+    // evict least recently used
+    if (_files.size() >= max_open_files) 
+        closeFile(std::prev(_files.end()));
+
+    // open file
+    sftp_file handle = sftp_open(_sftp_session, path.c_str(), O_RDONLY, 0);
+    if (handle == nullptr) {
+        std::cerr << "SFTP open file failed. " << std::endl;
+        return nullptr;
+    }
+
+    // responses are collected without blocking other channels
+    sftp_file_set_nonblocking(handle);
+
+    _files.emplace_front();
+    File& file = _files.front();
+    file.path = path;
+    file.mtime = mtime;
+    file.handle = handle;
+    file.read_window.reset(handle, [this]() { _connection->wait(*_lock); });
+    _file_index[path] = _files.begin();
+
+    return &file;
+}
+
+bool SSHSession::do_connect() {
+    // key exchange and authentication happen only if there's no connection to this host
+    _connection = _transport->connection(_compression);
+    if (!_connection) return 1;
+
+    boost::unique_lock<boost::mutex> lock(_connection->mutex());
+
+    // open a sftp channel
+    _sftp_session = sftp_new(_connection->session());
 
     if (_sftp_session == nullptr) {
         std::cerr << "Create SFTP session failed. " << std::endl;
@@ -89,14 +365,29 @@ bool SSHSession::do_connect(const std::string& path) {
         return 1;
     }
 
-    // open file
-    _file_handle = sftp_open(_sftp_session, path.c_str(), O_RDONLY, 0);
-    if (_file_handle == nullptr) {
-        std::cerr << "SFTP open file failed. " << std::endl;
-        return 1;
-    }
-    _file_open = path;
+    _connection->touch();
 
     return 0;
 }
 
+// close channel, and the connection if it's broken
+void SSHSession::disconnect() {
+    if (!_connection) return;
+
+    bool broken;
+    {
+        boost::unique_lock<boost::mutex> lock(_connection->mutex());
+        _lock = &lock;
+
+        while (_files.size()) closeFile(_files.begin());
+        if (_sftp_session) sftp_free(_sftp_session);
+        _sftp_session = nullptr;
+
+        broken = !_connection->isConnected();
+        _connection->touch();
+        _lock = nullptr;
+    }
+
+    if (broken) _transport->invalidate(_connection);
+    _connection.reset();
+}
@@ -18,14 +18,195 @@
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
 #include <string>
+#include <deque>
+#include <list>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
 #include <iostream>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 
+// Sliding window of asynchronous SFTP read requests on one open remote file.
+// Completed chunks are parked in a buffer that later reads consume, so a 
+// sequential reader pays about one round trip per window instead of one per read.
+// The window starts at one chunk, doubles on each sequential read
+// and falls back to one chunk on seek.
+// The file is nonblocking, wait is called whenever a response hasn't arrived yet.
+class SFTPReadWindow {
+public:
+    typedef std::function<void ()> Waiter;
+
+    SFTPReadWindow(): _file(nullptr), _next(0), _buffer_offset(0), _window(1), _eof(0) { }
+
+    // bind to a newly opened file, or to nullptr before the file is closed
+    // requests in flight are forgotten, their responses die with the file
+    void reset(sftp_file file, const Waiter& wait = Waiter()) {
+        _file = file;
+        if (wait) _wait = wait;
+        _requests.clear();
+        _buffer.clear();
+        _next = _buffer_offset = 0;
+        _window = 1;
+        _eof = 0;
+    }
+
+    // wait for requests in flight before the file is closed
+    // so that their responses don't pile up in the sftp session
+    void close() {
+        drain();
+        reset(nullptr);
+    }
+
+    // returns num of bytes read on success
+    // returns < 0 on error
+    intmax_t read(const size_t offset, const size_t size, char* buff);
+
+private:
+    struct Request {
+        uint32_t id;
+        size_t offset;
+    };
+
+    // blocks until response of request arrives
+    int await(const Request& request, char* buff);
+
+    // keep the window full and at least cover [.., end)
+    // returns true on error
+    bool fill(const size_t end);
+
+    // wait for and discard all requests in flight
+    void drain();
+
+    // bytes requested by each asynchronous read
+    static const uint32_t chunk_size = 32 * 1024;
+    // max num of requests in flight driven by window
+    static const size_t max_window = 32;
+    // max num of requests in flight, including those covering one big read
+    static const size_t max_requests = 128;
+
+    sftp_file _file;
+    Waiter _wait;
+    // requests in flight, contiguous from the end of _buffer up to _next
+    std::deque<Request> _requests;
+    size_t _next;
+    // completed but not yet consumed data, starting at _buffer_offset
+    std::string _buffer;
+    size_t _buffer_offset;
+    size_t _window;
+    bool _eof;
+};
+
+// One authenticated SSH connection to a host, SFTP channels of many SSHSessions 
+// are multiplexed on it. libssh isn't thread-safe, so every call into it is made 
+// with mutex held. A channel waiting for data releases mutex, so that others 
+// can send requests and collect responses meanwhile.
+class SSHConnection {
+public:
+    SSHConnection(const int compression): 
+        _compression(compression), _ssh_session(nullptr), _polling(0), _dispatches(0),
+        _last_active(std::chrono::steady_clock::now()) { }
+
+    ~SSHConnection() {
+        if (_ssh_session) {
+            ssh_disconnect(_ssh_session);
+            ssh_free(_ssh_session);
+        }
+    }
+
+    // key exchange and authentication
+    // returns true on error
+    bool connect(const std::string& address, const unsigned int port);
+
+    ssh_session session() const { return _ssh_session; }
+
+    boost::mutex& mutex() { return _mutex; }
+
+    // zlib level of data from server, 0 if not compressed
+    int compression() const { return _compression; }
+
+    // should be called with mutex held by lock
+    // blocks until data may have arrived for any channel, mutex is released meanwhile
+    void wait(boost::unique_lock<boost::mutex>& lock);
+
+    // should be called with mutex held
+    // after a channel has talked to server, data of other channels may have been 
+    // dispatched to them, wake them up
+    void touch() {
+        _last_active = std::chrono::steady_clock::now();
+        ++_dispatches;
+        _progress.notify_all();
+    }
+
+    // should be called with mutex held
+    bool isConnected() const { return ssh_is_connected(_ssh_session); }
+
+    // send a message ignored by server if it has been idle for interval
+    // returns true if connection is broken
+    bool keepalive(const std::chrono::steady_clock::duration interval);
+
+    // waiting channels check for their data at least this often
+    static const int poll_timeout = 20;
+
+private:
+    int _compression;
+    ssh_session _ssh_session;
+
+    boost::mutex _mutex;
+    boost::condition_variable _progress;
+    // a waiting channel is polling socket
+    bool _polling;
+    // changes when channels should check for their data again
+    uint64_t _dispatches;
+    std::chrono::steady_clock::time_point _last_active;
+};
+
+// All member functions are thread-safe.
+// Keeps one connection to a host shared by all its sessions, 
+// a new one is made only after it breaks.
+class SSHTransport {
+public:
+    SSHTransport(const std::string& host, const uint16_t port):
+        _address(host), _port(port), _connects(0) { }
+
+    // returns current connection, connects if there's none 
+    // or if current one has a different compression level,
+    // channels on the old one keep it until they're closed
+    // returns nullptr on error
+    std::shared_ptr<SSHConnection> connection(const int compression);
+
+    // connection is found broken, next call to connection() connects again
+    // channels still on it keep it alive until they're closed
+    void invalidate(const std::shared_ptr<SSHConnection>& connection) {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        if (_connection == connection) _connection.reset();
+    }
+
+    // keep current connection from being closed by server or firewalls for idleness
+    void keepalive(const std::chrono::steady_clock::duration interval);
+
+    // num of connections made
+    uint64_t connects() const {
+        boost::unique_lock<boost::mutex> lock(_mutex);
+        return _connects;
+    }
+
+private:
+    std::string _address;
+    uint16_t _port;
+
+    mutable boost::mutex _mutex;
+    std::shared_ptr<SSHConnection> _connection;
+    uint64_t _connects;
+};
 
+// An SFTP channel on the connection of its transport.
 class SSHSession {
 public:
-    SSHSession(const std::string& host, const uint16_t port):
-        _address(host), _port(port) { }
+    SSHSession(const std::shared_ptr<SSHTransport>& transport):
+        _transport(transport), _compression(0), _sftp_session(nullptr), _lock(nullptr) { }
 
     ~SSHSession() {
         disconnect();
@@ -35,44 +216,88 @@ public:
     //    Because many programs read a lot of times and each time a small chunk of data
     //    SSH server will automatically close the connection if not hear anything 
     //    for a while, and the connection will be recreated at next read.
-    // 2. This implementation of read() is extremely slow when read big file.
-    //    Use prefetch if u wanna speed up.
-    intmax_t read(const std::string& path, const size_t offset, const size_t size, char* buff);
+    // 2. Sequential reads are pipelined by a read-ahead window of asynchronous 
+    //    requests, random reads still cost one round trip each.
+    // 3. Recently read files are kept open, reading another file on the same host
+    //    opens one more handle instead of reconnecting.
+    //    mtime is the modification time the caller knows of this file, 
+    //    a handle opened for a different mtime is reopened.
+    // 4. Reconnecting opens a channel on the connection of the host,
+    //    a new SSH connection is made only if that one is broken, 
+    //    or compressed at a different level.
+    // 5. If unchanged isn't nullptr, the file is stat'ed after reading and it's set to
+    //    whether the file still has mtime and file_size, data is returned either way.
+    intmax_t read(const std::string& path, const size_t mtime, 
+                  const size_t offset, const size_t size, char* buff,
+                  const size_t file_size = 0, bool* unchanged = nullptr);
 
-    intmax_t do_read(const size_t offset, const size_t size, char* buff) {
-        if (sftp_seek64(_file_handle, offset) != 0) return -1;
-        return sftp_read(_file_handle, buff, size);
-    }
-
-    bool connect(const std::string& path) {
-        if (do_connect(path)) {
+    bool connect() {
+        if (do_connect()) {
             disconnect();
             return 1;
         }
         return 0;
     }
 
-    bool do_connect(const std::string& path);
-
-    void disconnect() {
-        _file_open.clear();
-        if (_file_handle) sftp_close(_file_handle);
-        _file_handle = nullptr;
-        if (_sftp_session) sftp_free(_sftp_session);
-        _sftp_session = nullptr;
-        ssh_disconnect(_ssh_session);
-        ssh_free(_ssh_session);
-        _ssh_session = nullptr;
+    bool do_connect();
+
+    // zlib level of data from server, 0 disables compression
+    // a channel on a connection of another level reconnects at next read
+    void setCompression(const int level) { _compression = level; }
+
+    // zlib level of the connection this channel is on
+    int compression() const { return _connection? _connection->compression(): 0; }
+
+    // returns true if this file is open
+    bool isOpen(const std::string& path) const {
+        return _file_index.find(path) != _file_index.end();
     }
 
+    // close channel, and the connection if it's broken
+    void disconnect();
+
 private:
-    std::string _address;
-    unsigned int _port;
+    // an open remote file
+    struct File {
+        std::string path;
+        size_t mtime;
+        sftp_file handle;
+        SFTPReadWindow read_window;
+    };
 
-    ssh_session _ssh_session;
+    // most recently used at front
+    typedef std::list<File> FileList;
+
+    // read with connection mutex held
+    intmax_t readFile(const std::string& path, const size_t mtime, 
+                      const size_t offset, const size_t size, char* buff,
+                      const size_t file_size, bool* unchanged);
+
+    // should be called with connection mutex held
+    // returns nullptr on error
+    File* openFile(const std::string& path, const size_t mtime);
+
+    // should be called with connection mutex held
+    void closeFile(const FileList::iterator file) {
+        file->read_window.close();
+        sftp_close(file->handle);
+        _file_index.erase(file->path);
+        _files.erase(file);
+    }
+
+    // max num of files kept open
+    static const size_t max_open_files = 16;
+
+    std::shared_ptr<SSHTransport> _transport;
+    int _compression;
+
+    std::shared_ptr<SSHConnection> _connection;
     sftp_session _sftp_session;
-    sftp_file _file_handle;
-    std::string _file_open;
+    // lock of connection mutex while it's held
+    boost::unique_lock<boost::mutex>* _lock;
+
+    FileList _files;
+    std::unordered_map<std::string, FileList::iterator> _file_index;
 };
 
 #endif /* LIBSSH_WRAPPER_H_ */
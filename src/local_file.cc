@@ -0,0 +1,121 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: local_file.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 27, 2015
+ *  Time: 16:21:30
+ *  Description: open files shared by this host
+ *****************************************************************************/
+#include "local_file.h"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+const size_t LocalFileCache::max_files;
+
+static uint64_t statMtimeNs(const struct stat& st) {
+    return uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+LocalFile::~LocalFile() {
+    close(_fd);
+}
+
+// returns num of bytes read on success
+// returns < 0 on error
+intmax_t LocalFile::read(const size_t offset, const size_t size, char* buff) const {
+    size_t bytes_read = 0;
+
+    while (bytes_read < size) {
+        ssize_t rtv = pread(_fd, buff + bytes_read, size - bytes_read, offset + bytes_read);
+        if (rtv < 0 && errno == EINTR) continue;
+        if (rtv < 0) return -1;
+        if (rtv == 0) break;
+        bytes_read += rtv;
+    }
+
+    return bytes_read;
+}
+
+// true if it's still the file at path described by st
+bool LocalFile::same(const struct stat& st) const {
+    return _inode == uint64_t(st.st_ino) && _mtime_ns == statMtimeNs(st);
+}
+
+// a cached file is reopened if modification time in nanoseconds or inode 
+// of path has changed since it was opened, e.g. it was rewritten or replaced
+// returns nullptr on error
+LocalFileCache::File LocalFileCache::open(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st)) return nullptr;
+
+    {
+        boost::unique_lock< boost::mutex > lock(_mutex);
+
+        auto ite = _index.find(path);
+        if (ite != _index.end()) {
+            // move to front
+            if (ite->second->second->same(st)) {
+                _files.splice(_files.begin(), _files, ite->second);
+                return _files.front().second;
+            }
+            // file changed since it was opened
+            _files.erase(ite->second);
+            _index.erase(ite);
+        }
+    }
+
+    // open without lock
+    File file = doOpen(path);
+    if (!file) return nullptr;
+
+    boost::unique_lock< boost::mutex > lock(_mutex);
+
+    // another thread has opened it too, keep the newer one
+    auto ite = _index.find(path);
+    if (ite != _index.end()) {
+        _files.erase(ite->second);
+        _index.erase(ite);
+    }
+
+    // evict least recently used
+    if (_files.size() >= max_files) {
+        _index.erase(_files.back().first);
+        _files.pop_back();
+    }
+
+    _files.emplace_front(path, file);
+    _index[path] = _files.begin();
+
+    return file;
+}
+
+// close all cached files, e.g. after working directory is rescanned
+// files still in use are closed when released
+void LocalFileCache::clear() {
+    boost::unique_lock< boost::mutex > lock(_mutex);
+    _index.clear();
+    _files.clear();
+}
+
+LocalFileCache::File LocalFileCache::doOpen(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return nullptr;
+    }
+
+    return std::make_shared<LocalFile>(fd, st.st_mtime, statMtimeNs(st), st.st_ino);
+}
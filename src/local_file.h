@@ -0,0 +1,87 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: local_file.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 27, 2015
+ *  Time: 15:08:44
+ *  Description: open files shared by this host
+ *****************************************************************************/
+#ifndef LOCAL_FILE_H_
+#define LOCAL_FILE_H_
+
+#include <list>
+#include <memory>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <boost/thread/mutex.hpp>
+
+// An open local file, it's closed when the last user releases it.
+// Files are read with pread only, a mapping would raise SIGBUS 
+// if the file is truncated while it's read.
+class LocalFile {
+public:
+    LocalFile(const int fd, const size_t mtime, const uint64_t mtime_ns, const uint64_t inode):
+        _fd(fd), _mtime(mtime), _mtime_ns(mtime_ns), _inode(inode) { }
+    ~LocalFile();
+
+    LocalFile(const LocalFile&) = delete;
+    LocalFile& operator=(const LocalFile&) = delete;
+
+    // returns num of bytes read on success
+    // returns < 0 on error
+    intmax_t read(const size_t offset, const size_t size, char* buff) const;
+
+    int fd() const { return _fd; }
+
+    // modification time when it was opened
+    size_t mtime() const { return _mtime; }
+    uint64_t mtimeNs() const { return _mtime_ns; }
+
+    // true if it's still the file at path described by st
+    bool same(const struct stat& st) const;
+
+private:
+    int _fd;
+    size_t _mtime;
+    // modification time in nanoseconds and inode when it was opened
+    uint64_t _mtime_ns;
+    uint64_t _inode;
+};
+
+// All member functions are thread-safe.
+// Cache of open local files keyed by path, so reading files shared by 
+// this host doesn't open and close them on every read.
+class LocalFileCache {
+public:
+    typedef std::shared_ptr<LocalFile> File;
+
+    // a cached file is reopened if modification time in nanoseconds or inode 
+    // of path has changed since it was opened, e.g. it was rewritten or replaced
+    // returns nullptr on error
+    File open(const std::string& path);
+
+    // close all cached files, e.g. after working directory is rescanned
+    // files still in use are closed when released
+    void clear();
+
+private:
+    // max num of files kept open
+    static const size_t max_files = 256;
+
+    static File doOpen(const std::string& path);
+
+    boost::mutex _mutex;
+    // most recently used at front
+    std::list< std::pair<std::string, File> > _files;
+    std::unordered_map< std::string, std::list< std::pair<std::string, File> >::iterator > _index;
+};
+
+#endif /* LOCAL_FILE_H_ */
@@ -18,6 +18,8 @@
 #include <stdexcept>
 #include <boost/filesystem.hpp>
 #include <boost/asio/ip/address.hpp>
+#include "compression.h"
+#include "block_cache.h"
 
 void OptionParser::initialize() {
     using namespace std;
@@ -46,6 +48,51 @@ void OptionParser::initialize() {
         ("ssh-port,s", value<uint16_t>(), 
             "Specify SSH port. Default value is 22. Listen at this port so that "
             "other nodes can create a SFTP connection. ")
+        ("block-port", value<uint16_t>(), 
+            "Specify port of native block server. Other nodes read shared files of this host "
+            "from this port instead of SFTP. Data isn't encrypted, use it only on trusted networks. "
+            "Disabled if not specified. ")
+        ("compression", value<string>(), 
+            "Specify compression of file data from other hosts, one of auto, off, fast and best. "
+            "Default value is auto, which chooses it for each host from measured throughput. ")
+        ("ssh-sessions", value<size_t>(), 
+            "Specify max number of SSH sessions to each remote host. Default value is 4. "
+            "Concurrent reads from the same host use different sessions. ")
+        ("bandwidth", value<size_t>(), 
+            "Specify max bandwidth in KiB/s used to read from each remote host. "
+            "Default value is 0, which means unlimited. ")
+        ("cache-memory", value<size_t>(), 
+            "Specify memory budget of remote file cache in MiB. Default value is 256. "
+            "0 disables this cache, otherwise it must be at least 2. ")
+        ("stripes", value<size_t>(), 
+            "Specify number of stripes fetched in parallel when a big remote file is read "
+            "sequentially, each over its own SSH session. Default value is 4. 1 disables striping. ")
+        ("stripe-threshold", value<size_t>(), 
+            "Specify size in MiB from which remote files are fetched in stripes. Default value is 64. ")
+        ("readahead", value<size_t>(), 
+            "Specify max size in MiB fetched ahead of sequential or strided readers of remote "
+            "files. Default value is 4. 0 disables readahead. ")
+        ("eager-size", value<size_t>(), 
+            "Specify size in KiB up to which remote files are fetched in one request when "
+            "they're opened and read from memory until closed. Default value is 256. 0 disables it. ")
+        ("cache-dir", value<boost::filesystem::path>(), 
+            "Specify directory of disk cache. Blocks of remote files are kept in this "
+            "directory and reused after restart. Disk cache is disabled if not specified. ")
+        ("cache-size", value<size_t>(), 
+            "Specify capacity of disk cache in MiB. Default value is 1024. ")
+        ("kernel-cache", 
+            "Let kernel keep page cache of unchanged shared files of this host between opens, "
+            "so repeated reads of them are served by kernel without this program. ")
+        ("content-hash", 
+            "Hash content of shared files of this host at startup, so that identical files "
+            "on all hosts share cached data and are read from the fastest host. ")
+        ("scan-threads", value<size_t>(), 
+            "Specify number of threads scanning shared files of this host at startup. "
+            "Default value is 8. More threads help on network filesystems. ")
+        ("watch-delay", value<size_t>(), 
+            "Specify in milliseconds how long changes of shared files of this host are collected "
+            "before they're published to other hosts. Default value is 200. 0 disables watching, "
+            "files changed after startup are then shared only after restart. Linux only. ")
         ("mount-point,m", value<boost::filesystem::path>(), 
             "Specify filesysem mount point. ")
         ("working-directory,w", value<boost::filesystem::path>(), 
@@ -119,6 +166,116 @@ void OptionParser::parse(const int argc, char** argv) {
     else
         ssh_port = 22;
 
+    // --block-port
+    if (vm.count("block-port"))
+        block_port = vm["block-port"].as<uint16_t>();
+    else
+        block_port = 0;
+
+    // --compression
+    string compression_name = vm.count("compression")? vm["compression"].as<string>(): "auto";
+    if (compression_name == "auto") 
+        compression = Compression::automatic;
+    else if (compression_name == "off") 
+        compression = Compression::none;
+    else if (compression_name == "fast") 
+        compression = Compression::fast;
+    else if (compression_name == "best") 
+        compression = Compression::best;
+    else
+        throw invalid_argument("Invalid option(s). Compression must be one of auto, off, fast and best. ");
+
+    // --ssh-sessions
+    if (vm.count("ssh-sessions"))
+        ssh_sessions = vm["ssh-sessions"].as<size_t>();
+    else
+        ssh_sessions = 4;
+
+    if (ssh_sessions == 0)
+        throw invalid_argument("Invalid option(s). Number of SSH sessions must be positive. ");
+
+    // --bandwidth
+    if (vm.count("bandwidth"))
+        bandwidth = vm["bandwidth"].as<size_t>();
+    else
+        bandwidth = 0;
+
+    // --cache-memory
+    if (vm.count("cache-memory"))
+        cache_memory = vm["cache-memory"].as<size_t>();
+    else
+        cache_memory = 256;
+
+    if (cache_memory && cache_memory << 20 < BlockCache::min_capacity)
+        throw invalid_argument("Invalid option(s). Memory budget of cache must be 0 or at least " + 
+                               to_string(BlockCache::min_capacity >> 20) + " MiB. ");
+
+    // --stripes
+    if (vm.count("stripes"))
+        stripes = vm["stripes"].as<size_t>();
+    else
+        stripes = 4;
+
+    if (stripes == 0)
+        throw invalid_argument("Invalid option(s). Number of stripes must be positive. ");
+
+    // --stripe-threshold
+    if (vm.count("stripe-threshold"))
+        stripe_threshold = vm["stripe-threshold"].as<size_t>();
+    else
+        stripe_threshold = 64;
+
+    // --readahead
+    if (vm.count("readahead"))
+        readahead = vm["readahead"].as<size_t>();
+    else
+        readahead = 4;
+
+    // --eager-size
+    if (vm.count("eager-size"))
+        eager_size = vm["eager-size"].as<size_t>();
+    else
+        eager_size = 256;
+
+    // --cache-dir
+    if (vm.count("cache-dir"))
+        cache_dir = vm["cache-dir"].as<boost::filesystem::path>().string();
+    else
+        cache_dir.clear();
+
+    // check cache-dir
+    if (cache_dir.size() && !boost::filesystem::exists(cache_dir))
+        throw std::invalid_argument("Invalid option(s). Cache directory \"" + cache_dir + "\" not exists. ");
+    if (cache_dir.size() && !boost::filesystem::is_directory(cache_dir))
+        throw std::invalid_argument("Invalid option(s). Cache directory \"" + cache_dir + "\" is not directory. ");
+
+    // --cache-size
+    if (vm.count("cache-size"))
+        cache_size = vm["cache-size"].as<size_t>();
+    else
+        cache_size = 1024;
+
+    // --kernel-cache
+    kernel_cache = vm.count("kernel-cache");
+
+    // --content-hash
+    content_hash = vm.count("content-hash");
+
+    // --scan-threads
+    if (vm.count("scan-threads"))
+        scan_threads = vm["scan-threads"].as<size_t>();
+    else
+        scan_threads = 8;
+
+    if (scan_threads == 0)
+        throw invalid_argument("Invalid option(s). Number of scan threads must be positive. ");
+
+    // --watch-delay
+    if (vm.count("watch-delay"))
+        watch_delay = vm["watch-delay"].as<size_t>();
+    else
+        watch_delay = 200;
+
     // --mount-point
     if (vm.count("mount-point"))
         mount_point = vm["mount-point"].as<boost::filesystem::path>().string();
@@ -36,6 +36,36 @@ struct OptionParser {
     uint16_t tcp_port;
     // port for ssh, default is 22
     uint16_t ssh_port;
+    // port of native block server, 0 disables it
+    uint16_t block_port;
+    // zlib level of file data from other hosts, -1 if it's chosen automatically
+    int compression;
+    // max num of ssh sessions to each remote host, default is 4
+    size_t ssh_sessions;
+    // max KiB/s read from each remote host, default is 0, which means unlimited
+    size_t bandwidth;
+    // memory budget of block cache in MiB, default is 256, 0 disables it
+    size_t cache_memory;
+    // num of stripes fetched in parallel from a big remote file, default is 4
+    size_t stripes;
+    // remote files not smaller than this are fetched in stripes, in MiB, default is 64
+    size_t stripe_threshold;
+    // max readahead window of remote files in MiB, default is 4, 0 disables it
+    size_t readahead;
+    // remote files not larger than this are fetched at open, in KiB, default is 256, 0 disables it
+    size_t eager_size;
+    // directory of disk cache, empty if disabled
+    std::string cache_dir;
+    // capacity of disk cache in MiB, default is 1024
+    size_t cache_size;
+    // kernel keeps page cache of files on this host between opens
+    bool kernel_cache;
+    // hash content of files on this host
+    bool content_hash;
+    // num of threads scanning working directory at startup, default is 8
+    size_t scan_threads;
+    // changes of working directory are published after this many milliseconds, 0 disables it
+    size_t watch_delay;
     std::string mount_point;
     std::string working_dir;
 
@@ -0,0 +1,149 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: path_index.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 26, 2015
+ *  Time: 16:38:05
+ *  Description: open-addressing hash table from hash of full path to tree node
+ *****************************************************************************/
+#ifndef PATH_INDEX_H_
+#define PATH_INDEX_H_
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+// Maps 64-bit hashes of full paths to nodes, with linear probing.
+// Only hashes are stored, so a lookup checks name of the node found,
+// and different paths of the same hash make it ambiguous. A path not indexed
+// is mistaken for one only if both hash and name are the same, odds of 2^-64.
+// Node is a type with a std::string member name.
+template <class Node>
+class PathIndex {
+public:
+    // FNV-1a, hash of "/a/b" is extend(extend(seed, "a"), "b")
+    static const uint64_t seed = 0xcbf29ce484222325ull;
+
+    // hash of path + "/" + name from hash of path
+    static uint64_t extend(uint64_t hash, const char* name, const size_t length) {
+        static const uint64_t prime = 0x100000001b3ull;
+        hash = (hash ^ '/') * prime;
+        for (size_t i = 0; i < length; ++i)
+            hash = (hash ^ static_cast<unsigned char>(name[i])) * prime;
+        return hash;
+    }
+
+    PathIndex(): _size(0) { }
+
+    size_t size() const { return _size; }
+    // num of slots and bytes taken by them, for statistics
+    size_t capacity() const { return _slots.size(); }
+    size_t bytes() const { return _slots.capacity() * sizeof(Slot); }
+
+    void clear() {
+        std::vector<Slot>().swap(_slots);
+        _size = 0;
+    }
+
+    void insert(const uint64_t hash, const Node* node) {
+        // keep load factor under 3/4
+        if ((_size + 1) * 4 > _slots.size() * 3) grow();
+
+        size_t mask = _slots.size() - 1;
+        size_t i = home(hash, mask);
+        while (_slots[i].node) i = (i + 1) & mask;
+
+        _slots[i].hash = hash;
+        _slots[i].node = node;
+        ++_size;
+    }
+
+    void erase(const uint64_t hash, const Node* node) {
+        if (!_size) return;
+
+        size_t mask = _slots.size() - 1;
+        size_t i = home(hash, mask);
+        for (; _slots[i].node; i = (i + 1) & mask)
+            if (_slots[i].node == node) break;
+        if (!_slots[i].node) return;
+
+        // shift back following slots which can't be reached from their homes otherwise
+        for (size_t j = i;;) {
+            j = (j + 1) & mask;
+            if (!_slots[j].node) break;
+
+            size_t k = home(_slots[j].hash, mask);
+            // stays if its home is cyclically in (i, j]
+            if (i <= j? (i < k && k <= j): (i < k || k <= j)) continue;
+
+            _slots[i] = _slots[j];
+            i = j;
+        }
+
+        _slots[i].node = nullptr;
+        --_size;
+    }
+
+    // returns node named name at path of hash, nullptr if none
+    // ambiguous is set if more than one are found
+    const Node* find(const uint64_t hash, const char* name, const size_t length,
+                     bool& ambiguous) const {
+        ambiguous = 0;
+        if (!_size) return nullptr;
+
+        const Node* found = nullptr;
+        size_t mask = _slots.size() - 1;
+        for (size_t i = home(hash, mask); _slots[i].node; i = (i + 1) & mask) {
+            const Slot& slot = _slots[i];
+            if (slot.hash != hash || slot.node->name.size() != length ||
+                memcmp(slot.node->name.data(), name, length))
+                continue;
+
+            if (found) {
+                ambiguous = 1;
+                return nullptr;
+            }
+            found = slot.node;
+        }
+
+        return found;
+    }
+
+    // slot where probing for hash starts, in a table of mask + 1 slots
+    // low bits of FNV-1a are poorly mixed
+    static size_t home(uint64_t hash, const size_t mask) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash & mask;
+    }
+
+private:
+    struct Slot {
+        uint64_t hash;
+        // nullptr if empty
+        const Node* node;
+    };
+
+    void grow() {
+        std::vector<Slot> slots(_slots.size()? _slots.size() * 2: 1024, Slot{ 0, nullptr });
+        slots.swap(_slots);
+        _size = 0;
+        for (const auto& slot: slots)
+            if (slot.node) insert(slot.hash, slot.node);
+    }
+
+    std::vector<Slot> _slots;
+    size_t _size;
+};
+
+template <class Node>
+const uint64_t PathIndex<Node>::seed;
+
+#endif /* PATH_INDEX_H_ */
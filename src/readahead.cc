@@ -0,0 +1,104 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: readahead.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul  9, 2015
+ *  Time: 16:03:12
+ *  Description: access pattern detection and readahead window of an open file
+ *****************************************************************************/
+#include "readahead.h"
+#include <algorithm>
+
+const size_t Readahead::min_window;
+const size_t Readahead::max_records;
+
+// record a read of [offset, offset + size) of a file of file_size bytes
+// returns ranges to fetch, empty if nothing needs fetching now
+std::vector<Readahead::Range> Readahead::record(const size_t offset, const size_t size, 
+                                                const size_t file_size, const size_t max_window) {
+    std::vector<Range> ranges;
+    if (!size || offset >= file_size) return ranges;
+
+    size_t end = std::min(offset + size, file_size);
+
+    // reading from beginning of file counts as sequential
+    Pattern pattern;
+    if (offset == _prev_end) 
+        pattern = SEQUENTIAL;
+    else if (_stride && offset == _prev_offset + _stride)
+        pattern = STRIDED;
+    else 
+        pattern = RANDOM;
+
+    // a gap forward may be the first step of a strided reader
+    if (pattern != STRIDED)
+        _stride = offset > _prev_end? offset - _prev_offset: 0;
+
+    // what's fetched for another pattern doesn't count
+    if (pattern != _pattern) _ahead_end = 0;
+
+    _pattern = pattern;
+    _prev_offset = offset;
+    _prev_end = offset + size;
+
+    switch (pattern) {
+        case RANDOM: 
+            _window /= 2;
+            if (_window < min_window) _window = 0;
+            break;
+
+        case SEQUENTIAL: {
+            // more than half of last window is still ahead of reader
+            if (_ahead_end > end && _ahead_end - end > _window / 2) break;
+
+            _window = grow(size, max_window);
+
+            size_t begin = std::max(_ahead_end, end);
+            size_t stop = std::min(end + _window, file_size);
+            if (stop > begin) ranges.push_back(Range{ begin, stop - begin });
+
+            _ahead_end = std::max(_ahead_end, stop);
+            break;
+        }
+
+        case STRIDED: {
+            size_t records = std::min(std::max<size_t>(_window / size, 1), max_records);
+
+            // more than half of last records are still ahead of reader
+            if (_ahead_end > offset + records / 2 * _stride) break;
+
+            _window = grow(size, max_window);
+            records = std::min(std::max<size_t>(_window / size, 1), max_records);
+            if (!_window) break;
+
+            size_t next = std::max(_ahead_end, offset + _stride);
+            for (size_t i = 0; i < records && next < file_size; ++i, next += _stride)
+                ranges.push_back(Range{ next, std::min(size, file_size - next) });
+
+            _ahead_end = next;
+            break;
+        }
+    }
+
+    return ranges;
+}
+
+// returns window size after a sequential or strided read of size bytes
+size_t Readahead::grow(const size_t size, const size_t max_window) const {
+    if (_window) return std::min(_window * 2, max_window);
+    return std::min(std::max(4 * size, min_window), max_window);
+}
+
+const char* Readahead::name(const Pattern pattern) {
+    switch (pattern) {
+        case SEQUENTIAL: return "sequential";
+        case STRIDED: return "strided";
+        default: return "random";
+    }
+}
@@ -0,0 +1,72 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: readahead.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul  9, 2015
+ *  Time: 15:27:50
+ *  Description: access pattern detection and readahead window of an open file
+ *****************************************************************************/
+#ifndef READAHEAD_H_
+#define READAHEAD_H_
+
+#include <vector>
+#include <cstddef>
+
+// Access pattern of an open file, fed by offsets of reads.
+// Like kernel's on-demand readahead, the window ramps up while reads stay 
+// sequential or strided, and shrinks down to nothing on random reads.
+// A new window is fetched when the reader has consumed half of the last one,
+// so fetching overlaps reading.
+class Readahead {
+public:
+    enum Pattern { RANDOM, SEQUENTIAL, STRIDED };
+
+    // a range of the file to fetch ahead of the reader
+    struct Range {
+        size_t offset;
+        size_t length;
+    };
+
+    Readahead(): _pattern(RANDOM), _prev_offset(0), _prev_end(0), _stride(0), 
+                 _window(0), _ahead_end(0) { }
+
+    // record a read of [offset, offset + size) of a file of file_size bytes
+    // returns ranges to fetch, empty if nothing needs fetching now
+    std::vector<Range> record(const size_t offset, const size_t size, 
+                              const size_t file_size, const size_t max_window);
+
+    Pattern pattern() const { return _pattern; }
+
+    // bytes fetched ahead of the reader each time
+    size_t window() const { return _window; }
+
+    static const char* name(const Pattern pattern);
+
+    // window on the first sequential read is 4 reads, but not smaller than this
+    static const size_t min_window = 128 * 1024;
+    // max num of records fetched ahead of a strided reader
+    static const size_t max_records = 32;
+
+private:
+    // returns window size after a sequential or strided read of size bytes
+    size_t grow(const size_t size, const size_t max_window) const;
+
+    Pattern _pattern;
+    size_t _prev_offset;
+    size_t _prev_end;
+    // distance between starts of the last two reads
+    size_t _stride;
+    size_t _window;
+
+    // sequential: data has been fetched up to _ahead_end
+    // strided: records have been fetched up to the one starting at _ahead_end
+    size_t _ahead_end;
+};
+
+#endif /* READAHEAD_H_ */
@@ -0,0 +1,110 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: ssh_manager.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 20, 2015
+ *  Time: 14:02:17
+ *  Description: Manage ssh connections
+ *****************************************************************************/
+#include "ssh_manager.h"
+#include <map>
+#include <iterator>
+#include <algorithm>
+
+// print num of sessions, connections, checkouts, contentions and compression of each host
+void SSHManager::printStats(std::ostream& os) const {
+    // copy pools out so that printing doesn't block inserting hosts
+    std::map< uint64_t, std::shared_ptr<SessionPool> > pools;
+    {
+        boost::shared_lock< boost::shared_mutex > lock(_access);
+        pools.insert(_pools.begin(), _pools.end());
+    }
+
+    for (const auto& pool: pools) {
+        os << "host " << pool.first << ": ";
+        pool.second->printStats(os);
+        os << "\n";
+    }
+}
+
+const int SSHManager::keepalive_interval;
+
+// keepalive thread
+void SSHManager::keepalive() {
+    boost::unique_lock<boost::mutex> lock(_keepalive_mutex);
+
+    while (!_stopped) {
+        _keepalive_cv.timed_wait(lock, boost::posix_time::seconds(keepalive_interval));
+        if (_stopped) break;
+
+        std::vector< std::shared_ptr<SessionPool> > pools;
+        {
+            boost::shared_lock< boost::shared_mutex > pools_lock(_access);
+            for (const auto& pool: _pools) pools.push_back(pool.second);
+        }
+
+        lock.unlock();
+        for (const auto& pool: pools) pool->keepalive();
+        lock.lock();
+    }
+}
+
+// blocks until a session is available
+// prefers an idle session that has path open
+SSHSession* SSHManager::SessionPool::checkout(const std::string& path) {
+    boost::unique_lock< boost::mutex > lock(_mutex);
+
+    ++_checkouts;
+
+    // all sessions are busy and pool is full, wait for one
+    if (_idle.empty() && _sessions.size() >= _max_size) {
+        ++_contentions;
+        while (_idle.empty())
+            _available.wait(lock);
+    }
+
+    // grow lazily, connection is created at first read
+    if (_idle.empty()) {
+        _sessions.push_back(new SSHSession(_transport));
+        _sessions.back()->setCompression(_link.level());
+        return _sessions.back();
+    }
+
+    // no one has this file open, take the most recently returned one
+    auto ite = std::find_if(_idle.rbegin(), _idle.rend(), 
+                            [&path](const SSHSession* s) { return s->isOpen(path); });
+    if (ite == _idle.rend()) ite = _idle.rbegin();
+
+    SSHSession* session = *ite;
+    _idle.erase(std::next(ite).base());
+
+    // it reconnects at next read if level has changed
+    session->setCompression(_link.level());
+
+    return session;
+}
+
+void SSHManager::SessionPool::checkin(SSHSession* session) {
+    {
+        boost::unique_lock< boost::mutex > lock(_mutex);
+        _idle.push_back(session);
+    }
+    _available.notify_one();
+}
+
+void SSHManager::SessionPool::printStats(std::ostream& os) {
+    boost::unique_lock< boost::mutex > lock(_mutex);
+    os << "sessions " << _sessions.size() << "/" << _max_size
+       << ", connections " << _transport->connects()
+       << ", busy " << _sessions.size() - _idle.size()
+       << ", checkouts " << _checkouts
+       << ", contentions " << _contentions
+       << ", compression level " << _link.level()
+       << ", throughput " << uint64_t(_link.throughput() / 1024) << " KiB/s";
+}
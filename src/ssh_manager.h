@@ -15,40 +15,175 @@
 #ifndef SSH_MANAGER_H_
 #define SSH_MANAGER_H_
 
+#include <memory>
+#include <vector>
+#include <ostream>
 #include <unordered_map>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include "libssh_wrapper.h"
+#include "compression.h"
 
 
+// All member functions are thread-safe.
+// Each host has a pool of sessions, a reader checks out one session 
+// and returns it after reading, so parallel readers use parallel channels.
+// Sessions of a host are SFTP channels on one SSH connection, which is kept alive
+// by a background thread.
 class SSHManager {
 public:
+    SSHManager(): _pool_size(4), _compression(Compression::automatic), _stopped(0) {
+        _keepalive_thread = boost::thread(&SSHManager::keepalive, this);
+    }
+
     ~SSHManager() {
-        for (auto i: _connections)
-            delete i.second;
+        {
+            boost::unique_lock<boost::mutex> lock(_keepalive_mutex);
+            _stopped = 1;
+        }
+        _keepalive_cv.notify_all();
+        _keepalive_thread.join();
     }
 
+    // max num of sessions per host, sessions are created lazily
+    // should be called before inserting any host
+    void setPoolSize(const size_t pool_size) { _pool_size = pool_size? pool_size: 1; }
+
+    // zlib level or Compression::automatic
+    // should be called before inserting any host
+    void setCompression(const int level) { _compression = level; }
+
     // returns true if found
     bool findHost(const uint64_t id) const {
-        return _connections.find(id) != _connections.end();
+        boost::shared_lock< boost::shared_mutex > lock(_access);
+        return _pools.find(id) != _pools.end();
     }
 
     int insertHost(const uint64_t id, const std::string& addr, const uint16_t port) {
-        return !_connections.emplace(id, new SSHSession(addr, port)).second;
+        boost::unique_lock< boost::shared_mutex > lock(_access);
+        std::shared_ptr<SessionPool> pool(new SessionPool(addr, port, _pool_size, _compression));
+        return !_pools.emplace(id, pool).second;
     }
 
     int removeHost(const uint64_t id) {
-        return !_connections.erase(id);
+        boost::unique_lock< boost::shared_mutex > lock(_access);
+        return !_pools.erase(id);
     }
 
-    intmax_t read(const uint64_t id, const std::string& path, const size_t offset,
-                  const size_t size, char* buff) const {
-        auto ite = _connections.find(id);
-        if (ite == _connections.end()) return -1;
+    // if unchanged isn't nullptr, it's set to whether the file still has mtime 
+    // and file_size after reading
+    intmax_t read(const uint64_t id, const std::string& path, const size_t mtime,
+                  const size_t offset, const size_t size, char* buff,
+                  const size_t file_size = 0, bool* unchanged = nullptr) const {
+        std::shared_ptr<SessionPool> pool = findPool(id);
+        if (!pool) return -1;
+
+        SSHSession* session = pool->checkout(path);
+        auto start = std::chrono::steady_clock::now();
+        intmax_t bytes_read = session->read(path, mtime, offset, size, buff, file_size, unchanged);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // bytes on the wire aren't known if it's compressed, estimate them,
+        // so that the level keeps following the link
+        if (bytes_read >= intmax_t(LinkMeter::min_sample)) {
+            int level = session->compression();
+            pool->record(level? Compression::estimate(buff, bytes_read, level): bytes_read, 
+                         elapsed);
+        }
+        pool->checkin(session);
+
+        return bytes_read;
+    }
 
-        return ite->second->read(path, offset, size, buff);
+    // bytes per second on the wire of reads from this host, 0 if not measured
+    double throughput(const uint64_t id) const {
+        std::shared_ptr<SessionPool> pool = findPool(id);
+        return pool? pool->throughput(): 0;
     }
 
+    // print num of sessions, connections, checkouts, contentions and compression of each host
+    void printStats(std::ostream& os) const;
+
+    // idle connections are sent a message this often
+    static const int keepalive_interval = 30;
+
 private:
-    std::unordered_map<uint64_t, SSHSession*> _connections;
+    class SessionPool {
+    public:
+        SessionPool(const std::string& addr, const uint16_t port, const size_t max_size, 
+                    const int compression):
+            _transport(new SSHTransport(addr, port)), _max_size(max_size), _link(compression),
+            _checkouts(0), _contentions(0) { }
+
+        ~SessionPool() {
+            for (auto session: _sessions)
+                delete session;
+        }
+
+        // blocks until a session is available
+        // prefers an idle session that has path open
+        SSHSession* checkout(const std::string& path);
+
+        void checkin(SSHSession* session);
+
+        // measure throughput on the wire
+        void record(const size_t bytes, const std::chrono::steady_clock::duration elapsed) {
+            _link.record(bytes, elapsed);
+        }
+
+        double throughput() const { return _link.throughput(); }
+
+        void keepalive() { 
+            _transport->keepalive(std::chrono::seconds(keepalive_interval));
+        }
+
+        void printStats(std::ostream& os);
+
+    private:
+        // connection shared by all sessions
+        std::shared_ptr<SSHTransport> _transport;
+        size_t _max_size;
+
+        // compression level of sessions, they reconnect when it changes
+        LinkMeter _link;
+
+        boost::mutex _mutex;
+        boost::condition_variable _available;
+
+        // all sessions of this host
+        std::vector<SSHSession*> _sessions;
+        // sessions not checked out, most recently returned at back
+        std::vector<SSHSession*> _idle;
+
+        // num of checkouts
+        uint64_t _checkouts;
+        // num of checkouts that had to wait for a session
+        uint64_t _contentions;
+    };
+
+    std::shared_ptr<SessionPool> findPool(const uint64_t id) const {
+        boost::shared_lock< boost::shared_mutex > lock(_access);
+        auto ite = _pools.find(id);
+        if (ite == _pools.end()) return nullptr;
+        return ite->second;
+    }
+
+    // keepalive thread
+    void keepalive();
+
+    size_t _pool_size;
+    int _compression;
+
+    boost::mutex _keepalive_mutex;
+    boost::condition_variable _keepalive_cv;
+    bool _stopped;
+    boost::thread _keepalive_thread;
+
+    // lock for _pools
+    mutable boost::shared_mutex _access;
+    std::unordered_map< uint64_t, std::shared_ptr<SessionPool> > _pools;
 };
 
 
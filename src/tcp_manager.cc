@@ -40,16 +40,32 @@ void TCPManager::read(const Packet& packet, const TCPMasterMessager::Connection:
        | dir tree length | dir tree bytes sequence | host length | host bytes sequence |
 
        packet type:
-       1: master sends recognition, slave id, merged dir tree, merged hosts info
+       1: slave missed some changes and asks for a full snapshot
+       packet content: empty
+
+       packet type:
+       2: slave sends changes of its own files
+       packet content:
+       |    8 bytes   |    delta length     |
+       | delta length | delta bytes sequence |
+
+       packet type:
+       1: master sends recognition, slave id, version, merged dir tree, merged hosts info
+       packet content:
+       |  8 bytes |  8 bytes |     8 bytes     |     dir tree length     |      8 bytes      |  hosts info length   |
+       | slave id |  version | dir tree length | dir tree bytes sequence | hosts info length | hosts bytes sequence |
+
+       packet type:
+       2: master sends full snapshot of dir tree and hosts info
        packet content:
        |  8 bytes |     8 bytes     |     dir tree length     |      8 bytes      |  hosts info length   |
-       | slave id | dir tree length | dir tree bytes sequence | hosts info length | hosts bytes sequence |
+       |  version | dir tree length | dir tree bytes sequence | hosts info length | hosts bytes sequence |
 
        packet type:
-       2: master sends updated dir tree and hosts info
+       3: master sends changes of dir tree and hosts info from version base to version
        packet content:
-       |     8 bytes     |     dir tree length     |      8 bytes      |  hosts info length   |
-       | dir tree length | dir tree bytes sequence | hosts info length | hosts bytes sequence |
+       |  8 bytes |  8 bytes |    8 bytes   |    delta length     |
+       |   base   |  version | delta length | delta bytes sequence |
 
 
 
@@ -76,7 +92,17 @@ void TCPManager::read(const Packet& packet, const TCPMasterMessager::Connection:
             data += hosts_seq_len;
 
             return _owner->newConnection(dir_tree_seq, hosts_seq, handle);
-        } 
+        } case 1: {
+            return _owner->sendSnapshot(handle);
+        } case 2: {
+            uint64_t delta_seq_len = network_to_host_64(data);
+            data += sizeof(uint64_t);
+
+            std::string delta_seq = std::string(data, delta_seq_len);
+            data += delta_seq_len;
+
+            return _owner->receiveChanges(delta_seq, handle);
+        }
     }
 
 }
@@ -117,6 +143,9 @@ void TCPManager::read(const Packet& packet) {
             uint64_t slave_id = network_to_host_64(data);
             data += sizeof(uint64_t);
 
+            uint64_t version = network_to_host_64(data);
+            data += sizeof(uint64_t);
+
             uint64_t dir_tree_seq_len = network_to_host_64(data);
             data += sizeof(uint64_t);
 
@@ -129,8 +158,11 @@ void TCPManager::read(const Packet& packet) {
             std::string hosts_seq = std::string(data, hosts_seq_len);
             data += hosts_seq_len;
 
-            return _owner->slaveRecognized(slave_id, dir_tree_seq, hosts_seq);
+            return _owner->slaveRecognized(slave_id, version, dir_tree_seq, hosts_seq);
         } case 2: {
+            uint64_t version = network_to_host_64(data);
+            data += sizeof(uint64_t);
+
             uint64_t dir_tree_seq_len = network_to_host_64(data);
             data += sizeof(uint64_t);
 
@@ -143,7 +175,21 @@ void TCPManager::read(const Packet& packet) {
             std::string hosts_seq = std::string(data, hosts_seq_len);
             data += hosts_seq_len;
 
-            return _owner->updateInfo(dir_tree_seq, hosts_seq);
+            return _owner->updateInfo(version, dir_tree_seq, hosts_seq);
+        } case 3: {
+            uint64_t base = network_to_host_64(data);
+            data += sizeof(uint64_t);
+
+            uint64_t version = network_to_host_64(data);
+            data += sizeof(uint64_t);
+
+            uint64_t delta_seq_len = network_to_host_64(data);
+            data += sizeof(uint64_t);
+
+            std::string delta_seq = std::string(data, delta_seq_len);
+            data += delta_seq_len;
+
+            return _owner->applyDelta(base, version, delta_seq);
         }
     }
 }
@@ -0,0 +1,94 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: thread_pool.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jun 30, 2015
+ *  Time: 10:05:26
+ *  Description: a fixed number of threads running posted tasks
+ *****************************************************************************/
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <thread>
+#include <memory>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+class ThreadPool {
+public:
+    ~ThreadPool() { stop(); }
+
+    void start(const size_t num_threads) {
+        _work.reset(new boost::asio::io_service::work(_io_service));
+        for (size_t i = 0; i < num_threads; ++i)
+            _threads.emplace_back([this]() { _io_service.run(); });
+    }
+
+    // tasks already posted are run before it returns, 
+    // so groups waiting for them are done
+    void stop() {
+        _work.reset();
+        for (auto& t: _threads) 
+            if (t.joinable()) t.join();
+        _threads.clear();
+
+        // tasks posted when no thread was running, they're run by this thread
+        _io_service.reset();
+        _io_service.run();
+        // it may be started again
+        _io_service.reset();
+    }
+
+    size_t size() const { return _threads.size(); }
+
+    template <class Task>
+    void post(Task task) { _io_service.post(task); }
+
+private:
+    boost::asio::io_service _io_service;
+    std::unique_ptr<boost::asio::io_service::work> _work;
+    std::vector<std::thread> _threads;
+};
+
+// Tasks posted through a group can be waited for together
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool& pool): _pool(pool), _pending(0) { }
+    ~TaskGroup() { wait(); }
+
+    template <class Task>
+    void post(Task task) {
+        {
+            boost::unique_lock< boost::mutex > lock(_mutex);
+            ++_pending;
+        }
+        _pool.post([this, task]() {
+            task();
+            // notify with lock held, this group may be destroyed right after wait()
+            boost::unique_lock< boost::mutex > lock(_mutex);
+            --_pending;
+            _done.notify_all();
+        });
+    }
+
+    void wait() {
+        boost::unique_lock< boost::mutex > lock(_mutex);
+        while (_pending) _done.wait(lock);
+    }
+
+private:
+    ThreadPool& _pool;
+    size_t _pending;
+    boost::mutex _mutex;
+    boost::condition_variable _done;
+};
+
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,239 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: tree_delta.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 22, 2015
+ *  Time: 10:52:13
+ *  Description: changes to subtrees of hosts between two versions of dir tree
+ *****************************************************************************/
+#include "tree_delta.h"
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+
+static const char tree_delta_magic[4] = { 'G', 'S', 'T', 'D' };
+static const uint64_t tree_delta_version = 1;
+
+typedef DirTree::TreeNode TreeNode;
+
+// copy all but name and children
+static void copyAttributes(const TreeNode& from, TreeNode& to) {
+    to.type = from.type;
+    to.size = from.size;
+    to.mtime = from.mtime;
+    to.host_id = from.host_id;
+    to.num_links = from.num_links;
+    to.hash = from.hash;
+}
+
+// returns true if top-level entry on path exists and belongs to host
+static bool ownedBy(const DirTree& tree, const uint64_t host_id, const boost::filesystem::path& path) {
+    auto ite = path.begin();
+    if (ite == path.end() || ++ite == path.end()) return 0;
+
+    auto top = tree.root()->children.find(ite->string());
+    return top != tree.root()->children.end() && top->host_id == host_id;
+}
+
+// absolute, without . or ..
+static bool isValidPath(const std::string& path) {
+    if (path.empty() || path.front() != '/') return 0;
+    for (const auto& component: boost::filesystem::path(path))
+        if (component == ".." || component == ".") return 0;
+    return 1;
+}
+
+// add children of root of tree under directory dir, as nodes of host
+// nodes of the same names are replaced
+void TreeDelta::add(const uint64_t host_id, const std::string& dir, DirTree&& tree) {
+    _ops.emplace_back();
+    _ops.back().type = ADD;
+    _ops.back().host_id = host_id;
+    _ops.back().path = dir;
+    _ops.back().tree = std::move(tree);
+}
+
+// remove a node and its descendants, or all nodes of host if path is "/"
+void TreeDelta::remove(const uint64_t host_id, const std::string& path) {
+    _ops.emplace_back();
+    _ops.back().type = REMOVE;
+    _ops.back().host_id = host_id;
+    _ops.back().path = path;
+}
+
+// set attributes of a node to those of node, its children are kept
+void TreeDelta::modify(const uint64_t host_id, const std::string& path, const TreeNode& node) {
+    _ops.emplace_back();
+    _ops.back().type = MODIFY;
+    _ops.back().host_id = host_id;
+    _ops.back().path = path;
+    _ops.back().tree.initialize();
+    copyAttributes(node, *_ops.back().tree.root());
+}
+
+// add a host, or update it if its id is known
+void TreeDelta::addHost(const Hosts::Host& host) {
+    _ops.emplace_back();
+    _ops.back().type = HOST;
+    _ops.back().host_id = host.id;
+    _ops.back().host = host;
+}
+
+// apply operations in order, nodes of trees of operations are moved into tree
+// operations touching nodes of other hosts, or nodes not found, fail,
+// but removing a node not found succeeds
+// returns true on error, tree and hosts may have been partly changed
+bool TreeDelta::apply(DirTree& tree, Hosts& hosts) {
+    for (auto& op: _ops)
+        if (apply(op, tree, hosts)) return 1;
+    return 0;
+}
+
+// returns true on error
+bool TreeDelta::apply(Op& op, DirTree& tree, Hosts& hosts) {
+    // host id 0 is undefined
+    if (!op.host_id || !tree.root()) return 1;
+
+    if (op.type == HOST) {
+        while (hosts.size() < op.host.id) hosts.push(Hosts::Host());
+
+        if (op.host.id < hosts.size())
+            hosts[op.host.id] = op.host;
+        else
+            hosts.push(op.host);
+
+        return 0;
+    }
+
+    if (op.type == REMOVE && op.path == "/") {
+        tree.removeOf(op.host_id);
+        return 0;
+    }
+
+    if (op.type == ADD) {
+        const TreeNode* dir = tree.find(op.path);
+        if (!dir || !op.tree.root()) return 1;
+
+        bool top_level = dir == tree.root();
+        if (!top_level && (dir->type != TreeNode::DIRECTORY || !ownedBy(tree, op.host_id, op.path)))
+            return 1;
+
+        auto& children = op.tree.root()->children;
+        for (const auto& child: children) {
+            if (top_level) {
+                auto ite = dir->children.find(child.name.data(), child.name.size());
+                if (ite != dir->children.end() && ite->host_id != op.host_id) return 1;
+            }
+
+            // nodes of a host are added only by it
+            child.host_id = op.host_id;
+            child.setHostID(op.host_id);
+        }
+
+        // children are moved, replacing those of the same names
+        tree.addChildren(op.path, *dir, std::move(children));
+
+        return 0;
+    }
+
+    boost::filesystem::path path(op.path);
+    std::string parent_path = path.parent_path().string();
+    std::string name = path.filename().string();
+    const TreeNode* parent = tree.find(parent_path);
+
+    // removing a node already removed changes nothing
+    if (!parent || !parent->children.count(name)) return op.type != REMOVE;
+
+    if (!ownedBy(tree, op.host_id, path)) return 1;
+
+    if (op.type == REMOVE) {
+        tree.removeChild(parent_path, *parent, name);
+        return 0;
+    }
+
+    if (op.type == MODIFY && op.tree.root()) {
+        // modified in place, children and index are kept
+        TreeNode& node = *parent->children.find(name);
+        uint64_t host_id = node.host_id;
+        copyAttributes(*op.tree.root(), node);
+        node.host_id = host_id;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Binary format: magic, version, num of operations, then each operation.
+// Trees are in format of DirTree, compressed at zlib level.
+std::string TreeDelta::serialize(const TreeDelta& delta, const int level) {
+    std::string out(tree_delta_magic, sizeof(tree_delta_magic));
+    BinaryWriter writer(out);
+    writer.varint(tree_delta_version);
+    writer.varint(delta._ops.size());
+
+    for (const auto& op: delta._ops) {
+        writer.varint(op.type);
+        writer.varint(op.host_id);
+
+        if (op.type == HOST) {
+            op.host.encode(writer);
+            continue;
+        }
+
+        writer.string(op.path);
+        if (op.type != REMOVE)
+            writer.string(DirTree::serialize(op.tree, level));
+    }
+
+    return out;
+}
+
+// throws std::exception on malformed data
+TreeDelta TreeDelta::deserialize(const std::string& byte_sequence) {
+    TreeDelta delta;
+
+    if (byte_sequence.compare(0, sizeof(tree_delta_magic), tree_delta_magic, sizeof(tree_delta_magic)))
+        throw std::runtime_error("Not a dir tree delta. ");
+
+    BinaryReader reader(byte_sequence.data() + sizeof(tree_delta_magic),
+                        byte_sequence.size() - sizeof(tree_delta_magic));
+
+    if (reader.varint() != tree_delta_version)
+        throw std::runtime_error("Unsupported version of dir tree delta. ");
+
+    size_t num_ops = reader.varint();
+    // each operation takes at least 3 bytes
+    if (num_ops > reader.remaining() / 3)
+        throw std::runtime_error("Malformed binary data. ");
+
+    delta._ops.resize(num_ops);
+    for (auto& op: delta._ops) {
+        uint64_t type = reader.varint();
+        if (type > HOST) throw std::runtime_error("Malformed binary data. ");
+        op.type = OpType(type);
+        op.host_id = reader.varint();
+
+        if (op.type == HOST) {
+            op.host.decode(reader);
+            if (op.host.id != op.host_id) throw std::runtime_error("Malformed binary data. ");
+            continue;
+        }
+
+        op.path = reader.string();
+        if (!isValidPath(op.path)) throw std::runtime_error("Malformed binary data. ");
+
+        if (op.type != REMOVE) {
+            op.tree = DirTree::deserialize(reader.string());
+            if (!op.tree.root()) throw std::runtime_error("Malformed binary data. ");
+        }
+    }
+
+    if (reader.remaining()) throw std::runtime_error("Malformed binary data. ");
+
+    return delta;
+}
@@ -0,0 +1,80 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: tree_delta.h 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 22, 2015
+ *  Time: 10:17:45
+ *  Description: changes to subtrees of hosts between two versions of dir tree
+ *****************************************************************************/
+#ifndef TREE_DELTA_H_
+#define TREE_DELTA_H_
+
+#include <string>
+#include <vector>
+#include "dir_tree.h"
+#include "host.h"
+
+// A list of operations, each on the subtree of one host,
+// i.e. on top-level entries of dir tree owned by that host and their descendants.
+// Master applies it to its dir tree and sends it to slaves,
+// which apply it to their copies in place.
+class TreeDelta {
+public:
+    enum OpType { ADD, REMOVE, MODIFY, HOST };
+
+    struct Op {
+        OpType type;
+        uint64_t host_id;
+        // ADD: directory nodes are added under
+        // REMOVE, MODIFY: node removed or modified, "/" removes all nodes of host
+        std::string path;
+        // ADD: nodes to add are children of its root
+        // MODIFY: attributes are those of its root
+        DirTree tree;
+        // HOST: host added or updated
+        Hosts::Host host;
+    };
+
+    // add children of root of tree under directory dir, as nodes of host
+    // nodes of the same names are replaced
+    void add(const uint64_t host_id, const std::string& dir, DirTree&& tree);
+
+    // remove a node and its descendants, or all nodes of host if path is "/"
+    void remove(const uint64_t host_id, const std::string& path);
+
+    // set attributes of a node to those of node, its children are kept
+    void modify(const uint64_t host_id, const std::string& path, const DirTree::TreeNode& node);
+
+    // add a host, or update it if its id is known
+    void addHost(const Hosts::Host& host);
+
+    bool empty() const { return _ops.empty(); }
+    const std::vector<Op>& ops() const { return _ops; }
+
+    // apply operations in order, nodes of trees of operations are moved into tree
+    // operations touching nodes of other hosts, or nodes not found, fail,
+    // but removing a node not found succeeds
+    // returns true on error, tree and hosts may have been partly changed
+    bool apply(DirTree& tree, Hosts& hosts);
+
+    // Binary format: magic, version, num of operations, then each operation.
+    // Trees are in format of DirTree, compressed at zlib level.
+    static std::string serialize(const TreeDelta& delta, const int level);
+
+    // throws std::exception on malformed data
+    static TreeDelta deserialize(const std::string& byte_sequence);
+
+private:
+    // returns true on error
+    static bool apply(Op& op, DirTree& tree, Hosts& hosts);
+
+    std::vector<Op> _ops;
+};
+
+#endif /* TREE_DELTA_H_ */
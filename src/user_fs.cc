@@ -15,16 +15,67 @@
 #include "user_fs.h"
 #include <stdexcept>
 #include <ctime>
+#include <cerrno>
+#include <cctype>
+#include <map>
+#include <sstream>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "bytes_order.h"
+#include "content_hash.h"
+#include "dir_scanner.h"
 
 // calling order of functions below:
-// master node: setMaster -> initDirTree -> initHost -> initTCPNetwork
-// slave node: initDirTree -> initHost -> initTCPNetwork
+// master node: setMaster -> initLocalFiles -> initContentHash -> initDirTree -> initHost -> 
+//              initBlockServer -> initCompression -> initSSH -> initBandwidth -> 
+//              initStriping -> initReadahead -> initEagerFetch -> initCache -> 
+//              initTCPNetwork -> initWatcher
+// slave node: initLocalFiles -> initContentHash -> initDirTree -> initHost -> 
+//             initBlockServer -> initCompression -> initSSH -> initBandwidth -> 
+//             initStriping -> initReadahead -> initEagerFetch -> initCache -> 
+//             initTCPNetwork -> initWatcher
+
+const size_t UserFS::stripe_blocks;
+const size_t UserFS::block_server_threads;
+const size_t UserFS::prefetch_threads;
+const size_t UserFS::warm_threads;
+const size_t UserFS::max_warmups;
+const size_t UserFS::max_kept_mtimes;
+const size_t UserFS::hash_threads;
 
 void UserFS::setMaster() { _host_id = 1; }
 
+UserFS::~UserFS() {
+    // warmers finish the file at hand soon
+    boost::unique_lock<boost::mutex> lock(_control_mutex);
+    for (const auto& warmup: _warmups) warmup->cancelled = 1;
+    lock.unlock();
+
+    // files waiting for hashers are dropped
+    boost::unique_lock<boost::mutex> hashing_lock(_hashing_mutex);
+    _hashing_stopped = 1;
+}
+
+// if kernel_cache is true, kernel keeps page cache of unchanged files on this host
+// between opens, so only the first read of them reaches this process
+void UserFS::initLocalFiles(const bool kernel_cache) {
+    _kernel_cache = kernel_cache;
+}
+
+// if enabled, content of each regular file of this host is hashed when 
+// dir tree is built, so identical files on all hosts share cached data
+void UserFS::initContentHash(const bool enabled) {
+    _content_hash = enabled;
+}
+
+// working dir is scanned with scan_threads threads
 // this function may throw exceptions
-void UserFS::initDirTree(const std::string& working_dir) {
+void UserFS::initDirTree(const std::string& working_dir, const size_t scan_threads) {
     using namespace boost::filesystem;
 
     boost::unique_lock< boost::shared_mutex > lock(_access);
@@ -34,6 +85,9 @@ void UserFS::initDirTree(const std::string& working_dir) {
     if (_working_dir.size() && _working_dir.back() != '/')
         _working_dir.push_back('/');
 
+    // files opened before may have been changed
+    _local_files.clear();
+
     _dir_tree.initialize();
     _dir_tree.root()->type = DirTree::TreeNode::DIRECTORY;
     // It seems there's is a portable way to get dir size, just set it to 0
@@ -43,74 +97,42 @@ void UserFS::initDirTree(const std::string& working_dir) {
     _dir_tree.root()->mtime = time(nullptr);
     _dir_tree.root()->num_links = hard_link_count(_working_dir);
 
-    // here
-    std::function< void (const path&, const DirTree::TreeNode&) > traverseDirectory;
-    traverseDirectory = [this, &traverseDirectory]
-        (const path& dir, const DirTree::TreeNode& parent)->void {
-        for (auto& f: directory_iterator(dir)) {
-            auto file_type = symlink_status(f).type();
-
-            decltype(DirTree::TreeNode::type) treenode_type;
-
-            switch (file_type) {
-                case boost::filesystem::file_type::directory_file: 
-                    treenode_type = DirTree::TreeNode::DIRECTORY;
-                    break;
-                case boost::filesystem::file_type::regular_file: 
-                    treenode_type = DirTree::TreeNode::REGULAR;
-                    break;
-                case boost::filesystem::file_type::character_file:
-                    treenode_type = DirTree::TreeNode::CHRDEVICE;
-                    break;
-                case boost::filesystem::file_type::block_file:
-                    treenode_type = DirTree::TreeNode::BLKDEVICE;
-                    break;
-                case boost::filesystem::file_type::fifo_file:
-                    treenode_type = DirTree::TreeNode::FIFO;
-                    break;
-                case boost::filesystem::file_type::symlink_file:
-                    treenode_type = DirTree::TreeNode::SYMLINK;
-                    break;
-                case boost::filesystem::file_type::socket_file:
-                    treenode_type = DirTree::TreeNode::SOCKET;
-                    break;
-                case boost::filesystem::file_type::type_unknown:
-                default:
-                    treenode_type = DirTree::TreeNode::UNKNOWN;
-            }
-            
-            if (treenode_type == DirTree::TreeNode::UNKNOWN)
-                continue;
-            else if (treenode_type == DirTree::TreeNode::DIRECTORY) {
-                DirTree::TreeNode dirnode;
-                dirnode.type = treenode_type;
-                dirnode.name = f.path().filename().string();
-                dirnode.size = 0;
-                dirnode.mtime = last_write_time(f.path());
-                dirnode.host_id = _host_id;
-                dirnode.num_links = hard_link_count(f.path());
-
-                auto insert_rtv = parent.children.insert(dirnode);
-
-                traverseDirectory(f, *(insert_rtv.first));
-            } else {
-                DirTree::TreeNode filenode;
-                filenode.type = treenode_type;
-                filenode.name = f.path().filename().string();
-                filenode.size = file_size(f);
-                filenode.mtime = last_write_time(f.path());
-                filenode.host_id = _host_id;
-                filenode.num_links = hard_link_count(f.path());
-
-                parent.children.insert(filenode);
-            }
-        }
-    };
+    _scan_threads = scan_threads? scan_threads: 1;
+
+    auto start = std::chrono::steady_clock::now();
 
-    traverseDirectory(_working_dir, *_dir_tree.root());
+    DirScanner scanner(_host_id, _content_hash, _scan_threads);
+    scanner.scan(_working_dir, *_dir_tree.root());
+
+    _scanned_entries = scanner.entries();
+    _scan_errors = scanner.errors();
+    _scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    _dir_tree.reindex();
+    indexCopies();
+}
+
+// fill attributes of file at p, its children aren't scanned and it isn't hashed
+// returns true on error, or if its type is unknown
+bool UserFS::makeNode(const boost::filesystem::path& p, DirTree::TreeNode& node) {
+    if (DirScanner::makeNode(AT_FDCWD, p.c_str(), node)) return 1;
+
+    node.name = p.filename().string();
+    node.host_id = _host_id;
+
+    return 0;
+}
+
+// add nodes of files under dir to children of parent, recursively
+// this function may throw exceptions
+void UserFS::scanDirectory(const boost::filesystem::path& dir, const DirTree::TreeNode& parent) {
+    DirScanner scanner(_host_id, _content_hash, _scan_threads);
+    scanner.scan(dir.string(), parent);
 }
 
-void UserFS::initHost(const std::string& addr, const uint16_t tcp_port, const uint16_t ssh_port) {
+// block_port is 0 if this node doesn't run a block server
+void UserFS::initHost(const std::string& addr, const uint16_t tcp_port, 
+                      const uint16_t ssh_port, const uint16_t block_port) {
     boost::unique_lock< boost::shared_mutex > lock(_access);
 
     // this functions should only be called when program initializes
@@ -121,11 +143,92 @@ void UserFS::initHost(const std::string& addr, const uint16_t tcp_port, const ui
     host.working_dir = _working_dir;
     host.tcp_port = tcp_port;
     host.ssh_port = ssh_port;
+    host.block_port = block_port;
 
     // push self's host at 0
     _hosts.push(host);
 }
 
+// serve files of this host to other nodes at port, 0 disables it
+// returns true on error
+bool UserFS::initBlockServer(const std::string& addr, const uint16_t port) {
+    if (!port) return 0;
+
+    using namespace std::placeholders;
+    _block_server.reset(new BlockServer(std::bind(&UserFS::serveBlock, this, _1, _2, _3, _4, _5, _6)));
+
+    return _block_server->start(addr, port, block_server_threads);
+}
+
+// zlib level of file data from other hosts, or Compression::automatic
+// to choose it for each host from measured throughput
+void UserFS::initCompression(const int level) {
+    _compression = level;
+    _ssh_manager.setCompression(level);
+
+    // dir tree is sent to all nodes at once, it's cheap to compress anyway
+    _tree_compression = level == Compression::none? Compression::none: Compression::fast;
+}
+
+// max num of SSH sessions to each remote host
+// it's also the num of requests sent to a host at the same time
+void UserFS::initSSH(const size_t sessions_per_host) {
+    _ssh_manager.setPoolSize(sessions_per_host);
+    _sessions_per_host = sessions_per_host? sessions_per_host: 1;
+}
+
+// max bytes per second read from each remote host, 0 for unlimited
+void UserFS::initBandwidth(const size_t rate) {
+    _bandwidth = rate;
+}
+
+// remote files not smaller than threshold bytes and read sequentially are
+// fetched in this num of stripes in parallel, each over its own SSH session
+// 1 disables striping, it needs block cache or disk cache
+void UserFS::initStriping(const size_t stripes, const size_t threshold) {
+    _stripes = stripes? stripes: 1;
+    _stripe_threshold = threshold;
+
+    // each reader fetching stripes waits for stripes - 1 workers
+    if (_stripes > 1)
+        _workers.start(2 * (_stripes - 1));
+}
+
+// remote regular files not larger than size bytes are fetched in one request 
+// at open and read from memory until release, 0 disables it
+void UserFS::initEagerFetch(const size_t size) {
+    _eager_size = size;
+}
+
+// remote files read sequentially or strided are fetched ahead of reader
+// in a window growing up to max_window bytes, 0 disables readahead
+// it needs block cache or disk cache
+void UserFS::initReadahead(const size_t max_window) {
+    _max_readahead = max_window;
+
+    if (_max_readahead) 
+        _prefetchers.start(prefetch_threads);
+}
+
+// memory budget of block cache in bytes, 0 disables it
+// disk cache is disabled if cache_dir is empty, capacity is in bytes
+// returns true on error
+bool UserFS::initCache(const size_t memory_size, const std::string& cache_dir, 
+                       const size_t cache_size) {
+    // a smaller budget would cache nothing
+    if (memory_size && memory_size < BlockCache::min_capacity) return 1;
+
+    _block_cache.setCapacity(memory_size);
+
+    if (!cache_dir.empty() && _disk_cache.initialize(cache_dir, cache_size)) 
+        return 1;
+
+    if (_block_cache.enabled() || _disk_cache.enabled())
+        _warmers.start(warm_threads);
+
+    return 0;
+}
+
 // returns true on error
 bool UserFS::initTCPNetwork(const std::string& addr, const uint16_t port) {
     bool is_master = _host_id == 1;
@@ -137,8 +240,11 @@ bool UserFS::initTCPNetwork(const std::string& addr, const uint16_t port) {
     _tcp_manager.start();
 
     // push master's host
-    if (is_master) 
+    if (is_master) {
+        boost::unique_lock< boost::shared_mutex > lock(_access);
         _hosts.push(_hosts[0]);
+        _tree_version = 1;
+    }
     // else wait for master's recognition or rejection
     else {
         std::string dir_tree_seq;
@@ -146,7 +252,7 @@ bool UserFS::initTCPNetwork(const std::string& addr, const uint16_t port) {
 
         {
             boost::shared_lock< boost::shared_mutex > lock(_access);
-            dir_tree_seq = DirTree::serialize(_dir_tree);
+            dir_tree_seq = DirTree::serialize(_dir_tree, _tree_compression);
             host_seq = Hosts::Host::serialize(_hosts[0]);
         }
 
@@ -166,69 +272,1280 @@ bool UserFS::initTCPNetwork(const std::string& addr, const uint16_t port) {
     return 0;
 }
 
-const DirTree::TreeNode* UserFS::find(const std::string& path) {
+// changes of files in working dir are collected for delay milliseconds,
+// then published to all nodes in one delta
+// returns true on error, or if watching isn't supported on this platform
+bool UserFS::initWatcher(const size_t delay) {
+    // a slave that failed to connect has no host id for its changes
+    if (!_host_id) return 1;
+
+    if (_content_hash) _hashers.start(hash_threads);
+
+    using namespace std::placeholders;
+    return _watcher.start(_working_dir, delay, std::bind(&UserFS::publishChanges, this, _1, _2));
+}
+
+// nodes may be moved or freed by any change of dir tree, so only copies 
+// of what they hold are handed out, taken with lock held
+// returns true if not found
+bool UserFS::getattr(const std::string& path, Attributes& attributes) const {
     boost::shared_lock< boost::shared_mutex > lock(_access);
-    return _dir_tree.find(path);
+
+    const DirTree::TreeNode* node = _dir_tree.find(path);
+    if (!node) return 1;
+
+    attributes.type = node->type;
+    attributes.num_links = node->num_links;
+    attributes.size = node->size;
+    attributes.mtime = node->mtime;
+    return 0;
 }
 
-// returns num of bytes read on success
-// returns < 0 on error
-intmax_t UserFS::read(const uint64_t node_id, const std::string path, 
-              const size_t offset, const size_t size, char* buff) {
+// names of children of directory at path
+// returns 0 on success, -ENOENT if not found, -ENOTDIR if it isn't a directory
+int UserFS::readdir(const std::string& path, std::vector<InternedString>& names) const {
+    boost::shared_lock< boost::shared_mutex > lock(_access);
+
+    const DirTree::TreeNode* node = _dir_tree.find(path);
+    if (!node) return -ENOENT;
+    if (node->type != DirTree::TreeNode::DIRECTORY) return -ENOTDIR;
+
+    names.clear();
+    names.reserve(node->children.size());
+    for (const auto& child: node->children) names.push_back(child.name);
+    return 0;
+}
+
+// reader is the process opening it
+// returns nullptr if not found
+UserFS::FileHandle* UserFS::open(const std::string& path, const IOScheduler::Reader& reader) {
+    FileHandle* handle = openHandle(path);
+
+    // fetch small remote files at once, without holding lock of dir tree
+    if (handle && !handle->local_file && handle->type == DirTree::TreeNode::REGULAR &&
+        _eager_size && handle->size <= _eager_size)
+        fetchContents(*handle, reader);
+
+    return handle;
+}
+
+// resolve path and fill a handle
+// returns nullptr if not found
+UserFS::FileHandle* UserFS::openHandle(const std::string& path) {
+    boost::shared_lock< boost::shared_mutex > lock(_access);
+
+    std::string source_path;
+    const DirTree::TreeNode* node = resolve(path, source_path);
+    if (!node) return nullptr;
+
+    const Hosts::Host& host = _hosts[node->host_id];
+
+    FileHandle* handle = new FileHandle;
+    handle->host_id = node->host_id;
+    handle->path = source_path;
+    handle->type = node->type;
+    handle->size = node->size;
+    handle->mtime = node->mtime;
+    handle->keep_cache = 0;
+    handle->cache_fd = -1;
+    handle->next_offset = 0;
+
+    handle->remote_path = remotePath(host, source_path);
+
+    // open local file now, reads use it directly
+    if (handle->host_id == _host_id) {
+        handle->local_file = _local_files.open(handle->remote_path);
+        if (!handle->local_file) {
+            delete handle;
+            return nullptr;
+        }
+        // pages kernel keeps are of the version of the last open, 
+        // they're dropped at the first open of a new version
+        if (_kernel_cache) {
+            uint64_t mtime = handle->local_file->mtimeNs();
+
+            boost::unique_lock<boost::mutex> lock(_kept_mtimes_mutex);
+            auto ite = _kept_mtimes_index.find(handle->remote_path);
+            if (ite != _kept_mtimes_index.end()) {
+                handle->keep_cache = ite->second->second == mtime;
+                ite->second->second = mtime;
+                _kept_mtimes.splice(_kept_mtimes.begin(), _kept_mtimes, ite->second);
+            } else {
+                if (_kept_mtimes.size() >= max_kept_mtimes) {
+                    _kept_mtimes_index.erase(_kept_mtimes.back().first);
+                    _kept_mtimes.pop_back();
+                }
+                _kept_mtimes.emplace_front(handle->remote_path, mtime);
+                _kept_mtimes_index.emplace(handle->remote_path, _kept_mtimes.begin());
+            }
+        }
+        return handle;
+    }
+
+    handle->path_key = pathKey(host, handle->remote_path);
+    handle->cache_key = cacheKey(*node, handle->path_key);
+    handle->cache_mtime = node->hash.size()? 0: handle->mtime;
+
+    if (_disk_cache.enabled())
+        handle->cache_fd = _disk_cache.openFile(handle->cache_key);
+
     // remote node isn't inserted into ssh manager
-    if (!_ssh_manager.findHost(node_id)) {
-        bool rtv = _ssh_manager.insertHost(node_id, _hosts[node_id].address, _hosts[node_id].ssh_port);
-        if (rtv) return -1;
+    // insertion fails if another thread has just inserted it
+    if (!_ssh_manager.findHost(handle->host_id)) 
+        _ssh_manager.insertHost(handle->host_id, host.address, host.ssh_port);
+
+    if (host.block_port)
+        handle->block_client = blockClient(host);
+
+    if (_max_readahead && (_block_cache.enabled() || _disk_cache.enabled()))
+        handle->prefetches.reset(new TaskGroup(_prefetchers));
+
+    {
+        boost::unique_lock<boost::mutex> open_files_lock(_open_files_mutex);
+        _open_files.insert(handle);
     }
-    
-    boost::filesystem::path remote_path = _hosts[node_id].working_dir;
+
+    return handle;
+}
+
+// should be called with _access held
+// resolve path to the file its reads go to, an identical one on this host 
+// or on the fastest host if its content hash is known
+// source_path is set to path of that file
+// returns nullptr if not found
+const DirTree::TreeNode* UserFS::resolve(const std::string& path, std::string& source_path) {
+    const DirTree::TreeNode* node = _dir_tree.find(path);
+    if (!node || node->host_id >= _hosts.size()) return nullptr;
+
+    source_path = path;
+    if (node->hash.size() && node->host_id != _host_id) {
+        source_path = chooseCopy(node->hash.string(), node->host_id, path);
+        if (source_path != path) node = _dir_tree.find(source_path);
+        if (!node || node->host_id >= _hosts.size()) return nullptr;
+    }
+
+    return node;
+}
+
+// path on host of a file at path in dir tree
+std::string UserFS::remotePath(const Hosts::Host& host, const std::string& path) {
+    boost::filesystem::path remote_path = host.working_dir;
     remote_path /= path.substr(path.front() == '/'? 1: 0);
+    return remote_path.string();
+}
 
-    std::string remote_path_string = remote_path.string();
+// identifies a file of host by path on host in cache
+// host id may change after restart, address and port don't
+std::string UserFS::pathKey(const Hosts::Host& host, const std::string& remote_path) {
+    return host.address + ":" + std::to_string(host.ssh_port) + remote_path;
+}
+
+// identifies data of a file in cache, 
+// identical files on any host share cached data if its content hash is known
+std::string UserFS::cacheKey(const DirTree::TreeNode& node, const std::string& path_key) {
+    return node.hash.size()? "sha1:" + node.hash.string(): path_key;
+}
+
+// fetch whole content of a small remote file in one request
+void UserFS::fetchContents(FileHandle& handle, const IOScheduler::Reader& reader) {
+    const size_t block_size = BlockCache::block_size;
+    const size_t file_size = handle.size;
+
+    std::string data(file_size, 0x00);
+    intmax_t rtv = 0;
+
+    // no request at all if every block is cached
+    bool cached = 1;
+    for (size_t index = 0; index * block_size < file_size && cached; ++index)
+        cached = isCached(handle, index);
+
+    if (cached) {
+        if (file_size) rtv = readRemote(handle, 0, file_size, &data[0], reader);
+    } else if (_block_cache.enabled() || _disk_cache.enabled()) {
+        // join fetches of this file by other threads, then read it from cache
+        size_t num_blocks = (file_size + block_size - 1) / block_size;
+        fetchBlocks(handle, 0, num_blocks, reader);
+        rtv = readRemote(handle, 0, file_size, &data[0], reader);
+    } else {
+        IOScheduler::Slot slot(*scheduler(handle.host_id), reader, file_size);
+        rtv = readFromHost(handle, 0, file_size, &data[0]);
+        if (rtv >= 0) data.resize(rtv);
+    }
 
+    // file on remote host differs from dir tree, read it as usual
+    if (rtv != intmax_t(file_size)) return;
+
+    handle.contents.reset(new std::string(std::move(data)));
+}
+
+void UserFS::release(FileHandle* handle) {
+    {
+        boost::unique_lock<boost::mutex> lock(_open_files_mutex);
+        _open_files.erase(handle);
+    }
+
+    // prefetches refer to this handle
+    if (handle->prefetches) handle->prefetches->wait();
+
+    if (handle->cache_fd >= 0) close(handle->cache_fd);
+    delete handle;
+}
+
+// returns num of bytes read on success
+// returns < 0 on error
+intmax_t UserFS::read(const FileHandle& handle, const size_t offset, const size_t size, char* buff,
+                      const IOScheduler::Reader& reader) {
     // read local file
-    if (node_id == _host_id) {
-        std::ifstream fin(remote_path_string);
-        fin.seekg(offset);
-        fin.read(buff, size);
-        if (fin.bad()) return -1;
-        size_t bytes_read = fin.gcount();
-        return bytes_read;
+    if (handle.local_file) 
+        return handle.local_file->read(offset, size, buff);
+
+    // small remote file fetched at open
+    if (handle.contents) {
+        if (offset >= handle.contents->size()) return 0;
+        size_t length = std::min(size, handle.contents->size() - offset);
+        memcpy(buff, handle.contents->data() + offset, length);
+        return length;
     }
 
     // read remote file
-    return _ssh_manager.read(node_id, remote_path_string, offset, size, buff);
+    return readRemote(handle, offset, size, buff, reader);
+}
+
+// find a descriptor from which [offset, offset + size) of this file can be read 
+// at the same offset, without copying through this process
+// returns true if found
+bool UserFS::locate(const FileHandle& handle, const size_t offset, const size_t size, int& fd,
+                    const IOScheduler::Reader& reader) {
+    if (handle.local_file) {
+        fd = handle.local_file->fd();
+        return 1;
+    }
+
+    // served from memory
+    if (handle.contents || handle.cache_fd < 0 || !size) return 0;
+
+    // only if it's within one block in disk cache
+    const size_t block_size = BlockCache::block_size;
+    size_t index = offset / block_size;
+    if ((offset + size - 1) / block_size != index) return 0;
+
+    size_t block_length = 0;
+    if (!_disk_cache.locate(handle.cache_key, handle.cache_mtime, handle.size, index, block_length))
+        return 0;
+    if (index * block_size + block_length < offset + size) return 0;
+
+    readAhead(handle, offset, size, reader);
+
+    fd = handle.cache_fd;
+    return 1;
+}
+
+// should be called with a slot of scheduler of its host
+// read [offset, offset + size) of a remote file from its host
+// through block server if possible, or else through SFTP
+// if unchanged isn't nullptr, it's set to whether the file still has mtime 
+// and size of handle after reading, data is returned either way
+intmax_t UserFS::readFromHost(const FileHandle& handle, 
+                              const size_t offset, const size_t size, char* buff,
+                              bool* unchanged) {
+    if (handle.block_client) {
+        uint64_t mtime = unchanged? handle.mtime: BlockClient::unchecked;
+        intmax_t rtv = handle.block_client->read(handle.path, offset, size, buff, mtime, handle.size);
+
+        // file has changed, read it as it is
+        if (rtv == -ESTALE) {
+            *unchanged = 0;
+            rtv = handle.block_client->read(handle.path, offset, size, buff);
+        } else if (unchanged) {
+            *unchanged = 1;
+        }
+
+        if (rtv >= 0) return rtv;
+    }
+
+    return _ssh_manager.read(handle.host_id, handle.remote_path, handle.mtime, offset, size, buff,
+                             handle.size, unchanged);
 }
 
-// send update packet to all slaves
-void UserFS::sendUpdate() {
-    std::string dir_tree_seq;
-    std::string hosts_seq;
+// read a file of this host for block server
+// unless mtime is BlockClient::unchecked, returns -ESTALE if the file 
+// doesn't have mtime and file_size after reading
+intmax_t UserFS::serveBlock(const std::string& path, 
+                            const size_t offset, const size_t size, char* buff,
+                            const uint64_t mtime, const uint64_t file_size) {
+    // only paths inside working dir
+    boost::filesystem::path p(path);
+    for (const auto& component: p)
+        if (component == "..") return -1;
+
+    std::string local_path;
 
     {
         boost::shared_lock< boost::shared_mutex > lock(_access);
-        dir_tree_seq = DirTree::serialize(_dir_tree);
-        hosts_seq = Hosts::serialize(_hosts);
+
+        const DirTree::TreeNode* node = _dir_tree.find(path);
+        if (!node || node->host_id != _host_id || node->type != DirTree::TreeNode::REGULAR) 
+            return -1;
+
+        local_path = (boost::filesystem::path(_working_dir) / p.relative_path()).string();
+    }
+
+    LocalFileCache::File file = _local_files.open(local_path);
+    if (!file) return -1;
+
+    intmax_t rtv = file->read(offset, size, buff);
+    if (rtv < 0 || mtime == BlockClient::unchecked) return rtv;
+
+    // stat after reading, so that a change during the read is seen
+    struct stat st;
+    if (fstat(file->fd(), &st)) return -1;
+    if (uint64_t(st.st_mtime) != mtime || uint64_t(st.st_size) != file_size) return -ESTALE;
+
+    return rtv;
+}
+
+// returns the connection to block server of this host
+std::shared_ptr<BlockClient> UserFS::blockClient(const Hosts::Host& host) {
+    boost::unique_lock<boost::mutex> lock(_block_clients_mutex);
+
+    std::shared_ptr<BlockClient>& client = _block_clients[host.id];
+    if (!client) client = std::make_shared<BlockClient>(host.address, host.block_port, _compression);
+
+    return client;
+}
+
+// returns the scheduler of requests to this host
+std::shared_ptr<IOScheduler> UserFS::scheduler(const uint64_t host_id) {
+    boost::unique_lock<boost::mutex> lock(_schedulers_mutex);
+
+    std::shared_ptr<IOScheduler>& scheduler = _schedulers[host_id];
+    if (!scheduler) scheduler = std::make_shared<IOScheduler>(_sessions_per_host, _bandwidth);
+
+    return scheduler;
+}
+
+// read remote file through block cache and disk cache
+intmax_t UserFS::readRemote(const FileHandle& handle, 
+                            const size_t offset, const size_t size, char* buff,
+                            const IOScheduler::Reader& reader) {
+    if (!_block_cache.enabled() && !_disk_cache.enabled()) {
+        IOScheduler::Slot slot(*scheduler(handle.host_id), reader, size);
+        return readFromHost(handle, offset, size, buff);
+    }
+
+    readAhead(handle, offset, size, reader);
+
+    const size_t file_size = handle.size;
+    const size_t block_size = BlockCache::block_size;
+    size_t end = std::min(offset + size, file_size);
+    size_t bytes_read = 0;
+
+    for (size_t index = offset / block_size; index * block_size < end; ++index) {
+        size_t block_offset = index * block_size;
+        size_t block_length = std::min(block_size, file_size - block_offset);
+
+        BlockCache::Block block = cachedBlock(handle, index);
+
+        // cache miss
+        if (!block) {
+            block = fetch(handle, index, reader);
+            if (!block) return bytes_read? bytes_read: -1;
+        }
+
+        size_t copy_begin = std::max(offset, block_offset);
+        size_t copy_end = std::min(end, block_offset + block->size());
+        if (copy_end <= copy_begin) break;
+
+        memcpy(buff + bytes_read, block->data() + copy_begin - block_offset, copy_end - copy_begin);
+        bytes_read += copy_end - copy_begin;
+
+        // short block
+        if (block->size() < block_length) break;
+    }
+
+    handle.next_offset = offset + bytes_read;
+
+    return bytes_read;
+}
+
+// feed a read to access pattern of this file, and fetch blocks ahead of it
+// at prefetch priority of reader
+void UserFS::readAhead(const FileHandle& handle, const size_t offset, const size_t size,
+                       const IOScheduler::Reader& reader) {
+    if (!handle.prefetches) return;
+
+    IOScheduler::Reader prefetcher = reader;
+    prefetcher.priority = std::max(reader.priority, IOScheduler::PREFETCH);
+
+    std::vector<Readahead::Range> ranges;
+    {
+        boost::unique_lock<boost::mutex> lock(handle.readahead_mutex);
+        ranges = handle.readahead.record(offset, size, handle.size, _max_readahead);
     }
 
-    sendUpdate(dir_tree_seq, hosts_seq);
+    const size_t block_size = BlockCache::block_size;
+    // ranges are ascending, records of a strided reader may share a block
+    size_t next_index = 0;
+
+    for (const auto& range: ranges) {
+        size_t index = std::max(range.offset / block_size, next_index);
+        size_t last = (range.offset + range.length - 1) / block_size;
+
+        // runs of blocks not cached, each in one task
+        while (index <= last) {
+            if (isCached(handle, index)) {
+                ++index;
+                continue;
+            }
+
+            size_t count = 1;
+            while (index + count <= last && count < stripe_blocks && !isCached(handle, index + count))
+                ++count;
+
+            handle.prefetches->post([this, &handle, index, count, prefetcher]() { 
+                fetchBlocks(handle, index, count, prefetcher); 
+            });
+            index += count;
+        }
+
+        next_index = last + 1;
+    }
 }
 
-void UserFS::sendUpdate(const std::string& dir_tree_seq, const std::string& hosts_seq) {
-    std::string message = host_to_network_64(0x02);
-    message += host_to_network_64(dir_tree_seq.length());
-    message += dir_tree_seq;
-    message += host_to_network_64(hosts_seq.length());
-    message += hosts_seq;
+// should be called with _access held
+// returns the path of a file of the same content on this host, or else
+// on the host with highest measured throughput, path on host_id by default
+std::string UserFS::chooseCopy(const std::string& hash, const uint64_t host_id, 
+                               const std::string& path) {
+    auto ite = _copies.find(hash);
+    if (ite == _copies.end()) return path;
+
+    const std::string* best_path = &path;
+    double best_throughput = hostThroughput(host_id);
+
+    for (const auto& copy: ite->second) {
+        if (copy.first == _host_id) return copy.second;
+
+        double throughput = hostThroughput(copy.first);
+        if (throughput > best_throughput) {
+            best_throughput = throughput;
+            best_path = &copy.second;
+        }
+    }
+
+    return *best_path;
+}
+
+// bytes per second measured from this host, 0 if not measured
+double UserFS::hostThroughput(const uint64_t host_id) {
+    double throughput = _ssh_manager.throughput(host_id);
+
+    boost::unique_lock<boost::mutex> lock(_block_clients_mutex);
+    auto ite = _block_clients.find(host_id);
+    if (ite != _block_clients.end()) 
+        throughput = std::max(throughput, ite->second->throughput());
+
+    return throughput;
+}
+
+// should be called with _access held exclusively
+// index regular files of dir tree by content hash
+// nothing is indexed if content hash is disabled
+void UserFS::indexCopies() {
+    _copies.clear();
+    if (_content_hash) indexCopies("/", 1, 1);
+}
+
+// should be called with _access held exclusively
+// add regular files at path to index of copies, or remove them from it,
+// those in its subtree too if subtree is true
+void UserFS::indexCopies(const std::string& path, const bool add, const bool subtree) {
+    const DirTree::TreeNode* root = _dir_tree.find(path);
+    if (!root) return;
+
+    std::function< void (const DirTree::TreeNode&, const std::string&) > traverse;
+    traverse = [this, &traverse, add, subtree](const DirTree::TreeNode& node, 
+                                               const std::string& node_path) {
+        if (node.type == DirTree::TreeNode::DIRECTORY) {
+            if (!subtree) return;
+            for (const auto& child: node.children)
+                traverse(child, node_path + "/" + child.name.string());
+            return;
+        }
+
+        if (node.hash.empty()) return;
+
+        if (add) {
+            _copies[node.hash.string()].emplace_back(node.host_id, node_path);
+            return;
+        }
+
+        auto ite = _copies.find(node.hash.string());
+        if (ite == _copies.end()) return;
+
+        auto& copies = ite->second;
+        copies.erase(std::remove(copies.begin(), copies.end(), 
+                                 std::make_pair(uint64_t(node.host_id), node_path)), 
+                     copies.end());
+        if (copies.empty()) _copies.erase(ite);
+    };
+
+    // paths in index are like "/a/b"
+    traverse(*root, path == "/"? "": path);
+}
+
+// should be called with _access held exclusively
+// apply delta to dir tree and hosts, files it changes are indexed again
+// returns true on error, then index of copies is rebuilt
+bool UserFS::applyToTree(TreeDelta& delta) {
+    if (!_content_hash) return delta.apply(_dir_tree, _hosts);
+
+    // subtrees added, replaced or removed, and nodes modified
+    std::set<std::string> subtrees;
+    std::set<std::string> nodes;
+
+    for (const auto& op: delta.ops()) {
+        if (op.type == TreeDelta::ADD && op.tree.root()) {
+            std::string dir = op.path == "/"? "": op.path;
+            for (const auto& child: op.tree.root()->children)
+                subtrees.insert(dir + "/" + child.name.string());
+        } else if (op.type == TreeDelta::REMOVE && op.path == "/") {
+            for (const auto& child: _dir_tree.root()->children)
+                if (child.host_id == op.host_id) subtrees.insert("/" + child.name.string());
+        } else if (op.type == TreeDelta::REMOVE) {
+            subtrees.insert(op.path);
+        } else if (op.type == TreeDelta::MODIFY) {
+            nodes.insert(op.path);
+        }
+    }
+
+    // returns true if path is in one of subtrees
+    auto covered = [&subtrees](const std::string& path) {
+        for (size_t slash = path.find('/', 1); slash != std::string::npos; 
+             slash = path.find('/', slash + 1))
+            if (subtrees.count(path.substr(0, slash))) return 1;
+        return 0;
+    };
+
+    for (auto ite = subtrees.begin(); ite != subtrees.end();)
+        ite = covered(*ite)? subtrees.erase(ite): std::next(ite);
+    for (auto ite = nodes.begin(); ite != nodes.end();)
+        ite = subtrees.count(*ite) || covered(*ite)? nodes.erase(ite): std::next(ite);
+
+    for (const auto& path: subtrees) indexCopies(path, 0, 1);
+    for (const auto& path: nodes) indexCopies(path, 0, 0);
+
+    if (delta.apply(_dir_tree, _hosts)) {
+        indexCopies();
+        return 1;
+    }
+
+    for (const auto& path: subtrees) indexCopies(path, 1, 1);
+    for (const auto& path: nodes) indexCopies(path, 1, 0);
+
+    return 0;
+}
+
+// returns true if this block is in block cache or disk cache
+bool UserFS::isCached(const FileHandle& handle, const size_t index) {
+    if (_block_cache.enabled() && 
+        _block_cache.contains(handle.cache_key, handle.cache_mtime, handle.size, index))
+        return 1;
+
+    return _disk_cache.enabled() && 
+           _disk_cache.contains(handle.cache_key, handle.cache_mtime, handle.size, index);
+}
+
+// look up a block in block cache, then in disk cache
+// returns nullptr if not cached
+BlockCache::Block UserFS::cachedBlock(const FileHandle& handle, const size_t index) {
+    BlockCache::Block block;
+
+    if (_block_cache.enabled())
+        block = _block_cache.get(handle.cache_key, handle.cache_mtime, handle.size, index);
+
+    if (block || !_disk_cache.enabled()) return block;
+
+    std::string data;
+    if (!_disk_cache.get(handle.cache_key, handle.cache_mtime, handle.size, index, data, 
+                         handle.cache_fd)) 
+        return nullptr;
+
+    block = std::make_shared<const std::string>(std::move(data));
+
+    if (_block_cache.enabled())
+        _block_cache.put(handle.cache_key, handle.cache_mtime, handle.size, index, block);
+
+    return block;
+}
+
+// fetch a block not cached
+// blocks after it are fetched in stripes over several sessions in parallel
+// if this is a big file read sequentially
+// returns nullptr on error
+BlockCache::Block UserFS::fetch(const FileHandle& handle, const size_t index, 
+                                const IOScheduler::Reader& reader) {
+    const size_t block_size = BlockCache::block_size;
+
+    // previous read ended in this block or the one before
+    size_t previous = handle.next_offset / block_size;
+    bool sequential = previous == index || previous + 1 == index;
+
+    if (_stripes < 2 || handle.size < _stripe_threshold || !sequential)
+        return fetchBlocks(handle, index, 1, reader);
+
+    size_t num_blocks = (handle.size + block_size - 1) / block_size;
+    size_t count = std::min(_stripes * stripe_blocks, num_blocks - index);
+    size_t stripe = (count + _stripes - 1) / _stripes;
+
+    TaskGroup group(_workers);
+
+    for (size_t first = index + stripe; first < index + count; first += stripe) {
+        size_t num = std::min(stripe, index + count - first);
+        IOScheduler::Reader stripe_reader = reader;
+        group.post([this, &handle, first, num, stripe_reader]() { 
+            fetchBlocks(handle, first, num, stripe_reader); 
+        });
+    }
+
+    // first stripe in this thread
+    BlockCache::Block block = fetchBlocks(handle, index, std::min(stripe, count), reader);
+
+    group.wait();
+
+    return block;
+}
+
+// fetch count blocks from index and cache them
+// blocks other threads are fetching are not fetched again, the rest are
+// fetched in one read for each run of them, with a slot of scheduler
+// returns the first one, nullptr on error
+BlockCache::Block UserFS::fetchBlocks(const FileHandle& handle, const size_t index, const size_t count,
+                                      const IOScheduler::Reader& reader) {
+    const size_t block_size = BlockCache::block_size;
+    size_t end = std::min((index + count) * block_size, handle.size);
+
+    // take a slot before claiming, so that blocks in flight are being fetched
+    // and readers joining them never wait behind the scheduler
+    IOScheduler::Slot slot(*scheduler(handle.host_id), reader, end - index * block_size);
+
+    std::vector<InflightBlocks::Claim> claims = 
+        _inflight.claim(handle.cache_key, handle.cache_mtime, handle.size, index, count);
+
+    BlockCache::Block first;
+
+    // own blocks cached since caller looked needn't be fetched
+    std::vector<bool> missing(count, 0);
+    for (size_t i = 0; i < count; ++i) {
+        if (!claims[i].owner) continue;
+
+        BlockCache::Block block;
+        if (isCached(handle, index + i)) block = cachedBlock(handle, index + i);
+
+        if (!block) {
+            missing[i] = 1;
+            continue;
+        }
+
+        _inflight.complete(claims[i].flight, block);
+        if (!i) first = block;
+    }
+
+    // complete all own blocks before waiting for others, 
+    // so that no two threads wait for each other
+    for (size_t i = 0; i < count; ) {
+        if (!missing[i]) {
+            ++i;
+            continue;
+        }
+
+        size_t run = 1;
+        while (i + run < count && missing[i + run]) ++run;
+
+        bool shared = 0;
+        std::vector<BlockCache::Block> blocks = fetchRun(handle, index + i, run, shared);
+
+        // others waiting for them may be reading another file of the same content hash
+        for (size_t j = 0; j < run; ++j)
+            _inflight.complete(claims[i + j].flight, shared && j < blocks.size()? blocks[j]: nullptr);
+
+        if (!i && blocks.size()) first = blocks.front();
+
+        i += run;
+    }
+
+    slot.release();
+
+    // first block is being fetched by another thread
+    if (!claims.front().owner) first = _inflight.wait(claims.front().flight);
+
+    // that fetch failed, or read a file changed since it was hashed, fetch it alone
+    if (!claims.front().owner && !first) {
+        IOScheduler::Slot retry_slot(*scheduler(handle.host_id), reader, 
+                                     std::min(block_size, handle.size - index * block_size));
+        bool shared = 0;
+        std::vector<BlockCache::Block> blocks = fetchRun(handle, index, 1, shared);
+        if (blocks.size()) first = blocks.front();
+    }
+
+    return first;
+}
+
+// should be called with a slot of scheduler of its host
+// read count blocks from index from its host in one read and cache them
+// shared is set to whether they're of cache key of handle, 
+// blocks of a file cached by content hash but changed since aren't
+// returns blocks read, the last one is short if data is
+std::vector<BlockCache::Block> UserFS::fetchRun(const FileHandle& handle, const size_t index, 
+                                                const size_t count, bool& shared) {
+    const size_t block_size = BlockCache::block_size;
+    size_t offset = index * block_size;
+    size_t length = std::min(count * block_size, handle.size - offset);
+
+    // a file cached by path is keyed by its mtime in dir tree, and a changed one 
+    // is dropped from cache when dir tree catches up. Content hash has no mtime, 
+    // so the file is checked to be still the one hashed.
+    bool hashed = handle.cache_key != handle.path_key;
+    bool unchanged = 1;
+
+    std::string data(length, 0x00);
+    intmax_t rtv = readFromHost(handle, offset, length, &data[0], hashed? &unchanged: nullptr);
+    shared = unchanged;
+    if (rtv < 0) return std::vector<BlockCache::Block>();
+
+    data.resize(rtv);
+    return cacheBlocks(handle, index, data, length, shared);
+}
+
+// cut data read from block index into blocks and cache them
+// under cache key of handle if shared is true, or else under its path key
+// length is how many bytes should have been read
+// returns blocks made, the last one is short if data is
+std::vector<BlockCache::Block> UserFS::cacheBlocks(const FileHandle& handle, const size_t index, 
+                                                   const std::string& data, const size_t length,
+                                                   const bool shared) {
+    const size_t block_size = BlockCache::block_size;
+
+    const std::string& key = shared? handle.cache_key: handle.path_key;
+    size_t mtime = shared? handle.cache_mtime: handle.mtime;
+
+    std::vector<BlockCache::Block> blocks;
+
+    for (size_t i = 0; i * block_size < length; ++i) {
+        size_t block_offset = i * block_size;
+        size_t block_length = std::min(block_size, length - block_offset);
+
+        if (i && block_offset >= data.size()) break;
+
+        BlockCache::Block block = std::make_shared<const std::string>(
+                                      data.substr(block_offset, block_length));
+        blocks.push_back(block);
+
+        // file on remote host differs from dir tree, don't cache it
+        if (block->size() != block_length) break;
+
+        if (_disk_cache.enabled())
+            _disk_cache.put(key, mtime, handle.size, index + i, *block);
+        if (_block_cache.enabled())
+            _block_cache.put(key, mtime, handle.size, index + i, block);
+    }
+
+    return blocks;
+}
+
+// human readable statistics
+std::string UserFS::stats() const {
+    std::ostringstream os;
+
+    os << "[ssh]\n";
+    _ssh_manager.printStats(os);
+
+    {
+        boost::unique_lock<boost::mutex> lock(_block_clients_mutex);
+        for (const auto& client: _block_clients)
+            client.second->printStats(os);
+    }
+
+    os << "[readahead]\n";
+    {
+        boost::unique_lock<boost::mutex> lock(_open_files_mutex);
+        for (const auto handle: _open_files) {
+            if (!handle->prefetches) continue;
+
+            boost::unique_lock<boost::mutex> readahead_lock(handle->readahead_mutex);
+            os << handle->path << ": " << Readahead::name(handle->readahead.pattern())
+               << ", window " << handle->readahead.window() << "\n";
+        }
+    }
+
+    os << "[scheduler]\n";
+    {
+        boost::unique_lock<boost::mutex> lock(_schedulers_mutex);
+        std::map< uint64_t, std::shared_ptr<IOScheduler> > schedulers(_schedulers.begin(), _schedulers.end());
+        for (const auto& scheduler: schedulers) {
+            os << "host " << scheduler.first << ": ";
+            scheduler.second->printStats(os);
+            os << "\n";
+        }
+    }
+
+    os << "[tree]\n";
+    os << "version " << _tree_version << ", deltas " << _deltas 
+       << ", snapshots " << _snapshots << "\n";
+    os << "scan: entries " << _scanned_entries << ", errors " << _scan_errors 
+       << ", " << _scan_seconds << " s\n";
+    {
+        boost::shared_lock< boost::shared_mutex > lock(_access);
+        os << "index: nodes " << _dir_tree.indexSize() << ", slots " << _dir_tree.indexCapacity() << "\n";
+
+        // strings are shared by all trees, those of dir tree are nearly all of them
+        size_t tree_bytes = _dir_tree.memoryUsage();
+        size_t string_bytes = InternedString::bytes();
+        os << "memory: tree " << tree_bytes << ", strings " << string_bytes << ", per entry " 
+           << (tree_bytes + string_bytes) / std::max<size_t>(_dir_tree.indexSize(), 1) << "\n";
+    }
+    if (_watcher.enabled())
+        _watcher.printStats(os);
+
+    os << "[cache]\n";
+    _block_cache.printStats(os);
+    _inflight.printStats(os);
+    if (_disk_cache.enabled())
+        _disk_cache.printStats(os);
+
+    return os.str();
+}
+
+// run a command written to control file, one of
+//   pin PATH, unpin PATH, warm PATH, evict PATH
+// it applies to all remote files at or under PATH in dir tree
+// returns true on error
+bool UserFS::control(const std::string& command) {
+    std::istringstream is(command);
+    std::string op;
+    std::string path;
+    is >> op >> std::ws;
+    std::getline(is, path);
+
+    // paths are absolute in dir tree, without trailing slash
+    while (path.size() && isspace(path.back())) path.pop_back();
+    if (path.empty() || path.front() != '/') path = "/" + path;
+    while (path.size() > 1 && path.back() == '/') path.pop_back();
+
+    for (const auto& component: boost::filesystem::path(path))
+        if (component == "..") return 1;
+
+    Attributes attributes;
+    if (getattr(path, attributes)) return 1;
+
+    std::vector< std::pair<std::string, size_t> > files = remoteFiles(path);
+
+    if (op == "pin" || op == "unpin") {
+        bool pinned = op == "pin";
+        for (const auto& file: files) pinFile(file.first, pinned, 0);
+
+        boost::unique_lock<boost::mutex> lock(_control_mutex);
+        if (pinned) 
+            _pinned_paths.insert(path);
+        else 
+            _pinned_paths.erase(path);
+    } else if (op == "evict") {
+        for (const auto& file: files) pinFile(file.first, 0, 1);
+
+        // pins at or under path are gone
+        boost::unique_lock<boost::mutex> lock(_control_mutex);
+        for (auto ite = _pinned_paths.begin(); ite != _pinned_paths.end(); )
+            if (*ite == path || path == "/" || !ite->compare(0, path.size() + 1, path + "/"))
+                ite = _pinned_paths.erase(ite);
+            else
+                ++ite;
+    } else if (op == "warm") {
+        // nowhere to put data
+        if (!_block_cache.enabled() && !_disk_cache.enabled()) return 1;
+
+        std::shared_ptr<Warmup> warmup = std::make_shared<Warmup>();
+        warmup->path = path;
+        warmup->files = files.size();
+        warmup->bytes = 0;
+        for (const auto& file: files) warmup->bytes += file.second;
+        warmup->files_done = 0;
+        warmup->bytes_done = 0;
+        warmup->failures = 0;
+        warmup->cancelled = 0;
+
+        {
+            boost::unique_lock<boost::mutex> lock(_control_mutex);
+
+            // forget oldest finished ones
+            for (auto ite = _warmups.begin(); ite != _warmups.end() && _warmups.size() >= max_warmups; )
+                if ((*ite)->files_done == (*ite)->files)
+                    ite = _warmups.erase(ite);
+                else
+                    ++ite;
+
+            _warmups.push_back(warmup);
+        }
+
+        // tasks keep warmup alive, but not this object
+        for (const auto& file: files) {
+            std::string file_path = file.first;
+            _warmers.post([this, warmup, file_path]() { warmFile(*warmup, file_path); });
+        }
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+// pinned paths and progress of warm-ups
+std::string UserFS::controlStatus() const {
+    std::ostringstream os;
+
+    boost::unique_lock<boost::mutex> lock(_control_mutex);
+
+    for (const auto& path: _pinned_paths)
+        os << "pinned " << path << "\n";
+
+    for (const auto& warmup: _warmups) {
+        bool done = warmup->files_done == warmup->files;
+        os << "warm " << warmup->path 
+           << ": files " << warmup->files_done << "/" << warmup->files
+           << ", bytes " << warmup->bytes_done << "/" << warmup->bytes
+           << ", failures " << warmup->failures
+           << (done? ", done": ", running") << "\n";
+    }
+
+    return os.str();
+}
+
+// paths and sizes of remote regular files at or under path
+std::vector< std::pair<std::string, size_t> > UserFS::remoteFiles(const std::string& path) {
+    std::vector< std::pair<std::string, size_t> > files;
+
+    boost::shared_lock< boost::shared_mutex > lock(_access);
+
+    const DirTree::TreeNode* node = _dir_tree.find(path);
+    if (!node) return files;
+
+    std::function< void (const DirTree::TreeNode&, const std::string&) > traverse;
+    traverse = [this, &traverse, &files](const DirTree::TreeNode& node, const std::string& node_path) {
+        if (node.type == DirTree::TreeNode::DIRECTORY) {
+            for (const auto& child: node.children) 
+                traverse(child, node_path + "/" + child.name.string());
+        } else if (node.type == DirTree::TreeNode::REGULAR && node.host_id != _host_id) {
+            files.emplace_back(node_path, node.size);
+        }
+    };
+
+    traverse(*node, path == "/"? "": path);
+
+    return files;
+}
+
+// pin or unpin cached blocks of a file, and evict them if evict is true
+// the file isn't opened, its key is resolved as an open would
+void UserFS::pinFile(const std::string& path, const bool pinned, const bool evict) {
+    std::string cache_key;
+    size_t size;
+
+    {
+        boost::shared_lock< boost::shared_mutex > lock(_access);
+
+        std::string source_path;
+        const DirTree::TreeNode* node = resolve(path, source_path);
+
+        // an identical file on this host is read instead
+        if (!node || node->host_id == _host_id) return;
+
+        const Hosts::Host& host = _hosts[node->host_id];
+        cache_key = cacheKey(*node, pathKey(host, remotePath(host, source_path)));
+        size = node->size;
+    }
+
+    if (_block_cache.enabled()) {
+        _block_cache.pin(cache_key, size, pinned);
+        if (evict) _block_cache.evict(cache_key, size);
+    }
+    if (_disk_cache.enabled()) {
+        _disk_cache.pin(cache_key, size, pinned);
+        if (evict) _disk_cache.evict(cache_key, size);
+    }
+}
+
+// fetch blocks of a file not cached yet, at background priority
+void UserFS::warmFile(Warmup& warmup, const std::string& path) {
+    FileHandle* handle = warmup.cancelled? nullptr: openHandle(path);
+    if (!handle) {
+        ++warmup.failures;
+        ++warmup.files_done;
+        return;
+    }
+
+    const size_t block_size = BlockCache::block_size;
+    const IOScheduler::Reader reader{ IOScheduler::BACKGROUND, 0, 1 };
+
+    size_t num_blocks = (handle->size + block_size - 1) / block_size;
+
+    for (size_t index = 0; index < num_blocks && !handle->local_file; index += stripe_blocks) {
+        if (warmup.cancelled) {
+            ++warmup.failures;
+            break;
+        }
+
+        size_t count = std::min(stripe_blocks, num_blocks - index);
+
+        bool cached = 1;
+        for (size_t i = index; i < index + count && cached; ++i)
+            cached = isCached(*handle, i);
+
+        if (!cached && !fetchBlocks(*handle, index, count, reader)) {
+            ++warmup.failures;
+            break;
+        }
+
+        warmup.bytes_done += std::min(count * block_size, handle->size - index * block_size);
+    }
+
+    ++warmup.files_done;
+
+    release(handle);
+}
+
+// for master, apply a change to dir tree and hosts, and send it to all slaves
+// if it fails to apply, dir tree may be partly changed, and is sent in full
+// returns true on error
+bool UserFS::updateTree(TreeDelta& delta) {
+    // trees of delta are moved into dir tree when it's applied
+    std::string delta_seq = TreeDelta::serialize(delta, _tree_compression);
+
+    // messages are queued with lock held, so that slaves get them in order of versions
+    boost::unique_lock< boost::shared_mutex > lock(_access);
+
+    bool failed = applyToTree(delta);
+
+    uint64_t base = _tree_version++;
+
+    std::string message;
+    if (failed) {
+        std::string dir_tree_seq = DirTree::serialize(_dir_tree, _tree_compression);
+        std::string hosts_seq = Hosts::serialize(_hosts);
+
+        message = host_to_network_64(0x02) + host_to_network_64(_tree_version) +
+                  host_to_network_64(dir_tree_seq.length()) + dir_tree_seq +
+                  host_to_network_64(hosts_seq.length()) + hosts_seq;
+        ++_snapshots;
+    } else {
+        message = host_to_network_64(0x03) + 
+                  host_to_network_64(base) + host_to_network_64(_tree_version) +
+                  host_to_network_64(delta_seq.length()) + delta_seq;
+        ++_deltas;
+    }
 
     // send to all slaves
     _tcp_manager.write(message);
+
+    return failed;
+}
+
+// turn paths changed in working dir into a delta of nodes of this host
+// master applies it and sends it to slaves, a slave applies it and sends it to master
+// written files are hashed later by hashers
+void UserFS::publishChanges(const std::set<std::string>& paths, const std::set<std::string>& written) {
+    boost::unique_lock<boost::mutex> lock(_publish_mutex);
+
+    TreeDelta delta;
+
+    if (paths.count("/")) {
+        // some changes are lost, rescan all
+        DirTree tree;
+        tree.initialize();
+        try {
+            scanDirectory(_working_dir, *tree.root());
+        } catch (const std::exception&) {
+            return;
+        }
+
+        delta.remove(_host_id, "/");
+        delta.add(_host_id, "/", std::move(tree));
+    } else {
+        // mtime of directories changes with their entries
+        std::set<std::string> changed = paths;
+        for (const auto& path: paths) {
+            size_t slash = path.rfind('/');
+            if (slash) changed.insert(path.substr(0, slash));
+        }
+
+        std::set<std::string> covered;
+        for (const auto& path: changed) {
+            bool is_covered = 0;
+            for (size_t slash = path.find('/', 1); slash != std::string::npos && !is_covered; 
+                 slash = path.find('/', slash + 1))
+                is_covered = covered.count(path.substr(0, slash));
+
+            if (!is_covered) diffPath(path, delta, covered);
+        }
+    }
+
+    publishDelta(delta);
+    lock.unlock();
+
+    // a batch comes after watch delay without changes, so these files are quiet by now
+    if (_content_hash)
+        for (const auto& path: written) queueHash(path);
+}
+
+// should be called with _publish_mutex held
+void UserFS::publishDelta(TreeDelta& delta) {
+    if (delta.empty()) return;
+
+    if (_host_id == 1) {
+        updateTree(delta);
+        return;
+    }
+
+    std::string delta_seq = TreeDelta::serialize(delta, _tree_compression);
+
+    bool connected;
+    {
+        // master sends it back, applying it again changes nothing
+        boost::unique_lock< boost::shared_mutex > lock(_access);
+        applyToTree(delta);
+        connected = _tree_version;
+    }
+
+    if (connected)
+        _tcp_manager.write(host_to_network_64(0x02) + 
+                           host_to_network_64(delta_seq.length()) + delta_seq);
+}
+
+// add changes of path to delta, comparing file on disk with its node
+// whole subtrees added or removed are put in covered
+void UserFS::diffPath(const std::string& path, TreeDelta& delta, std::set<std::string>& covered) {
+    DirTree::TreeNode node;
+    bool on_disk = !makeNode(_working_dir + path.substr(1), node);
+
+    // highest ancestor of path not in dir tree, it's added with all below it
+    std::string added = path;
+    {
+        boost::shared_lock< boost::shared_mutex > lock(_access);
+
+        // name of a top-level entry taken by another host, it isn't shared
+        const DirTree::TreeNode* top = _dir_tree.find(path.substr(0, path.find('/', 1)));
+        if (top && top->host_id != _host_id) return;
+
+        const DirTree::TreeNode* old = _dir_tree.find(path);
+
+        if (!on_disk) {
+            if (old) {
+                delta.remove(_host_id, path);
+                covered.insert(path);
+            }
+            return;
+        }
+
+        if (old && old->type == node.type) {
+            // content is hashed again by hashers, if it's closed after writing
+            if (old->size == node.size && old->mtime == node.mtime)
+                node.hash = old->hash;
+
+            if (old->size != node.size || old->mtime != node.mtime || 
+                old->num_links != node.num_links || old->hash != node.hash)
+                delta.modify(_host_id, path, node);
+            return;
+        }
+
+        for (size_t slash = added.rfind('/'); slash && !_dir_tree.find(added.substr(0, slash)); 
+             slash = added.rfind('/'))
+            added.resize(slash);
+    }
+
+    if (added != path && makeNode(_working_dir + added.substr(1), node)) return;
+
+    if (node.type == DirTree::TreeNode::DIRECTORY) {
+        try {
+            scanDirectory(_working_dir + added.substr(1), node);
+        } catch (const std::exception&) {
+            return;
+        }
+    }
+
+    DirTree tree;
+    tree.initialize();
+    tree.root()->children.insert(std::move(node));
+
+    size_t slash = added.rfind('/');
+    delta.add(_host_id, slash? added.substr(0, slash): "/", std::move(tree));
+    covered.insert(added);
+}
+
+// hash file at path by hashers, unless it's already waiting for them
+void UserFS::queueHash(const std::string& path) {
+    {
+        boost::unique_lock<boost::mutex> lock(_hashing_mutex);
+        auto result = _hashing.insert(std::make_pair(path, false));
+        if (!result.second) {
+            result.first->second = 1;
+            return;
+        }
+    }
+
+    _hashers.post([this, path]() { hashFile(path); });
+}
+
+// hash a file of this host closed after writing, 
+// and publish the hash if the file is still as published
+void UserFS::hashFile(const std::string& path) {
+    const std::string full_path = _working_dir + path.substr(1);
+
+    for (;;) {
+        {
+            boost::unique_lock<boost::mutex> lock(_hashing_mutex);
+            if (_hashing_stopped) {
+                _hashing.erase(path);
+                return;
+            }
+            _hashing[path] = 0;
+        }
+
+        // file isn't hashed if it's changed while being read
+        DirTree::TreeNode node, after;
+        std::string hash;
+        if (!makeNode(full_path, node) && node.type == DirTree::TreeNode::REGULAR)
+            hash = contentHash(full_path);
+        if (hash.size() && !makeNode(full_path, after) && 
+            after.size == node.size && after.mtime == node.mtime) {
+            node.hash = hash;
+
+            boost::unique_lock<boost::mutex> publish_lock(_publish_mutex);
+
+            TreeDelta delta;
+            {
+                boost::shared_lock< boost::shared_mutex > lock(_access);
+                // otherwise a delta of a newer version is on its way, or it's gone
+                const DirTree::TreeNode* old = _dir_tree.find(path);
+                if (old && old->host_id == _host_id && old->type == node.type && 
+                    old->size == node.size && old->mtime == node.mtime && old->hash != node.hash)
+                    delta.modify(_host_id, path, node);
+            }
+
+            publishDelta(delta);
+        }
+
+        boost::unique_lock<boost::mutex> lock(_hashing_mutex);
+        auto ite = _hashing.find(path);
+        if (_hashing_stopped || !ite->second) {
+            _hashing.erase(ite);
+            return;
+        }
+    }
 }
 
 // Callback Functions for slaves' tcp manager:
 
 // slave get recognized from master
-void UserFS::slaveRecognized(const uint64_t slave_id, const std::string& dir_tree_seq, const std::string& hosts_seq) {
+void UserFS::slaveRecognized(const uint64_t slave_id, const uint64_t version, 
+                             const std::string& dir_tree_seq, const std::string& hosts_seq) {
     // deploy dir tree
     DirTree merged_tree = DirTree::deserialize(dir_tree_seq);
     
@@ -238,24 +1555,71 @@ void UserFS::slaveRecognized(const uint64_t slave_id, const std::string& dir_tre
     
     {
         boost::unique_lock< boost::shared_mutex > lock(_access);
-        _dir_tree.root()->children = merged_tree.root()->children;
+        _dir_tree.root()->children = std::move(merged_tree.root()->children);
+        _dir_tree.reindex();
         _hosts = merged_hosts;
+        _tree_version = version;
+        indexCopies();
     }
     // wake up main thread
     _main_thread_is_waiting = 0;
     _slave_wait_sem.post();
 }
 
-// master sent a update packet, update dirtree and hosts
-void UserFS::updateInfo(const std::string& dir_tree_seq, const std::string& hosts_seq) {
+// master sent a full snapshot of dirtree and hosts
+void UserFS::updateInfo(const uint64_t version, 
+                        const std::string& dir_tree_seq, const std::string& hosts_seq) {
     DirTree new_tree = DirTree::deserialize(dir_tree_seq);
     Hosts merged_hosts = Hosts::deserialize(hosts_seq);
 
     {
         boost::unique_lock< boost::shared_mutex > lock(_access);
-        _dir_tree.root()->children = new_tree.root()->children;
+
+        // not recognized yet, or deltas have moved past it
+        if (!_tree_version || version < _tree_version) return;
+
+        _dir_tree.root()->children = std::move(new_tree.root()->children);
+        _dir_tree.reindex();
         _hosts = merged_hosts;
+        _tree_version = version;
+        _resync_pending = 0;
+        indexCopies();
+    }
+
+    ++_snapshots;
+}
+
+// master sent changes from version base to version, apply them in place
+// asks master for a full snapshot if this node isn't at base
+void UserFS::applyDelta(const uint64_t base, const uint64_t version, const std::string& delta_seq) {
+    TreeDelta delta;
+    bool malformed = 0;
+    try {
+        delta = TreeDelta::deserialize(delta_seq);
+    } catch (const std::exception&) {
+        malformed = 1;
+    }
+
+    {
+        boost::unique_lock< boost::shared_mutex > lock(_access);
+
+        // not recognized yet, already in a snapshot, or a snapshot is coming
+        if (!_tree_version || version <= _tree_version || _resync_pending) return;
+
+        if (!malformed && base == _tree_version) {
+            if (!applyToTree(delta)) {
+                _tree_version = version;
+                ++_deltas;
+                return;
+            }
+        }
+
+        // missed some changes, or dir tree has diverged from master's
+        _resync_pending = 1;
     }
+
+    // ask for a full snapshot
+    _tcp_manager.write(host_to_network_64(0x01));
 }
 
 
@@ -265,6 +1629,9 @@ void UserFS::disconnect() {
     { 
         boost::unique_lock< boost::shared_mutex > lock(_access);
         _dir_tree.removeNotOf(_host_id);
+        // no more deltas from master
+        _tree_version = 0;
+        indexCopies();
     }
     // if the first attempt to connect to master is failed,
     // recognition message will never come, and main thread will forever wait.
@@ -286,13 +1653,52 @@ void UserFS::disconnect(const TCPMasterMessager::Connection::iterator handle) {
     if (slave_id == 0) return;
 
     // remove this slave's node in dir tree
-    {
-        boost::unique_lock< boost::shared_mutex > lock(_access);
-        _dir_tree.removeOf(slave_id);
-    }
+    TreeDelta delta;
+    delta.remove(slave_id, "/");
 
     slave_id = 0;
-    sendUpdate();
+    updateTree(delta);
+}
+
+// slave missed some changes, send it a full snapshot
+void UserFS::sendSnapshot(const TCPMasterMessager::Connection::iterator handle) {
+    // slave is initializting, recognition will carry dir tree
+    if (std::get<4>(*handle) == 0) return;
+
+    // queued with lock held, so that later deltas follow it
+    boost::shared_lock< boost::shared_mutex > lock(_access);
+
+    std::string dir_tree_seq = DirTree::serialize(_dir_tree, _tree_compression);
+    std::string hosts_seq = Hosts::serialize(_hosts);
+
+    std::string message = host_to_network_64(0x02) + host_to_network_64(_tree_version) +
+                          host_to_network_64(dir_tree_seq.length()) + dir_tree_seq +
+                          host_to_network_64(hosts_seq.length()) + hosts_seq;
+
+    _tcp_manager.writeTo(message, handle);
+    ++_snapshots;
+}
+
+// slave sent changes of its files, apply them and send them to all slaves
+void UserFS::receiveChanges(const std::string& delta_seq, 
+                            const TCPMasterMessager::Connection::iterator handle) {
+    uint64_t slave_id = std::get<4>(*handle);
+
+    // slave is initializting
+    if (slave_id == 0) return;
+
+    TreeDelta delta;
+    try {
+        delta = TreeDelta::deserialize(delta_seq);
+    } catch (const std::exception&) {
+        return;
+    }
+
+    // slaves change only their own nodes
+    for (const auto& op: delta.ops())
+        if (op.type == TreeDelta::HOST || op.host_id != slave_id) return;
+
+    updateTree(delta);
 }
 
 // new slave coming, chekc dirtree, allocate host_id, merge dir_tree and hosts
@@ -303,60 +1709,63 @@ void UserFS::newConnection(const std::string& dir_tree_seq,
     DirTree slave_dir_tree = DirTree::deserialize(dir_tree_seq);
     Hosts::Host slave_host = Hosts::Host::deserialize(host_seq);
 
-    // check conflicts
-    std::vector<std::string> conflicts;
-    
-    {
-       boost::shared_lock< boost::shared_mutex > lock(_access);
-       conflicts = _dir_tree.hasConflict(slave_dir_tree);
-    }
+    boost::system::error_code ec;
+    slave_host.address = std::get<0>(*handle).remote_endpoint(ec).address().to_string(ec);
+
+    // conflicts are checked and trees are merged with lock held, 
+    // so that no change comes in between and nothing is sent unless it's merged
+    boost::unique_lock< boost::shared_mutex > lock(_access);
 
     // there's conflict, close connection
-    if (conflicts.size()) return _tcp_manager.close(handle);
-    // else
+    if (_dir_tree.hasConflict(slave_dir_tree).size()) {
+        lock.unlock();
+        return _tcp_manager.close(handle);
+    }
 
     // alloc slave id
-    boost::system::error_code ec;
     uint64_t slave_id = _max_host_id++;
-    slave_host.address = std::get<0>(*handle).remote_endpoint(ec).address().to_string(ec);
     slave_host.id = slave_id;
     slave_dir_tree.root()->setHostID(slave_id);
 
-    std::get<4>(*handle) = slave_id;
-    
-    {
-        boost::unique_lock< boost::shared_mutex > lock(_access); 
+    // merge dir tree and host
+    TreeDelta delta;
+    delta.addHost(slave_host);
+    delta.add(slave_id, "/", std::move(slave_dir_tree));
 
-        // merge dir tree
-        _dir_tree.merge(slave_dir_tree);
-       
-        // merge host 
-        _hosts.push(slave_host);
-    }
+    std::string delta_seq = TreeDelta::serialize(delta, _tree_compression);
+    size_t num_hosts = _hosts.size();
 
+    if (applyToTree(delta)) {
+        // take back what has been merged, other slaves haven't been told anything
+        _dir_tree.removeOf(slave_id);
+        while (_hosts.size() > num_hosts) _hosts.pop();
+        if (slave_id < _hosts.size()) _hosts[slave_id] = Hosts::Host();
+        --_max_host_id;
+        indexCopies();
 
-    // construct response message
+        lock.unlock();
+        return _tcp_manager.close(handle);
+    }
 
-    std::string merged_dir_tree_seq;
-    std::string merged_hosts_seq;
+    // send only the change to other slaves
+    uint64_t base = _tree_version++;
+    _tcp_manager.write(host_to_network_64(0x03) + 
+                       host_to_network_64(base) + host_to_network_64(_tree_version) +
+                       host_to_network_64(delta_seq.length()) + delta_seq);
+    ++_deltas;
 
-    { 
-        boost::shared_lock< boost::shared_mutex > lock(_access);
-        merged_dir_tree_seq = DirTree::serialize(_dir_tree);
-        merged_hosts_seq = Hosts::serialize(_hosts);
-    }
+    std::get<4>(*handle) = slave_id;
 
-    std::string merged_dir_tree_seq_len = host_to_network_64(merged_dir_tree_seq.length());
-    std::string merged_hosts_seq_len = host_to_network_64(merged_hosts_seq.length());
-    std::string protocol_type = host_to_network_64(0x01);
-    std::string slave_id_seq = host_to_network_64(slave_id);
+    // construct response message
+    // it's queued with lock held, so that later deltas follow it
+    std::string merged_dir_tree_seq = DirTree::serialize(_dir_tree, _tree_compression);
+    std::string merged_hosts_seq = Hosts::serialize(_hosts);
 
-    std::string message = protocol_type + slave_id_seq +
-                          merged_dir_tree_seq_len + merged_dir_tree_seq +
-                          merged_hosts_seq_len + merged_hosts_seq;
+    std::string message = host_to_network_64(0x01) + host_to_network_64(slave_id) +
+                          host_to_network_64(_tree_version) +
+                          host_to_network_64(merged_dir_tree_seq.length()) + merged_dir_tree_seq +
+                          host_to_network_64(merged_hosts_seq.length()) + merged_hosts_seq;
 
     // send to slave
     _tcp_manager.writeTo(message, handle);
-    sendUpdate(merged_dir_tree_seq, merged_hosts_seq);
 }
-
@@ -15,55 +15,215 @@
 #ifndef USER_FS_H_
 #define USER_FS_H_
 
-#include <fstream>
+#include <map>
+#include <set>
+#include <list>
+#include <atomic>
 #include <boost/filesystem.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/interprocess/sync/interprocess_semaphore.hpp> 
 #include "dir_tree.h"
+#include "tree_delta.h"
 #include "host.h"
 #include "tcp_manager.h"
 #include "ssh_manager.h"
+#include "block_cache.h"
+#include "inflight_blocks.h"
+#include "io_scheduler.h"
+#include "disk_cache.h"
+#include "local_file.h"
+#include "thread_pool.h"
+#include "block_transfer.h"
+#include "readahead.h"
+#include "dir_watcher.h"
 
 class UserFS {
 public:
+    // state of an open file, FUSE keeps a pointer to it in fuse_file_info::fh
+    // attributes are copied from dir tree when it's opened, 
+    // because dir tree may be replaced by master's update at any time
+    struct FileHandle {
+        uint64_t host_id;
+        // path in dir tree
+        std::string path;
+        DirTree::TreeNode::FileType type;
+        size_t size;
+        size_t mtime;
+        // path on its host
+        std::string remote_path;
+        // identifies data of this file in block cache and disk cache
+        std::string cache_key;
+        // mtime blocks are cached with, 0 if cache_key is content hash
+        size_t cache_mtime;
+        // identifies this file by host and path, cache_key is it unless content hash is known
+        // data read while the file differs from dir tree is cached under it with mtime
+        std::string path_key;
+        // read-only descriptor of its disk cache file, < 0 if none
+        int cache_fd;
+        // open file if it's on this host
+        LocalFileCache::File local_file;
+        // connection to block server of its host, nullptr if that host doesn't run one
+        std::shared_ptr<BlockClient> block_client;
+        // whole content of a small remote file fetched at open, nullptr if not fetched
+        std::unique_ptr<const std::string> contents;
+        // let kernel keep page cache of this file between opens
+        bool keep_cache;
+        // where the previous read ended
+        mutable std::atomic<size_t> next_offset;
+        // access pattern of reads, guarded by readahead_mutex
+        mutable Readahead readahead;
+        mutable boost::mutex readahead_mutex;
+        // blocks being fetched ahead of reader, nullptr if readahead is disabled
+        // waited for before this handle is released
+        std::unique_ptr<TaskGroup> prefetches;
+    };
+
     UserFS(): _host_id(0), _max_host_id(2), _slave_wait_sem(0), 
-              _main_thread_is_waiting(1), _tcp_manager(this) { }
+              _main_thread_is_waiting(1), _tree_version(0), _resync_pending(0), _deltas(0), _snapshots(0),
+              _content_hash(0), _scan_threads(1), _scanned_entries(0), _scan_errors(0), _scan_seconds(0),
+              _tcp_manager(this), _kernel_cache(0),
+              _stripes(1), _stripe_threshold(0), _compression(Compression::automatic),
+              _tree_compression(Compression::fast), _eager_size(0), _max_readahead(0), _sessions_per_host(4), _bandwidth(0),
+              _hashing_stopped(0) { }
+
+    ~UserFS();
 
     // calling order of functions below:
-    // master node: setMaster -> initDirTree -> initHost -> initTCPNetwork
-    // slave node: initDirTree -> initHost -> initTCPNetwork
+    // master node: setMaster -> initLocalFiles -> initContentHash -> initDirTree -> initHost -> 
+    //              initBlockServer -> initCompression -> initSSH -> initBandwidth -> 
+    //              initStriping -> initReadahead -> initEagerFetch -> initCache -> 
+    //              initTCPNetwork -> initWatcher
+    // slave node: initLocalFiles -> initContentHash -> initDirTree -> initHost -> 
+    //             initBlockServer -> initCompression -> initSSH -> initBandwidth -> 
+    //             initStriping -> initReadahead -> initEagerFetch -> initCache -> 
+    //             initTCPNetwork -> initWatcher
 
     void setMaster();
 
+    // block_port is 0 if this node doesn't run a block server
     void initHost(const std::string& addr, const uint16_t tcp_port, 
-                  const uint16_t ssh_port);
+                  const uint16_t ssh_port, const uint16_t block_port);
+
+    // serve files of this host to other nodes at port, 0 disables it
+    // returns true on error
+    bool initBlockServer(const std::string& addr, const uint16_t port);
+
+    // zlib level of file data from other hosts, or Compression::automatic
+    // to choose it for each host from measured throughput
+    void initCompression(const int level);
+
+    // max num of SSH sessions to each remote host
+    // it's also the num of requests sent to a host at the same time
+    void initSSH(const size_t sessions_per_host);
 
+    // max bytes per second read from each remote host, 0 for unlimited
+    void initBandwidth(const size_t rate);
+
+    // remote files not smaller than threshold bytes and read sequentially are
+    // fetched in this num of stripes in parallel, each over its own SSH session
+    // 1 disables striping, it needs block cache or disk cache
+    void initStriping(const size_t stripes, const size_t threshold);
+
+    // remote files read sequentially or strided are fetched ahead of reader
+    // in a window growing up to max_window bytes, 0 disables readahead
+    // it needs block cache or disk cache
+    void initReadahead(const size_t max_window);
+
+    // remote regular files not larger than size bytes are fetched in one request 
+    // at open and read from memory until release, 0 disables it
+    void initEagerFetch(const size_t size);
+
+    // memory budget of block cache in bytes, 0 disables it
+    // disk cache is disabled if cache_dir is empty, capacity is in bytes
+    // returns true on error
+    bool initCache(const size_t memory_size, const std::string& cache_dir, 
+                   const size_t cache_size);
+
+    // if kernel_cache is true, kernel keeps page cache of unchanged files on this host
+    // between opens, so only the first read of them reaches this process
+    void initLocalFiles(const bool kernel_cache);
+
+    // if enabled, content of each regular file of this host is hashed when 
+    // dir tree is built, so identical files on all hosts share cached data
+    void initContentHash(const bool enabled);
+
+    // working dir is scanned with scan_threads threads
     // this function may throw exceptions
-    void initDirTree(const std::string& working_dir);
+    void initDirTree(const std::string& working_dir, const size_t scan_threads);
 
     // returns true on error
     bool initTCPNetwork(const std::string& addr, const uint16_t port);
 
-    const DirTree::TreeNode* find(const std::string& path);
+    // changes of files in working dir are collected for delay milliseconds,
+    // then published to all nodes in one delta
+    // returns true on error, or if watching isn't supported on this platform
+    bool initWatcher(const size_t delay);
+
+    // attributes of a node of dir tree
+    struct Attributes {
+        DirTree::TreeNode::FileType type;
+        uint32_t num_links;
+        uint64_t size;
+        uint64_t mtime;
+    };
+
+    // nodes may be moved or freed by any change of dir tree, so only copies 
+    // of what they hold are handed out, taken with lock held
+    // returns true if not found
+    bool getattr(const std::string& path, Attributes& attributes) const;
 
+    // names of children of directory at path
+    // returns 0 on success, -ENOENT if not found, -ENOTDIR if it isn't a directory
+    int readdir(const std::string& path, std::vector<InternedString>& names) const;
+
+    // reader is the process opening it
+    // returns nullptr if not found
+    FileHandle* open(const std::string& path, const IOScheduler::Reader& reader);
+
+    void release(FileHandle* handle);
+
+    // reader is the process reading it, requests to other hosts are scheduled by it
     // returns num of bytes read on success
     // returns < 0 on error
-    intmax_t read(const uint64_t node_id, const std::string path, 
-                  const size_t offset, const size_t size, char* buff);
+    intmax_t read(const FileHandle& handle, const size_t offset, const size_t size, char* buff,
+                  const IOScheduler::Reader& reader);
 
-    // send update packet to all slaves
-    void sendUpdate();
+    // find a descriptor from which [offset, offset + size) of this file can be read 
+    // at the same offset, without copying through this process
+    // returns true if found
+    bool locate(const FileHandle& handle, const size_t offset, const size_t size, int& fd,
+                const IOScheduler::Reader& reader);
 
-    void sendUpdate(const std::string& dir_tree_seq, const std::string& hosts_seq);
+    // human readable statistics
+    std::string stats() const;
+
+    // run a command written to control file, one of
+    //   pin PATH, unpin PATH, warm PATH, evict PATH
+    // it applies to all remote files at or under PATH in dir tree
+    // returns true on error
+    bool control(const std::string& command);
+
+    // pinned paths and progress of warm-ups
+    std::string controlStatus() const;
+
+    // for master, apply a change to dir tree and hosts, and send it to all slaves
+    // if it fails to apply, dir tree may be partly changed, and is sent in full
+    // returns true on error
+    bool updateTree(TreeDelta& delta);
 
     // Callback Functions for slaves' tcp manager:
 
     // slave get recognized from master
-    void slaveRecognized(const uint64_t slave_id, const std::string& dir_tree_seq, 
-                         const std::string& hosts_seq);
+    void slaveRecognized(const uint64_t slave_id, const uint64_t version,
+                         const std::string& dir_tree_seq, const std::string& hosts_seq);
 
-    // master sent a update packet, update dirtree and hosts
-    void updateInfo(const std::string& dir_tree_seq, const std::string& hosts_seq);
+    // master sent a full snapshot of dirtree and hosts
+    void updateInfo(const uint64_t version, 
+                    const std::string& dir_tree_seq, const std::string& hosts_seq);
+
+    // master sent changes from version base to version, apply them in place
+    // asks master for a full snapshot if this node isn't at base
+    void applyDelta(const uint64_t base, const uint64_t version, const std::string& delta_seq);
 
     // connect failed or slave disconnect from master
     void disconnect();
@@ -74,6 +234,13 @@ public:
     // slave disconnect from master
     void disconnect(const TCPMasterMessager::Connection::iterator handle);
 
+    // slave missed some changes, send it a full snapshot
+    void sendSnapshot(const TCPMasterMessager::Connection::iterator handle);
+
+    // slave sent changes of its files, apply them and send them to all slaves
+    void receiveChanges(const std::string& delta_seq, 
+                        const TCPMasterMessager::Connection::iterator handle);
+
     // new slave coming, chekc dirtree, allocate host_id, merge dir_tree and hosts
     void newConnection(const std::string& dir_tree_seq, 
                        const std::string& host_seq, 
@@ -82,6 +249,185 @@ public:
     size_t hostID() const { return _host_id; }
 
 private:
+    // fill attributes of file at p, its children aren't scanned and it isn't hashed
+    // returns true on error, or if its type is unknown
+    bool makeNode(const boost::filesystem::path& p, DirTree::TreeNode& node);
+
+    // add nodes of files under dir to children of parent, recursively
+    // this function may throw exceptions
+    void scanDirectory(const boost::filesystem::path& dir, const DirTree::TreeNode& parent);
+
+    // turn paths changed in working dir into a delta of nodes of this host
+    // master applies it and sends it to slaves, a slave applies it and sends it to master
+    // written files are hashed later by hashers
+    void publishChanges(const std::set<std::string>& paths, const std::set<std::string>& written);
+
+    // should be called with _publish_mutex held
+    void publishDelta(TreeDelta& delta);
+
+    // hash file at path by hashers, unless it's already waiting for them
+    void queueHash(const std::string& path);
+
+    // hash a file of this host closed after writing, 
+    // and publish the hash if the file is still as published
+    void hashFile(const std::string& path);
+
+    // add changes of path to delta, comparing file on disk with its node
+    // whole subtrees added or removed are put in covered
+    void diffPath(const std::string& path, TreeDelta& delta, std::set<std::string>& covered);
+
+    // resolve path and fill a handle
+    // returns nullptr if not found
+    FileHandle* openHandle(const std::string& path);
+
+    // should be called with _access held
+    // resolve path to the file its reads go to, an identical one on this host 
+    // or on the fastest host if its content hash is known
+    // source_path is set to path of that file
+    // returns nullptr if not found
+    const DirTree::TreeNode* resolve(const std::string& path, std::string& source_path);
+
+    // path on host of a file at path in dir tree
+    static std::string remotePath(const Hosts::Host& host, const std::string& path);
+
+    // identifies a file of host by path on host in cache
+    static std::string pathKey(const Hosts::Host& host, const std::string& remote_path);
+
+    // identifies data of a file in cache, 
+    // identical files on any host share cached data if its content hash is known
+    static std::string cacheKey(const DirTree::TreeNode& node, const std::string& path_key);
+
+    // fetch whole content of a small remote file in one request
+    void fetchContents(FileHandle& handle, const IOScheduler::Reader& reader);
+
+    // should be called with a slot of scheduler of its host
+    // read [offset, offset + size) of a remote file from its host
+    // through block server if possible, or else through SFTP
+    // if unchanged isn't nullptr, it's set to whether the file still has mtime 
+    // and size of handle after reading, data is returned either way
+    intmax_t readFromHost(const FileHandle& handle, 
+                          const size_t offset, const size_t size, char* buff,
+                          bool* unchanged = nullptr);
+
+    // read a file of this host for block server
+    // unless mtime is BlockClient::unchecked, returns -ESTALE if the file 
+    // doesn't have mtime and file_size after reading
+    intmax_t serveBlock(const std::string& path, 
+                        const size_t offset, const size_t size, char* buff,
+                        const uint64_t mtime, const uint64_t file_size);
+
+    // returns the connection to block server of this host
+    std::shared_ptr<BlockClient> blockClient(const Hosts::Host& host);
+
+    // returns the scheduler of requests to this host
+    std::shared_ptr<IOScheduler> scheduler(const uint64_t host_id);
+
+    // read remote file through block cache and disk cache
+    intmax_t readRemote(const FileHandle& handle, 
+                        const size_t offset, const size_t size, char* buff,
+                        const IOScheduler::Reader& reader);
+
+    // feed a read to access pattern of this file, and fetch blocks ahead of it
+    // at prefetch priority of reader
+    void readAhead(const FileHandle& handle, const size_t offset, const size_t size,
+                   const IOScheduler::Reader& reader);
+
+    // a warm command, files are fetched in the background by warmers
+    struct Warmup {
+        std::string path;
+        size_t files;
+        size_t bytes;
+        std::atomic<size_t> files_done;
+        std::atomic<size_t> bytes_done;
+        std::atomic<size_t> failures;
+        std::atomic<bool> cancelled;
+    };
+
+    // paths and sizes of remote regular files at or under path
+    std::vector< std::pair<std::string, size_t> > remoteFiles(const std::string& path);
+
+    // pin or unpin cached blocks of a file, and evict them if evict is true
+    // the file isn't opened, its key is resolved as an open would
+    void pinFile(const std::string& path, const bool pinned, const bool evict);
+
+    // fetch blocks of a file not cached yet, at background priority
+    void warmFile(Warmup& warmup, const std::string& path);
+
+    // should be called with _access held
+    // returns the path of a file of the same content on this host, or else
+    // on the host with highest measured throughput, path on host_id by default
+    std::string chooseCopy(const std::string& hash, const uint64_t host_id, 
+                           const std::string& path);
+
+    // bytes per second measured from this host, 0 if not measured
+    double hostThroughput(const uint64_t host_id);
+
+    // should be called with _access held exclusively
+    // index regular files of dir tree by content hash
+    // nothing is indexed if content hash is disabled
+    void indexCopies();
+
+    // should be called with _access held exclusively
+    // add regular files at path to index of copies, or remove them from it,
+    // those in its subtree too if subtree is true
+    void indexCopies(const std::string& path, const bool add, const bool subtree);
+
+    // should be called with _access held exclusively
+    // apply delta to dir tree and hosts, files it changes are indexed again
+    // returns true on error, then index of copies is rebuilt
+    bool applyToTree(TreeDelta& delta);
+
+    // returns true if this block is in block cache or disk cache
+    bool isCached(const FileHandle& handle, const size_t index);
+
+    // look up a block in block cache, then in disk cache
+    // returns nullptr if not cached
+    BlockCache::Block cachedBlock(const FileHandle& handle, const size_t index);
+
+    // fetch a block not cached
+    // blocks after it are fetched in stripes over several sessions in parallel
+    // if this is a big file read sequentially
+    // returns nullptr on error
+    BlockCache::Block fetch(const FileHandle& handle, const size_t index, 
+                            const IOScheduler::Reader& reader);
+
+    // fetch count blocks from index and cache them
+    // blocks other threads are fetching are not fetched again, the rest are
+    // fetched in one read for each run of them, with a slot of scheduler
+    // returns the first one, nullptr on error
+    BlockCache::Block fetchBlocks(const FileHandle& handle, const size_t index, const size_t count,
+                                  const IOScheduler::Reader& reader);
+
+    // should be called with a slot of scheduler of its host
+    // read count blocks from index from its host in one read and cache them
+    // shared is set to whether they're of cache key of handle, 
+    // blocks of a file cached by content hash but changed since aren't
+    // returns blocks read, the last one is short if data is
+    std::vector<BlockCache::Block> fetchRun(const FileHandle& handle, const size_t index, 
+                                            const size_t count, bool& shared);
+
+    // cut data read from block index into blocks and cache them
+    // under cache key of handle if shared is true, or else under its path key
+    // length is how many bytes should have been read
+    // returns blocks made, the last one is short if data is
+    std::vector<BlockCache::Block> cacheBlocks(const FileHandle& handle, const size_t index, 
+                                               const std::string& data, const size_t length,
+                                               const bool shared);
+
+    // num of blocks in a stripe
+    static const size_t stripe_blocks = 8;
+    // num of threads of block server
+    static const size_t block_server_threads = 4;
+    // num of threads fetching ahead of readers
+    static const size_t prefetch_threads = 4;
+    // num of threads warming cache
+    static const size_t warm_threads = 2;
+    // finished warm-ups kept for control status
+    static const size_t max_warmups = 16;
+    // max num of files whose modification time is kept for kernel cache
+    static const size_t max_kept_mtimes = 65536;
+    // num of threads hashing files changed after startup
+    static const size_t hash_threads = 2;
     
     // This sem is used to block slave node until it's get master's recognization and dir tree
     bool _main_thread_is_waiting;
@@ -96,15 +442,114 @@ private:
 
 
     // lock for _dir_tree and _hosts
-    boost::shared_mutex _access;
+    mutable boost::shared_mutex _access;
 
     // access to dir tree and hosts should be controlled with lock or sem or condition variable
     DirTree _dir_tree;
     Hosts _hosts;
 
+    // bumped by master on each change of dir tree or hosts, written with _access held
+    // 0 until slave is recognized
+    std::atomic<uint64_t> _tree_version;
+    // slave has asked for a full snapshot, deltas are ignored until it comes
+    bool _resync_pending;
+    // deltas and full snapshots sent by master or applied by slave, for statistics
+    std::atomic<uint64_t> _deltas;
+    std::atomic<uint64_t> _snapshots;
+
+    // files of each content hash, (host id, path)
+    std::unordered_map< std::string, std::vector< std::pair<uint64_t, std::string> > > _copies;
+
+    // compute content hash of files of this host
+    bool _content_hash;
+
+    // threads scanning working dir
+    size_t _scan_threads;
+    // result of scan at startup, for statistics
+    size_t _scanned_entries;
+    size_t _scan_errors;
+    double _scan_seconds;
+
     TCPManager _tcp_manager;
 
     SSHManager _ssh_manager;
+
+    BlockCache _block_cache;
+
+    DiskCache _disk_cache;
+
+    // blocks being fetched from other hosts
+    InflightBlocks _inflight;
+
+    LocalFileCache _local_files;
+    bool _kernel_cache;
+    // modification time in nanoseconds of files on this host when they were 
+    // last opened with kernel cache, indexed by path, most recently opened at front
+    // a file out of it loses kernel cache at its next open
+    boost::mutex _kept_mtimes_mutex;
+    std::list< std::pair<std::string, uint64_t> > _kept_mtimes;
+    std::unordered_map< std::string, std::list< std::pair<std::string, uint64_t> >::iterator > 
+        _kept_mtimes_index;
+
+    // num of stripes fetched in parallel, 1 disables striping
+    size_t _stripes;
+    // files not smaller than this are fetched in stripes
+    size_t _stripe_threshold;
+    // threads fetching stripes
+    ThreadPool _workers;
+
+    // zlib level or Compression::automatic
+    int _compression;
+    // zlib level of dir tree sent to other nodes
+    int _tree_compression;
+
+    // remote files not larger than this are fetched at open, 0 disables it
+    size_t _eager_size;
+
+    // max bytes fetched ahead of reader, 0 disables readahead
+    size_t _max_readahead;
+    // threads fetching ahead of readers
+    ThreadPool _prefetchers;
+
+    // open remote files, for statistics
+    mutable boost::mutex _open_files_mutex;
+    std::set<const FileHandle*> _open_files;
+
+    // connections to block servers of other hosts, indexed by host id
+    mutable boost::mutex _block_clients_mutex;
+    std::unordered_map< uint64_t, std::shared_ptr<BlockClient> > _block_clients;
+
+    // max num of requests to a host at the same time
+    size_t _sessions_per_host;
+    // max bytes per second from a host, 0 for unlimited
+    size_t _bandwidth;
+    // schedulers of requests to other hosts, indexed by host id
+    mutable boost::mutex _schedulers_mutex;
+    std::unordered_map< uint64_t, std::shared_ptr<IOScheduler> > _schedulers;
+
+    // paths pinned by control file, and warm-ups oldest first
+    mutable boost::mutex _control_mutex;
+    std::set<std::string> _pinned_paths;
+    std::list< std::shared_ptr<Warmup> > _warmups;
+    // stops before members it uses are destroyed
+    ThreadPool _warmers;
+
+    // stops before members it reads are destroyed
+    std::unique_ptr<BlockServer> _block_server;
+
+    // deltas of watcher and hashers are made and published one at a time, 
+    // so that a hash never goes with a newer version of its file
+    boost::mutex _publish_mutex;
+
+    // files waiting for hashers, true if written again since its hashing began
+    boost::mutex _hashing_mutex;
+    std::map<std::string, bool> _hashing;
+    bool _hashing_stopped;
+    // stops after watcher, before members it uses are destroyed
+    ThreadPool _hashers;
+
+    // changes of working dir, stops before members it uses are destroyed
+    DirWatcher _watcher;
 };
 
 
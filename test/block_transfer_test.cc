@@ -0,0 +1,178 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: block_transfer_test.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 15:02:11
+ *  Description: tests of BlockServer and BlockClient over loopback
+ *****************************************************************************/
+#include <map>
+#include <thread>
+#include <random>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include "block_transfer.h"
+
+// files served, read only after the server starts
+static std::map<std::string, std::string> files;
+
+// mtime of every file served
+static const uint64_t file_mtime = 1436000000;
+
+static intmax_t readFile(const std::string& path, const size_t offset, 
+                         const size_t size, char* buff,
+                         const uint64_t mtime, const uint64_t file_size) {
+    auto ite = files.find(path);
+    if (ite == files.end()) return -1;
+
+    const std::string& data = ite->second;
+    if (mtime != BlockClient::unchecked && (mtime != file_mtime || file_size != data.size()))
+        return -ESTALE;
+    if (offset >= data.size()) return 0;
+
+    size_t length = std::min(size, data.size() - offset);
+    memcpy(buff, data.data() + offset, length);
+    return length;
+}
+
+// reads [offset, offset + size) of path through client and compares it with files
+static void checkRead(BlockClient& client, const std::string& path, 
+                      const size_t offset, const size_t size) {
+    const std::string& data = files[path];
+    size_t expected = offset < data.size()? std::min(size, data.size() - offset): 0;
+
+    std::vector<char> buff(size + 1);
+    intmax_t rtv = client.read(path, offset, size, buff.data());
+    assert(rtv == intmax_t(expected));
+    assert(!memcmp(buff.data(), data.data() + std::min(offset, data.size()), expected));
+}
+
+// bytes on the wire over file data, from statistics of client
+static double compressionRatio(const BlockClient& client) {
+    std::ostringstream os;
+    client.printStats(os);
+    std::string stats = os.str();
+    size_t pos = stats.find("compression ratio ");
+    assert(pos != std::string::npos);
+    return std::stod(stats.substr(pos + strlen("compression ratio ")));
+}
+
+// raw reads, whole files split into many chunks, short reads at end of file
+void testRaw(const uint16_t port) {
+    BlockClient client("127.0.0.1", port, 0);
+
+    checkRead(client, "random", 0, files["random"].size());
+    checkRead(client, "random", 12345, 3 * BlockClient::chunk_size + 17);
+    checkRead(client, "random", files["random"].size() - 100, BlockClient::chunk_size);
+    checkRead(client, "text", 0, files["text"].size());
+    checkRead(client, "empty", 0, 4096);
+
+    assert(compressionRatio(client) == 1.0);
+}
+
+// compressible data is sent compressed, incompressible data falls back to raw
+void testCompressed(const uint16_t port) {
+    BlockClient client("127.0.0.1", port, 6);
+
+    checkRead(client, "text", 0, files["text"].size());
+    checkRead(client, "text", 1000, BlockClient::chunk_size + 1);
+    assert(compressionRatio(client) > 2.0);
+
+    checkRead(client, "random", 0, files["random"].size());
+    checkRead(client, "text", files["text"].size() - 10, 4096);
+}
+
+// out of range offsets read nothing, errors of server fail only their reads
+void testErrors(const uint16_t port) {
+    BlockClient client("127.0.0.1", port, 0);
+    std::vector<char> buff(BlockClient::chunk_size);
+
+    // block index past end of file
+    size_t end = files["random"].size();
+    assert(client.read("random", end, buff.size(), buff.data()) == 0);
+    assert(client.read("random", end + 100 * BlockClient::chunk_size, 
+                       buff.size(), buff.data()) == 0);
+
+    // offset so large that offset + size overflows in a careless server
+    assert(client.read("random", uint64_t(-1) - 10, buff.size(), buff.data()) == 0);
+
+    assert(client.read("missing", 0, buff.size(), buff.data()) < 0);
+
+    // the connection is still usable
+    checkRead(client, "text", 0, 4096);
+}
+
+// reads checked against mtime and size of a file fail with ESTALE if it differs
+void testChecked(const uint16_t port) {
+    BlockClient client("127.0.0.1", port, 0);
+    const std::string& data = files["random"];
+    std::vector<char> buff(3 * BlockClient::chunk_size);
+
+    assert(client.read("random", 100, buff.size(), buff.data(), file_mtime, data.size()) == 
+           intmax_t(buff.size()));
+    assert(!memcmp(buff.data(), data.data() + 100, buff.size()));
+
+    assert(client.read("random", 0, buff.size(), buff.data(), file_mtime + 1, data.size()) == 
+           -ESTALE);
+    assert(client.read("random", 0, 100, buff.data(), file_mtime, data.size() - 1) == -ESTALE);
+
+    // the connection is still usable
+    checkRead(client, "random", 0, 4096);
+}
+
+// readers of many threads share one pipelined connection
+void testConcurrent(const uint16_t port) {
+    BlockClient client("127.0.0.1", port, 1);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 8; ++t)
+        threads.emplace_back([&client, t]() {
+            std::mt19937_64 random(t);
+            for (size_t i = 0; i < 50; ++i) {
+                const char* path = random() % 2? "random": "text";
+                size_t offset = random() % (files[path].size() + 1000);
+                size_t size = random() % (2 * BlockClient::chunk_size) + 1;
+                checkRead(client, path, offset, size);
+            }
+        });
+    for (auto& t: threads) t.join();
+}
+
+int main() {
+    std::mt19937_64 random(0);
+
+    std::string data(3 * 1024 * 1024 + 1234, 0);
+    for (auto& c: data) c = random();
+    files["random"] = data;
+
+    std::string text;
+    while (text.size() < 2 * 1024 * 1024) 
+        text += "line " + std::to_string(text.size() % 1000) + " of a compressible file\n";
+    files["text"] = text;
+
+    files["empty"] = "";
+
+    BlockServer server(readFile);
+    assert(!server.start("127.0.0.1", 0, 4));
+    assert(server.port());
+
+    testRaw(server.port());
+    testCompressed(server.port());
+    testErrors(server.port());
+    testChecked(server.port());
+    testConcurrent(server.port());
+
+    server.stop();
+    std::cout << "block_transfer_test ok" << std::endl;
+}
@@ -0,0 +1,153 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: path_index_test.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 19:35:52
+ *  Description: tests of PathIndex
+ *****************************************************************************/
+#include <map>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <iostream>
+#include "path_index.h"
+
+struct Node {
+    std::string name;
+};
+
+typedef PathIndex<Node> Index;
+
+// a table of the first size has this many slots
+static const size_t num_slots = 1024;
+
+static const Node* find(const Index& index, const uint64_t hash, const Node& node) {
+    bool ambiguous;
+    const Node* found = index.find(hash, node.name.data(), node.name.size(), ambiguous);
+    assert(!ambiguous);
+    return found;
+}
+
+// returns count hashes starting to probe at slot, in a table of num_slots slots
+static std::vector<uint64_t> hashesAt(const size_t slot, const size_t count, uint64_t& seed) {
+    std::vector<uint64_t> hashes;
+    while (hashes.size() < count)
+        if (Index::home(++seed, num_slots - 1) == slot) hashes.push_back(seed);
+    return hashes;
+}
+
+// a run of slots wraps from the end of table to its start, erasing entries
+// in it shifts back those after them, across the wrap too
+void testWrappedErase() {
+    uint64_t seed = 0;
+    std::vector<uint64_t> before_end = hashesAt(num_slots - 2, 1, seed);
+    std::vector<uint64_t> at_end = hashesAt(num_slots - 1, 3, seed);
+    std::vector<uint64_t> at_start = hashesAt(0, 2, seed);
+    std::vector<uint64_t> after = hashesAt(4, 1, seed);
+
+    // slots: 1022 before_end[0], 1023 at_end[0], 0 at_end[1], 1 at_end[2],
+    //        2 at_start[0], 3 at_start[1], 4 after[0], 5 nothing
+    std::vector<uint64_t> hashes;
+    for (auto group: { &before_end, &at_end, &at_start, &after })
+        hashes.insert(hashes.end(), group->begin(), group->end());
+
+    // erase each entry in turn from a fresh table, then the rest in order
+    for (size_t first = 0; first < hashes.size(); ++first) {
+        std::deque<Node> nodes(hashes.size());
+        Index index;
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            nodes[i].name = "node" + std::to_string(i);
+            index.insert(hashes[i], &nodes[i]);
+        }
+        assert(index.capacity() == num_slots);
+
+        std::vector<bool> erased(hashes.size());
+        for (size_t k = 0; k < hashes.size(); ++k) {
+            size_t i = (first + k) % hashes.size();
+            index.erase(hashes[i], &nodes[i]);
+            erased[i] = 1;
+            assert(index.size() == hashes.size() - k - 1);
+
+            for (size_t j = 0; j < hashes.size(); ++j)
+                assert(find(index, hashes[j], nodes[j]) == (erased[j]? nullptr: &nodes[j]));
+        }
+    }
+}
+
+// erasing an entry not in index changes nothing
+void testEraseMissing() {
+    uint64_t seed = 0;
+    std::vector<uint64_t> hashes = hashesAt(num_slots - 1, 3, seed);
+    Node nodes[4] = { { "a" }, { "b" }, { "c" }, { "d" } };
+
+    Index index;
+    for (size_t i = 0; i < 3; ++i) index.insert(hashes[i], &nodes[i]);
+
+    index.erase(hashes[0], &nodes[3]);
+    index.erase(12345, &nodes[0]);
+    assert(index.size() == 3);
+    for (size_t i = 0; i < 3; ++i) assert(find(index, hashes[i], nodes[i]) == &nodes[i]);
+}
+
+// nodes of the same hash and name can't be told apart
+void testAmbiguous() {
+    Node a = { "same" }, b = { "same" }, c = { "other" };
+    Index index;
+    index.insert(7, &a);
+    index.insert(7, &b);
+    index.insert(7, &c);
+
+    bool ambiguous;
+    assert(!index.find(7, "same", 4, ambiguous) && ambiguous);
+    assert(index.find(7, "other", 5, ambiguous) == &c && !ambiguous);
+
+    index.erase(7, &a);
+    assert(index.find(7, "same", 4, ambiguous) == &b && !ambiguous);
+}
+
+// random inserts and erases in a table growing past its first size,
+// with few distinct hashes so that runs are long and wrap
+void testRandom() {
+    std::mt19937_64 random(1);
+    std::deque<Node> nodes;
+    std::map<const Node*, uint64_t> inserted;
+    Index index;
+
+    for (size_t round = 0; round < 20000; ++round) {
+        if (inserted.empty() || random() % 3) {
+            nodes.push_back(Node{ "n" + std::to_string(nodes.size()) });
+            uint64_t hash = random() % 4096;
+            index.insert(hash, &nodes.back());
+            inserted[&nodes.back()] = hash;
+        } else {
+            auto ite = inserted.begin();
+            std::advance(ite, random() % inserted.size());
+            index.erase(ite->second, ite->first);
+            inserted.erase(ite);
+        }
+
+        if (round % 1000 == 0 || round == 19999) {
+            assert(index.size() == inserted.size());
+            for (const auto& entry: inserted) 
+                assert(find(index, entry.second, *entry.first) == entry.first);
+        }
+    }
+    assert(index.capacity() > num_slots);
+}
+
+int main() {
+    testWrappedErase();
+    testEraseMissing();
+    testAmbiguous();
+    testRandom();
+    std::cout << "path_index_test ok" << std::endl;
+}
@@ -0,0 +1,68 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: Group-Share Filesystem
+ *  Filename: thread_pool_test.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: Jul 28, 2015
+ *  Time: 14:20:36
+ *  Description: tests of ThreadPool and TaskGroup
+ *****************************************************************************/
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include "thread_pool.h"
+
+// tasks queued when the pool stops still run, and their group is done
+void testStopRunsQueued() {
+    ThreadPool pool;
+    pool.start(1);
+
+    std::atomic<size_t> done(0);
+    {
+        TaskGroup group(pool);
+        for (size_t i = 0; i < 100; ++i)
+            group.post([&done]() { ++done; });
+        pool.stop();
+        group.wait();
+    }
+    assert(done == 100);
+}
+
+// tasks posted to a pool never started are run by stop()
+void testStopWithoutThreads() {
+    ThreadPool pool;
+
+    std::atomic<size_t> done(0);
+    TaskGroup group(pool);
+    group.post([&done]() { ++done; });
+    pool.stop();
+    group.wait();
+    assert(done == 1);
+}
+
+// a stopped pool can be started again
+void testRestart() {
+    ThreadPool pool;
+    pool.start(2);
+    pool.stop();
+    pool.start(2);
+
+    std::atomic<size_t> done(0);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < 10; ++i)
+        group.post([&done]() { ++done; });
+    group.wait();
+    assert(done == 10);
+}
+
+int main() {
+    testStopRunsQueued();
+    testStopWithoutThreads();
+    testRestart();
+    std::cout << "thread_pool_test ok" << std::endl;
+}